@@ -2,54 +2,96 @@
 #include <stdlib.h>
 #include <string.h>
 #include "treasure.h"
+#include "treasure_score.h"
+#include "treasure_column.h"
+#include "treasure_filter.h"
+#include "treasure_users.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <hunt_id>\n", argv[0]);
-        return 1;
+// Adds up the hunt from its value columns instead of scores.dat
+static int score_columns(const char *hunt_id, ScoreTable *table) {
+    ColumnSet cols;
+    if (column_open(hunt_id, &cols) == -1) {
+        return -1;
+    }
+    int64_t *sums = calloc(cols.user_count ? cols.user_count : 1, sizeof(int64_t));
+    int64_t *counts = calloc(cols.user_count ? cols.user_count : 1, sizeof(int64_t));
+    int result = sums && counts ? 0 : -1;
+    if (result == 0) {
+        column_group_sum(cols.users, cols.values, cols.count, sums, counts);
+        // Names are looked up only for the users that own a treasure here
+        for (size_t i = 0; i < cols.user_count && result == 0; i++) {
+            if (counts[i] > 0) {
+                result = score_adjust(table, users_label((uint32_t)i), sums[i], counts[i]);
+            }
+        }
     }
+    free(sums);
+    free(counts);
+    column_close(&cols);
+    return result;
+}
+
+static int keep_match(const void *arg, const TreasureView *t) {
+    return FILTER_MATCH((const Filter *)arg, t);
+}
 
-    char path[256];
-    snprintf(path, sizeof(path), "%s/treasures.dat", argv[1]);
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        perror("fopen");
+int main(int argc, char *argv[]) {
+    const char *program = argv[0];
+    int columns = argc > 1 && strcmp(argv[1], "--columns") == 0;
+    if (columns) {
+        argv++;
+        argc--;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [--columns] <hunt_id> [top_n] [filter...]\n", program);
         return 1;
     }
 
-    Treasure t;
-    int user_count = 0;
-    struct {
-        char name[NAME_SIZE];
-        int score;
-    } users[100];
-
-    while (fread(&t, sizeof(Treasure), 1, file)) {
-        int found = 0;
-        for (int i = 0; i < user_count; ++i) {
-            if (strcmp(users[i].name, t.user_name) == 0) {
-                users[i].score += t.value;
-                found = 1;
-                break;
-            }
+    // top_n is the first extra argument when it is a number, the rest is
+    // a filter like value>=50 user!=bob
+    int first = 2;
+    size_t top_n = 0;
+    if (argc > 2 && argv[2][0] && strspn(argv[2], "0123456789") == strlen(argv[2])) {
+        top_n = strtoul(argv[2], NULL, 10);
+        first = 3;
+    }
+    int filtered = argc > first;
+    Filter filter;
+    if (filtered) {
+        char text[FILTER_TEXT_SIZE], error[128];
+        if (columns) {
+            fprintf(stderr, "Usage: %s [--columns] <hunt_id> [top_n] [filter...]\n"
+                    "--columns does not take a filter\n", program);
+            return 1;
+        }
+        if (filter_join(argc - first, argv + first, text, sizeof(text)) == -1) {
+            fprintf(stderr, "Filter too long\n");
+            return 1;
         }
-        if (!found && user_count < 100) {
-            strncpy(users[user_count].name, t.user_name, NAME_SIZE);
-            users[user_count].score = t.value;
-            ++user_count;
+        if (filter_parse(text, &filter, error, sizeof(error)) == -1) {
+            fprintf(stderr, "%s\n", error);
+            return 1;
         }
     }
-    fclose(file);
 
-    printf("Scores for hunt '%s':\n", argv[1]);
-    for (int i = 0; i < user_count; ++i) {
-        printf("  %s: %d points\n", users[i].name, users[i].score);
+    ScoreTable users;
+    if (score_init(&users) == -1) {
+        perror("score_init");
+        return 1;
+    }
+    // A filtered total is not what scores.dat holds, so it is always scanned
+    int result = columns ? score_columns(argv[1], &users) :
+                 filtered ? score_hunt_where(argv[1], &users, keep_match, &filter) :
+                 score_load_hunt(argv[1], &users);
+    if (result == -1) {
+        perror(columns ? "column_open" : filtered ? "score_hunt_where" : "score_load_hunt");
+        score_free(&users);
+        return 1;
     }
 
-    printf("score_calc done for hunt '%s'\n", argv[1]);
-    fflush(stderr);
-
+    score_print(stdout, argv[1], &users, top_n);
+    score_free(&users);
 
-    //fflush(stdout); // force flush in case output is buffered
+    fflush(stdout);
     return 0;
 }
@@ -5,6 +5,8 @@
 #define NAME_SIZE 64
 #define CLUE_SIZE 512
 
+#define TREASURE_FILE "treasures.dat"
+
 typedef struct {
     char id[ID_SIZE];
     char user_name[NAME_SIZE];
@@ -14,4 +16,8 @@ typedef struct {
     int value;
 } Treasure;
 
+// A removed treasure stays in treasures.dat with its ID cleared until the
+// hunt is compacted; every reader must skip these records
+#define TREASURE_IS_DEAD(t) ((t)->id[0] == '\0')
+
 #endif
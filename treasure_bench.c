@@ -0,0 +1,1083 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "treasure.h"
+#include "treasure_store.h"
+#include "treasure_score.h"
+#include "treasure_column.h"
+#include "treasure_proto.h"
+
+// End-to-end benchmark over hunts made by treasure_gen. Every command is
+// run the way a user runs it (a treasure_manager or score_calc process, or
+// a line typed into treasure_hub) and timed from start to finish; requests
+// meant to be in flight together are sent to treasure_monitor directly. The
+// value aggregates are also timed in process, the row scan against the columns.
+// Results are written as JSON, one result per line, and can be compared
+// against an earlier run.
+
+#define BENCH_MAX_HUNTS 4096
+#define BENCH_READ_SIZE (64 * 1024)
+#define HUB_PROMPT "hub> "
+#define FLIGHT_VIEWS 5          // view_treasure requests sent behind calculate_score
+
+typedef struct {
+    char name[64];
+    long runs;
+    double *samples_us;
+    double total_us;
+    long max_rss_kb;
+} Bench;
+
+typedef struct {
+    char id[NAME_MAX + 1];
+    long records;
+} BenchHunt;
+
+typedef struct {
+    pid_t pid;
+    pid_t monitor_pid;
+    int in_fd;            // our end of the hub's stdin
+    int out_fd;           // our end of the hub's stdout
+} HubSession;
+
+static char bin_dir[PATH_MAX];
+static BenchHunt hunts[BENCH_MAX_HUNTS];
+static int hunt_count;
+static long total_records;
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int bench_init(Bench *b, const char *name, long runs) {
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    b->runs = 0;
+    b->total_us = 0;
+    b->max_rss_kb = 0;
+    b->samples_us = malloc(runs * sizeof(double));
+    return b->samples_us != NULL;
+}
+
+static void bench_add(Bench *b, double us, long rss_kb) {
+    b->samples_us[b->runs++] = us;
+    b->total_us += us;
+    if (rss_kb > b->max_rss_kb) {
+        b->max_rss_kb = rss_kb;
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted samples
+static double percentile(const Bench *b, double p) {
+    if (b->runs == 0) {
+        return 0;
+    }
+    long rank = (long)(p / 100.0 * b->runs + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return b->samples_us[rank - 1];
+}
+
+// ---- the data set ----
+
+static int compare_hunt(const void *a, const void *b) {
+    return strcmp(((const BenchHunt *)a)->id, ((const BenchHunt *)b)->id);
+}
+
+// Live records of a hunt, or -1 if it can not be mapped
+static long live_records(const char *hunt_id) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        return -1;
+    }
+    long records = 0;
+    TreasureView t;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        records += !t.dead;
+    }
+    store_unmap(&map);
+    return records;
+}
+
+// Every directory with a treasures.dat, with its live record count. The
+// benchmark only removes from the end, so t0 .. t<records-1> are all live.
+static int load_hunts(void) {
+    DIR *dir = opendir(".");
+    if (!dir) {
+        perror("Error opening data directory");
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && hunt_count < BENCH_MAX_HUNTS) {
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", entry->d_name, TREASURE_FILE);
+        if (entry->d_name[0] == '.' || n < 0 || n >= (int)sizeof(path) || access(path, R_OK) == -1) {
+            continue;
+        }
+        long records = live_records(entry->d_name);
+        if (records > 0) {
+            snprintf(hunts[hunt_count].id, sizeof(hunts[hunt_count].id), "%s", entry->d_name);
+            hunts[hunt_count].records = records;
+            total_records += records;
+            hunt_count++;
+        }
+    }
+    closedir(dir);
+    qsort(hunts, hunt_count, sizeof(BenchHunt), compare_hunt);
+    return hunt_count > 0;
+}
+
+// ID of a random record; treasure_gen names them t0, t1, ...
+static void random_treasure(const BenchHunt *h, char *id, size_t size) {
+    snprintf(id, size, "t%ld", (long)(next_random() % (uint64_t)h->records));
+}
+
+// ---- one process per command ----
+
+// path = bin_dir/program, PATH_MAX bytes. Returns 0 if it does not fit.
+static int bin_path(char *path, const char *program) {
+    int n = snprintf(path, PATH_MAX, "%s/%s", bin_dir, program);
+    if (n < 0 || n >= PATH_MAX) {
+        fprintf(stderr, "Path of %s in '%s' is too long\n", program, bin_dir);
+        return 0;
+    }
+    return 1;
+}
+
+// Runs bin_dir/program with its output thrown away and input (if not
+// NULL, at most PIPE_BUF bytes) on its stdin. Returns the elapsed
+// microseconds and the peak RSS, or -1 if it could not run or failed.
+static double run_program_input(char *const argv[], const char *input, long *rss_kb) {
+    char path[PATH_MAX];
+    if (!bin_path(path, argv[0])) {
+        return -1;
+    }
+
+    // Small enough to sit in the pipe before the program starts
+    int in_pipe[2] = { -1, -1 };
+    if (input && (pipe(in_pipe) == -1 || write(in_pipe[1], input, strlen(input)) != (ssize_t)strlen(input))) {
+        perror("Error passing input");
+        return -1;
+    }
+    if (input) {
+        close(in_pipe[1]);
+    }
+
+    double start = now_us();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        if (input) {
+            dup2(in_pipe[0], STDIN_FILENO);
+            close(in_pipe[0]);
+        }
+        execv(path, argv);
+        _exit(127);
+    }
+    if (input) {
+        close(in_pipe[0]);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return -1;
+        }
+    }
+    double elapsed = now_us() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed (status %d)\n", argv[0], status);
+        return -1;
+    }
+    *rss_kb = usage.ru_maxrss;
+    return elapsed;
+}
+
+static double run_program(char *const argv[], long *rss_kb) {
+    return run_program_input(argv, NULL, rss_kb);
+}
+
+// Times one kind of manager/score_calc command over the hunts in turn.
+// fill() writes the arguments for run i into argv.
+static int bench_program(Bench *b, const char *name, long iterations,
+                         void (*fill)(long i, char **argv, char ids[][NAME_MAX + 1])) {
+    if (!bench_init(b, name, iterations)) {
+        return 0;
+    }
+    for (long i = 0; i < iterations; i++) {
+        char ids[2][NAME_MAX + 1];
+        char *argv[6];
+        fill(i, argv, ids);
+        long rss_kb = 0;
+        double us = run_program(argv, &rss_kb);
+        if (us < 0) {
+            return 0;
+        }
+        bench_add(b, us, rss_kb);
+    }
+    return 1;
+}
+
+static void fill_list(long i, char **argv, char ids[][NAME_MAX + 1]) {
+    snprintf(ids[0], NAME_MAX + 1, "%s", hunts[i % hunt_count].id);
+    argv[0] = "treasure_manager";
+    argv[1] = "--list";
+    argv[2] = ids[0];
+    argv[3] = NULL;
+}
+
+static void fill_view(long i, char **argv, char ids[][NAME_MAX + 1]) {
+    const BenchHunt *h = &hunts[i % hunt_count];
+    snprintf(ids[0], NAME_MAX + 1, "%s", h->id);
+    random_treasure(h, ids[1], NAME_MAX + 1);
+    argv[0] = "treasure_manager";
+    argv[1] = "--view";
+    argv[2] = ids[0];
+    argv[3] = ids[1];
+    argv[4] = NULL;
+}
+
+// Removes records from the end of each hunt, so the IDs left stay
+// t0 .. t<records-1> for the next run on the same data
+static void fill_remove(long i, char **argv, char ids[][NAME_MAX + 1]) {
+    const BenchHunt *h = &hunts[i % hunt_count];
+    snprintf(ids[0], NAME_MAX + 1, "%s", h->id);
+    snprintf(ids[1], NAME_MAX + 1, "t%ld", h->records - 1 - i / hunt_count);
+    argv[0] = "treasure_manager";
+    argv[1] = "--remove_treasure";
+    argv[2] = ids[0];
+    argv[3] = ids[1];
+    argv[4] = NULL;
+}
+
+static void fill_score(long i, char **argv, char ids[][NAME_MAX + 1]) {
+    snprintf(ids[0], NAME_MAX + 1, "%s", hunts[i % hunt_count].id);
+    argv[0] = "score_calc";
+    argv[1] = ids[0];
+    argv[2] = NULL;
+}
+
+static void fill_score_columns(long i, char **argv, char ids[][NAME_MAX + 1]) {
+    fill_score(i, argv, ids);
+    argv[1] = "--columns";
+    argv[2] = ids[0];
+    argv[3] = NULL;
+}
+
+// ---- concurrent writers (-S) ----
+
+#define STRESS_MAX_WRITERS 64
+#define STRESS_ADDS 25          // --add runs per writer
+#define STRESS_IMPORTS 2        // --import batches per writer
+#define STRESS_BATCH 5000       // treasures per batch
+
+// Forks a process that runs argv over and over until the stop pipe reads
+// EOF. Its failures (a scan racing a rewrite, say) are not the point, so
+// they are not reported.
+static pid_t start_reader(char *const argv[], const int stop[2]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int stop_fd = stop[0];
+        close(stop[1]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        fcntl(stop_fd, F_SETFL, O_NONBLOCK);
+        char c;
+        while (read(stop_fd, &c, 1) == -1 && errno == EAGAIN) {
+            long rss_kb;
+            run_program(argv, &rss_kb);
+        }
+        _exit(0);
+    }
+    if (pid == -1) {
+        perror("fork");
+    }
+    return pid;
+}
+
+// Body of writer process `writer`: STRESS_ADDS --add runs, or
+// STRESS_IMPORTS --import batches, each with IDs no other writer uses.
+// Exits with 0 if every run succeeded.
+static void run_writer(const char *hunt_id, int import, int writer) {
+    int failed = 0;
+    long rss_kb;
+    if (!import) {
+        for (int k = 0; k < STRESS_ADDS && !failed; k++) {
+            char input[128];
+            snprintf(input, sizeof(input), "w%da%d\nuser%d\n45.%04d\n25.%04d\nstress clue %d\n%d\n",
+                     writer, k, k % 100, k, writer, k, 1 + k % 100);
+            char *argv[] = { "treasure_manager", "--add", (char *)hunt_id, NULL };
+            failed = run_program_input(argv, input, &rss_kb) < 0;
+        }
+        _exit(failed);
+    }
+    char path[NAME_MAX + 1];
+    if (snprintf(path, sizeof(path), "%s.w%d.csv", hunt_id, writer) >= (int)sizeof(path)) {
+        _exit(1);
+    }
+    for (int round = 0; round < STRESS_IMPORTS && !failed; round++) {
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            perror("Error writing import file");
+            _exit(1);
+        }
+        for (int k = 0; k < STRESS_BATCH; k++) {
+            fprintf(f, "w%dr%dn%d,user%d,%.4f,%.4f,stress clue %d,%d\n", writer, round, k, k % 100,
+                    45.0 + k / 10000.0, 25.0 + writer / 100.0, k, 1 + k % 100);
+        }
+        failed = fclose(f) != 0;
+        char *argv[] = { "treasure_manager", "--import", (char *)hunt_id, path, NULL };
+        failed = failed || run_program(argv, &rss_kb) < 0;
+    }
+    unlink(path);
+    _exit(failed);
+}
+
+// One stress round: `writers` writer processes on a fresh hunt alongside a
+// --list, a --search and a --compact loop. Afterwards every treasure
+// written must be live. Sets *rate to treasures written per second and
+// returns 1, or 0 on a failed writer or a lost treasure.
+static int stress_round(int import, int writers, double *rate) {
+    char hunt_id[32];
+    snprintf(hunt_id, sizeof(hunt_id), "stress_%s_%d", import ? "import" : "add", writers);
+    long rss_kb;
+    char *remove[] = { "treasure_manager", "--remove_hunt", hunt_id, NULL };
+    if (access(hunt_id, F_OK) == 0 && run_program(remove, &rss_kb) < 0) {
+        return 0;
+    }
+    if (mkdir(hunt_id, 0755) == -1) {
+        perror("Error creating stress hunt");
+        return 0;
+    }
+
+    int stop[2];
+    if (pipe(stop) == -1) {
+        perror("pipe");
+        return 0;
+    }
+    char *list[] = { "treasure_manager", "--list", hunt_id, NULL };
+    char *search[] = { "treasure_manager", "--search", hunt_id, "stress", NULL };
+    char *compact[] = { "treasure_manager", "--compact", hunt_id, NULL };
+    pid_t readers[] = { start_reader(list, stop), start_reader(search, stop),
+                        start_reader(compact, stop) };
+    close(stop[0]);
+
+    double start = now_us();
+    pid_t pids[STRESS_MAX_WRITERS];
+    int started = 0, ok = 1;
+    for (; started < writers; started++) {
+        pids[started] = fork();
+        if (pids[started] == 0) {
+            close(stop[1]);
+            run_writer(hunt_id, import, started);
+        }
+        if (pids[started] == -1) {
+            perror("fork");
+            ok = 0;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        int status;
+        ok = waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+    double elapsed = now_us() - start;
+
+    close(stop[1]); // the readers finish their current run and leave
+    for (size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); i++) {
+        if (readers[i] > 0) {
+            waitpid(readers[i], NULL, 0);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: a writer failed\n", hunt_id);
+        return 0;
+    }
+
+    long expected = (long)writers * (import ? STRESS_IMPORTS * STRESS_BATCH : STRESS_ADDS);
+    long live = live_records(hunt_id);
+    *rate = expected / (elapsed / 1e6);
+    if (live != expected) {
+        fprintf(stderr, "%s: %ld treasures live, %ld written: treasures lost\n", hunt_id, live, expected);
+        return 0;
+    }
+    return 1;
+}
+
+// Runs the stress rounds for 1, 2, 4 .. max_writers writers and writes
+// the rates as JSON. Returns 1 if no round failed.
+static int stress(FILE *out, int max_writers) {
+    fprintf(out, "{\n  \"stress\": [\n");
+    int ok = 1;
+    for (int import = 0; import <= 1 && ok; import++) {
+        for (int writers = 1; writers <= max_writers && ok; writers *= 2) {
+            double rate = 0;
+            ok = stress_round(import, writers, &rate);
+            fprintf(stderr, "%-8s %2d writers  %10.1f inserts/s%s\n", import ? "--import" : "--add",
+                    writers, rate, ok ? "" : "  FAILED");
+            fprintf(out, "    {\"name\": \"stress_%s\", \"writers\": %d, \"inserts_per_s\": %.1f, \"ok\": %s}%s\n",
+                    import ? "import" : "add", writers, rate, ok ? "true" : "false",
+                    import && writers * 2 > max_writers ? "" : ",");
+        }
+    }
+    fprintf(out, "  ]\n}\n");
+    return ok;
+}
+
+// ---- value aggregates in process ----
+
+static volatile int64_t kernel_sink;   // keeps the results alive
+
+// Sum of the live values of a hunt, record by record from the store
+static void kernel_rows_sum(const char *hunt_id) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        return;
+    }
+    int64_t sum = 0;
+    TreasureView t;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        if (!t.dead) {
+            sum += t.value;
+        }
+    }
+    store_unmap(&map);
+    kernel_sink += sum;
+}
+
+// Per-user totals of a hunt from the store, what score_calc does
+static void kernel_rows_group(const char *hunt_id) {
+    ScoreTable table;
+    if (score_init(&table) == -1) {
+        return;
+    }
+    if (score_hunt(hunt_id, &table) == 0) {
+        kernel_sink += (int64_t)table.count;
+    }
+    score_free(&table);
+}
+
+static void kernel_columns_sum(const char *hunt_id) {
+    ColumnSet cols;
+    if (column_open(hunt_id, &cols) == 0) {
+        kernel_sink += column_sum(cols.values, cols.count);
+        column_close(&cols);
+    }
+}
+
+static void kernel_columns_group(const char *hunt_id) {
+    ColumnSet cols;
+    if (column_open(hunt_id, &cols) == -1) {
+        return;
+    }
+    int64_t *sums = calloc(cols.user_count + 1, sizeof(int64_t));
+    int64_t *counts = calloc(cols.user_count + 1, sizeof(int64_t));
+    if (sums && counts) {
+        column_group_sum(cols.users, cols.values, cols.count, sums, counts);
+        kernel_sink += sums[0];
+    }
+    free(sums);
+    free(counts);
+    column_close(&cols);
+}
+
+// Times one aggregate over the hunts in turn, with the given kernel set
+// (NULL: the best one, or the one TREASURE_SIMD asks for)
+static int bench_kernel(Bench *b, const char *name, long iterations, const char *isa,
+                        void (*kernel)(const char *hunt_id)) {
+    if (!bench_init(b, name, iterations)) {
+        return 0;
+    }
+    if (!isa) {
+        isa = getenv("TREASURE_SIMD") ? getenv("TREASURE_SIMD") : "avx2";
+    }
+    column_use_isa(isa);
+    for (long i = 0; i < iterations; i++) {
+        double start = now_us();
+        kernel(hunts[i % hunt_count].id);
+        double us = now_us() - start;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        bench_add(b, us, usage.ru_maxrss);
+    }
+    return 1;
+}
+
+// ---- the hub ----
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Reads the hub's output up to its next prompt. The first capture_size - 1
+// bytes are kept in capture if it is not NULL. Returns 1, or 0 if the hub
+// went away.
+static int hub_wait_prompt(HubSession *hub, char *capture, size_t capture_size) {
+    static char buf[BENCH_READ_SIZE];
+    size_t prompt_len = strlen(HUB_PROMPT);
+    char window[sizeof(HUB_PROMPT)];   // the last bytes seen, the prompt may span two reads
+    size_t window_len = 0;
+    size_t captured = 0;
+    while (1) {
+        ssize_t n = read(hub->out_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        if (capture && captured + 1 < capture_size) {
+            size_t keep = (size_t)n < capture_size - 1 - captured ? (size_t)n : capture_size - 1 - captured;
+            memcpy(capture + captured, buf, keep);
+            captured += keep;
+            capture[captured] = '\0';
+        }
+        if ((size_t)n >= prompt_len) {
+            memcpy(window, buf + n - prompt_len, prompt_len);
+            window_len = prompt_len;
+        } else {
+            size_t keep = window_len < prompt_len - n ? window_len : prompt_len - n;
+            memmove(window, window + window_len - keep, keep);
+            memcpy(window + keep, buf, n);
+            window_len = keep + n;
+        }
+        if (window_len == prompt_len && memcmp(window, HUB_PROMPT, prompt_len) == 0) {
+            return 1;
+        }
+    }
+}
+
+// Starts treasure_hub in the data directory and its monitor through it
+static int hub_start(HubSession *hub) {
+    // The hub starts ./treasure_monitor from the directory it works on
+    if (access("treasure_monitor", X_OK) == -1) {
+        char path[PATH_MAX];
+        if (!bin_path(path, "treasure_monitor")) {
+            return 0;
+        }
+        if (symlink(path, "treasure_monitor") == -1) {
+            perror("Error linking treasure_monitor into the data directory");
+            return 0;
+        }
+    }
+
+    char path[PATH_MAX];
+    if (!bin_path(path, "treasure_hub")) {
+        return 0;
+    }
+    int in_pipe[2], out_pipe[2];
+    if (pipe(in_pipe) == -1 || pipe(out_pipe) == -1) {
+        perror("pipe");
+        return 0;
+    }
+    hub->pid = fork();
+    if (hub->pid == -1) {
+        perror("fork");
+        return 0;
+    }
+    if (hub->pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        execl(path, "treasure_hub", NULL);
+        _exit(127);
+    }
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    hub->in_fd = in_pipe[1];
+    hub->out_fd = out_pipe[0];
+    hub->monitor_pid = 0;
+
+    char started[256];
+    if (!hub_wait_prompt(hub, NULL, 0) || !write_all(hub->in_fd, "start_monitor\n", 14) ||
+        !hub_wait_prompt(hub, started, sizeof(started))) {
+        fprintf(stderr, "treasure_hub did not start\n");
+        return 0;
+    }
+    const char *pid_text = strstr(started, "PID ");
+    if (pid_text) {
+        hub->monitor_pid = (pid_t)atoi(pid_text + 4);
+    }
+    return 1;
+}
+
+static void hub_stop(HubSession *hub) {
+    if (write_all(hub->in_fd, "stop_monitor\n", 13)) {
+        hub_wait_prompt(hub, NULL, 0);
+    }
+    // Let the monitor go before the hub does
+    for (int i = 0; i < 500 && hub->monitor_pid > 0 && kill(hub->monitor_pid, 0) == 0; i++) {
+        usleep(10000);
+    }
+    close(hub->in_fd); // the hub leaves at end of input
+    char buf[BENCH_READ_SIZE];
+    while (read(hub->out_fd, buf, sizeof(buf)) > 0) {
+    }
+    close(hub->out_fd);
+    waitpid(hub->pid, NULL, 0);
+}
+
+// Current resident set of the monitor, from /proc
+static long monitor_rss_kb(pid_t monitor_pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)monitor_pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    long rss = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+// The input for run i of a hub command: the command line and the answers
+// to any questions it asks
+static void hub_input(const char *command, long i, char *input, size_t size) {
+    const BenchHunt *h = &hunts[i % hunt_count];
+    char id[NAME_MAX + 1];
+    if (strcmp(command, "list_treasures") == 0) {
+        snprintf(input, size, "list_treasures %s 0\n", h->id); // the whole hunt, streamed
+    } else if (strcmp(command, "list_where") == 0) {
+        // treasure_gen values are 1..100, so this streams about 5% of the hunt
+        snprintf(input, size, "list_treasures %s 0 where value>=96\n", h->id);
+    } else if (strcmp(command, "list_page") == 0) {
+        // First page only: a longer hunt asks whether to go on
+        snprintf(input, size, h->records > 20 ? "list_treasures %s 20\nq\n" : "list_treasures %s 20\n", h->id);
+    } else if (strcmp(command, "view_treasure") == 0) {
+        random_treasure(h, id, sizeof(id));
+        snprintf(input, size, "view_treasure\n%s\n%s\n", h->id, id);
+    } else if (strcmp(command, "rank") == 0) {
+        snprintf(input, size, "rank user%ld\n", (long)(next_random() % 100));
+    } else if (strcmp(command, "near") == 0) {
+        // treasure_gen spreads each hunt over [45, 47] x [25, 27]
+        snprintf(input, size, "near %s %.4f %.4f 2000\n", h->id,
+                 45.0 + (double)(next_random() % 20000) / 10000.0,
+                 25.0 + (double)(next_random() % 20000) / 10000.0);
+    } else if (strcmp(command, "search") == 0) {
+        snprintf(input, size, "search %s old tree\n", h->id);
+    } else if (strcmp(command, "values") == 0) {
+        snprintf(input, size, "values %s\n", h->id);
+    } else {
+        snprintf(input, size, "%s\n", command);
+    }
+}
+
+static int bench_hub(HubSession *hub, Bench *b, const char *command, long iterations) {
+    char name[64];
+    snprintf(name, sizeof(name), "hub_%s", command);
+    if (!bench_init(b, name, iterations)) {
+        return 0;
+    }
+    char input[512];
+    // One untimed run, so the monitor has the data cached like it would in use
+    hub_input(command, 0, input, sizeof(input));
+    if (!write_all(hub->in_fd, input, strlen(input)) || !hub_wait_prompt(hub, NULL, 0)) {
+        return 0;
+    }
+    for (long i = 0; i < iterations; i++) {
+        hub_input(command, i, input, sizeof(input));
+        double start = now_us();
+        if (!write_all(hub->in_fd, input, strlen(input)) || !hub_wait_prompt(hub, NULL, 0)) {
+            fprintf(stderr, "treasure_hub stopped during %s\n", command);
+            return 0;
+        }
+        bench_add(b, now_us() - start, monitor_rss_kb(hub->monitor_pid));
+    }
+    return 1;
+}
+
+// ---- requests in flight ----
+
+// treasure_monitor started straight on two pipes, without the hub, which
+// waits for every answer before it sends the next request
+typedef struct {
+    pid_t pid;
+    int request_fd;
+    int response_fd;
+} MonitorSession;
+
+// workers, if not NULL, is passed on as TREASURE_MONITOR_WORKERS
+static int monitor_start(MonitorSession *m, const char *workers) {
+    char path[PATH_MAX];
+    if (!bin_path(path, "treasure_monitor")) {
+        return 0;
+    }
+    int request_pipe[2], response_pipe[2];
+    if (pipe(request_pipe) == -1 || pipe(response_pipe) == -1) {
+        perror("pipe");
+        return 0;
+    }
+    m->pid = fork();
+    if (m->pid == -1) {
+        perror("fork");
+        return 0;
+    }
+    if (m->pid == 0) {
+        close(request_pipe[1]);
+        close(response_pipe[0]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        if (workers) {
+            setenv("TREASURE_MONITOR_WORKERS", workers, 1);
+        }
+        char req_arg[16], resp_arg[16];
+        snprintf(req_arg, sizeof(req_arg), "%d", request_pipe[0]);
+        snprintf(resp_arg, sizeof(resp_arg), "%d", response_pipe[1]);
+        execl(path, "treasure_monitor", req_arg, resp_arg, NULL);
+        _exit(127);
+    }
+    close(request_pipe[0]);
+    close(response_pipe[1]);
+    m->request_fd = request_pipe[1];
+    m->response_fd = response_pipe[0];
+    return 1;
+}
+
+// The monitor answers what it has queued and leaves once its request
+// pipe is closed
+static void monitor_stop(MonitorSession *m) {
+    close(m->request_fd);
+    FrameHeader h;
+    char *payload;
+    while (proto_recv(m->response_fd, &h, &payload) == 1) {
+        free(payload);
+    }
+    close(m->response_fd);
+    waitpid(m->pid, NULL, 0);
+}
+
+// Sends calculate_score with every scores.dat removed, so it scans all the
+// hunts, and FLIGHT_VIEWS view_treasure requests right behind it without
+// waiting. Returns the microseconds until the last view is answered, or -1.
+static double views_behind_score(MonitorSession *m, long i) {
+    for (int k = 0; k < hunt_count; k++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", hunts[k].id, SCORE_FILE) < (int)sizeof(path)) {
+            unlink(path);
+        }
+    }
+    uint32_t first_id = (uint32_t)i * (FLIGHT_VIEWS + 1);
+    double start = now_us();
+    if (proto_send(m->request_fd, first_id, FRAME_REQUEST, "calculate_score", 15) == -1) {
+        return -1;
+    }
+    for (int v = 0; v < FLIGHT_VIEWS; v++) {
+        const BenchHunt *h = &hunts[(i + v) % hunt_count];
+        char id[NAME_MAX + 1], request[2 * NAME_MAX + 32];
+        random_treasure(h, id, sizeof(id));
+        int len = snprintf(request, sizeof(request), "view_treasure %s %s", h->id, id);
+        if (proto_send(m->request_fd, first_id + 1 + (uint32_t)v, FRAME_REQUEST, request, (size_t)len) == -1) {
+            return -1;
+        }
+    }
+
+    // The answers interleave; each request's END frame says it is done
+    int left = FLIGHT_VIEWS + 1, views_left = FLIGHT_VIEWS;
+    double views_us = -1;
+    while (left > 0) {
+        FrameHeader h;
+        char *payload;
+        if (proto_recv(m->response_fd, &h, &payload) != 1) {
+            return -1;
+        }
+        free(payload);
+        if (h.type == FRAME_END) {
+            left--;
+            if (h.request_id != first_id && --views_left == 0) {
+                views_us = now_us() - start;
+            }
+        }
+    }
+    return views_us;
+}
+
+static int bench_in_flight(Bench *b, const char *name, long iterations, const char *workers) {
+    if (!bench_init(b, name, iterations)) {
+        return 0;
+    }
+    MonitorSession m;
+    if (!monitor_start(&m, workers)) {
+        return 0;
+    }
+    // One untimed run fills the cache
+    int ok = views_behind_score(&m, 0) >= 0;
+    for (long i = 1; ok && i <= iterations; i++) {
+        double us = views_behind_score(&m, i);
+        ok = us >= 0;
+        if (ok) {
+            bench_add(b, us, monitor_rss_kb(m.pid));
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "treasure_monitor stopped during %s\n", name);
+    }
+    monitor_stop(&m);
+    return ok;
+}
+
+// ---- results ----
+
+static void write_results(FILE *out, const char *data_dir, long iterations, Bench *benches, int count) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"data_dir\": \"%s\",\n", data_dir);
+    fprintf(out, "  \"hunts\": %d,\n", hunt_count);
+    fprintf(out, "  \"records\": %ld,\n", total_records);
+    fprintf(out, "  \"iterations\": %ld,\n", iterations);
+    fprintf(out, "  \"results\": [\n");
+    for (int i = 0; i < count; i++) {
+        Bench *b = &benches[i];
+        qsort(b->samples_us, b->runs, sizeof(double), compare_double);
+        fprintf(out, "    {\"name\": \"%s\", \"runs\": %ld, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                "\"max_us\": %.1f, \"ops_per_s\": %.1f, \"max_rss_kb\": %ld}%s\n",
+                b->name, b->runs, percentile(b, 50), percentile(b, 99), percentile(b, 100),
+                b->total_us > 0 ? b->runs * 1e6 / b->total_us : 0.0, b->max_rss_kb,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Prints how each result moved against a baseline written by an earlier
+// run. Returns the number of p50 regressions beyond tolerance percent.
+static int compare_baseline(const char *path, Bench *benches, int count, double tolerance) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("Error opening baseline");
+        return -1;
+    }
+    int regressions = 0;
+    char line[512];
+    fprintf(stderr, "\n%-24s %12s %12s %8s %12s %12s %8s\n",
+            "benchmark", "base p50", "p50", "change", "base p99", "p99", "change");
+    while (fgets(line, sizeof(line), in)) {
+        char name[64];
+        long runs;
+        double p50, p99;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"runs\": %ld, \"p50_us\": %lf, \"p99_us\": %lf",
+                   name, &runs, &p50, &p99) != 4) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            Bench *b = &benches[i];
+            if (strcmp(b->name, name) != 0) {
+                continue;
+            }
+            double now50 = percentile(b, 50), now99 = percentile(b, 99);
+            double change50 = p50 > 0 ? (now50 - p50) / p50 * 100 : 0;
+            double change99 = p99 > 0 ? (now99 - p99) / p99 * 100 : 0;
+            int regressed = change50 > tolerance;
+            regressions += regressed;
+            fprintf(stderr, "%-24s %10.0fus %10.0fus %+7.1f%% %10.0fus %10.0fus %+7.1f%%%s\n",
+                    name, p50, now50, change50, p99, now99, change99, regressed ? "  REGRESSION" : "");
+        }
+    }
+    fclose(in);
+    return regressions;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s <data_dir> [-b bin_dir] [-k iterations] [-o results.json] "
+            "[-B baseline.json] [-t tolerance_percent]\n", name);
+    fprintf(stderr, "       %s <data_dir> -S max_writers [-b bin_dir] [-o results.json]\n"
+            "  (writers alongside readers on new hunts in data_dir, checking that nothing is lost)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 20;
+    const char *out_path = NULL, *baseline = NULL;
+    double tolerance = 10;
+    long max_writers = 0;
+    if (!getcwd(bin_dir, sizeof(bin_dir))) {
+        perror("getcwd");
+        return 1;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:k:o:B:t:S:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!realpath(optarg, bin_dir)) {
+                    perror("Error resolving bin_dir");
+                    return 1;
+                }
+                break;
+            case 'k': iterations = strtol(optarg, NULL, 10); break;
+            case 'o': out_path = optarg; break;
+            case 'B': baseline = optarg; break;
+            case 't': tolerance = strtod(optarg, NULL); break;
+            case 'S': max_writers = strtol(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || iterations < 1 || max_writers < 0 || max_writers > STRESS_MAX_WRITERS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Both paths are opened before moving into the data directory
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror("Error opening results file");
+        return 1;
+    }
+    char baseline_path[PATH_MAX];
+    if (baseline && !realpath(baseline, baseline_path)) {
+        perror("Error opening baseline");
+        return 1;
+    }
+
+    const char *data_dir = argv[optind];
+    if (chdir(data_dir) == -1) {
+        perror("Error entering data directory");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (max_writers > 0) {
+        int ok = stress(out, (int)max_writers);
+        if (out != stdout) {
+            fclose(out);
+        }
+        return ok ? 0 : 1;
+    }
+    if (!load_hunts()) {
+        fprintf(stderr, "No hunts in %s, create some with treasure_gen\n", data_dir);
+        return 1;
+    }
+    fprintf(stderr, "%d hunts, %ld treasures, %ld runs per benchmark\n", hunt_count, total_records, iterations);
+
+    // Bring every index up to date first, so no timed run pays for a
+    // rebuild and every run starts from the same state
+    for (int i = 0; i < hunt_count; i++) {
+        char *rebuild[] = { "treasure_manager", "--rebuild_index", hunts[i].id, NULL };
+        char *near[] = { "treasure_manager", "--near", hunts[i].id, "46", "26", "1", NULL };
+        char *search[] = { "treasure_manager", "--search", hunts[i].id, "old", NULL };
+        long rss_kb;
+        if (run_program(rebuild, &rss_kb) < 0 || run_program(near, &rss_kb) < 0 ||
+            run_program(search, &rss_kb) < 0) {
+            return 1;
+        }
+    }
+
+    static const char *hub_commands[] = {
+        "list_hunts", "list_treasures", "list_where", "list_page", "view_treasure", "calculate_score", "leaderboard",
+        "rank", "near", "search", "values", "stats",
+    };
+    int hub_count = sizeof(hub_commands) / sizeof(hub_commands[0]);
+    Bench benches[12 + sizeof(hub_commands) / sizeof(hub_commands[0])];
+    int count = 0;
+
+    // The first score_calc --columns run writes each hunt's values.col
+    int ok = bench_program(&benches[count++], "manager_list", iterations, fill_list) &&
+             bench_program(&benches[count++], "manager_view", iterations, fill_view) &&
+             bench_program(&benches[count++], "score_calc", iterations, fill_score) &&
+             bench_program(&benches[count++], "score_calc_columns", iterations, fill_score_columns);
+
+    ok = ok && bench_kernel(&benches[count++], "rows_sum", iterations, NULL, kernel_rows_sum) &&
+         bench_kernel(&benches[count++], "columns_sum_scalar", iterations, "scalar", kernel_columns_sum) &&
+         bench_kernel(&benches[count++], "columns_sum", iterations, NULL, kernel_columns_sum) &&
+         bench_kernel(&benches[count++], "rows_group", iterations, NULL, kernel_rows_group) &&
+         bench_kernel(&benches[count++], "columns_group", iterations, NULL, kernel_columns_group);
+
+    HubSession hub;
+    if (ok && (ok = hub_start(&hub))) {
+        for (int i = 0; ok && i < hub_count; i++) {
+            ok = bench_hub(&hub, &benches[count++], hub_commands[i], iterations);
+        }
+        hub_stop(&hub);
+    }
+
+    // The same requests in flight together, answered by the worker pool
+    // and by a single worker
+    ok = ok && bench_in_flight(&benches[count++], "views_behind_score", iterations, NULL) &&
+         bench_in_flight(&benches[count++], "views_behind_score_1w", iterations, "1");
+
+    // Last, as it changes the data
+    ok = ok && bench_program(&benches[count++], "manager_remove", iterations, fill_remove);
+    if (!ok) {
+        fprintf(stderr, "Benchmark aborted\n");
+        return 1;
+    }
+
+    write_results(out, data_dir, iterations, benches, count);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%-24s p50 %10.0fus  p99 %10.0fus  %8.1f ops/s  %7ld kB\n", benches[i].name,
+                percentile(&benches[i], 50), percentile(&benches[i], 99),
+                benches[i].runs * 1e6 / benches[i].total_us, benches[i].max_rss_kb);
+    }
+
+    int status = 0;
+    if (baseline) {
+        int regressions = compare_baseline(baseline_path, benches, count, tolerance);
+        if (regressions != 0) {
+            status = 2;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(benches[i].samples_us);
+    }
+    return status;
+}
@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "treasure.h"
+#include "treasure_index.h"
+#include "treasure_store.h"
+#include "treasure_cache.h"
+#include "treasure_lock.h"
+#include "treasure_stats.h"
+
+#define CACHE_MIN_SLOTS 16
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+// Events on the working directory that add or drop a hunt
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+// Events inside a hunt directory that may change its treasures.dat
+#define HUNT_EVENTS (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static CachedHunt **hunts;      // sorted by name
+static size_t hunt_count, hunt_capacity;
+static int notify_fd = -1;
+static int dir_watch = -1;      // watch on ".", -1 = rescan on every refresh
+static size_t budget_bytes;
+static size_t resident_bytes;
+static unsigned long clock_tick;
+static unsigned long scan_generation;
+
+static uint32_t hash_id(const char *id) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < ID_SIZE && id[i]; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void drop_records(CachedHunt *h) {
+    if (!h->records) {
+        return;
+    }
+    free(h->records);
+    free(h->strings);
+    free(h->slots);
+    h->records = NULL;
+    h->strings = NULL;
+    h->slots = NULL;
+    h->count = 0;
+    h->slot_count = 0;
+    resident_bytes -= h->bytes;
+    h->bytes = 0;
+}
+
+// treasures.dat changed: forget everything derived from it
+static void invalidate(CachedHunt *h) {
+    drop_records(h);
+    h->counted = 0;
+    h->generation++;
+}
+
+// Position of name in the sorted list, or where it would be inserted
+static size_t find_position(const char *name, int *found) {
+    size_t lo = 0, hi = hunt_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcmp(hunts[mid]->name, name);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = 0;
+    return lo;
+}
+
+static CachedHunt *lookup(const char *name) {
+    int found;
+    size_t i = find_position(name, &found);
+    return found ? hunts[i] : NULL;
+}
+
+static CachedHunt *add_hunt(const char *name) {
+    int found;
+    size_t i = find_position(name, &found);
+    if (found) {
+        return hunts[i];
+    }
+    if (strlen(name) > NAME_MAX) {
+        return NULL;
+    }
+    if (hunt_count == hunt_capacity) {
+        size_t cap = hunt_capacity ? hunt_capacity * 2 : 64;
+        CachedHunt **grown = realloc(hunts, cap * sizeof(CachedHunt *));
+        if (!grown) {
+            return NULL;
+        }
+        hunts = grown;
+        hunt_capacity = cap;
+    }
+    CachedHunt *h = calloc(1, sizeof(CachedHunt));
+    if (!h) {
+        return NULL;
+    }
+    strcpy(h->name, name);
+    h->generation = 1;
+    h->watch = notify_fd == -1 ? -1 : inotify_add_watch(notify_fd, name, HUNT_EVENTS);
+
+    memmove(&hunts[i + 1], &hunts[i], (hunt_count - i) * sizeof(CachedHunt *));
+    hunts[i] = h;
+    hunt_count++;
+    return h;
+}
+
+static void remove_at(size_t i) {
+    CachedHunt *h = hunts[i];
+    if (h->watch != -1) {
+        inotify_rm_watch(notify_fd, h->watch);
+    }
+    drop_records(h);
+    free(h);
+    memmove(&hunts[i], &hunts[i + 1], (hunt_count - i - 1) * sizeof(CachedHunt *));
+    hunt_count--;
+}
+
+static int is_directory(const struct dirent *entry) {
+    struct stat st;
+    if (entry->d_type == DT_DIR) {
+        return 1;
+    }
+    return entry->d_type == DT_UNKNOWN && stat(entry->d_name, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Brings the hunt list in line with the directory: new hunts are added,
+// vanished ones dropped. Used at start, without a watch and on overflow.
+static int rescan(void) {
+    DIR *dir = opendir(".");
+    if (!dir) {
+        return -1;
+    }
+    scan_generation++;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || !is_directory(entry)) {
+            continue;
+        }
+        CachedHunt *h = add_hunt(entry->d_name);
+        if (h) {
+            h->scan_mark = scan_generation;
+        }
+    }
+    closedir(dir);
+
+    for (size_t i = hunt_count; i-- > 0; ) {
+        if (hunts[i]->scan_mark != scan_generation) {
+            remove_at(i);
+        }
+    }
+    return 0;
+}
+
+static size_t budget_from_env(void) {
+    const char *env = getenv("TREASURE_CACHE_MB");
+    long mb = env ? atol(env) : 0;
+    if (mb <= 0) {
+        mb = DEFAULT_CACHE_MB;
+    }
+    return (size_t)mb * 1024 * 1024;
+}
+
+int cache_init(size_t budget) {
+    budget_bytes = budget ? budget : budget_from_env();
+
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd != -1) {
+        dir_watch = inotify_add_watch(notify_fd, ".", DIR_EVENTS);
+    }
+    if (notify_fd == -1 || dir_watch == -1) {
+        perror("inotify, hunts are revalidated with stat()");
+    }
+    return rescan();
+}
+
+void cache_free(void) {
+    while (hunt_count > 0) {
+        remove_at(hunt_count - 1);
+    }
+    free(hunts);
+    hunts = NULL;
+    hunt_capacity = 0;
+    if (notify_fd != -1) {
+        close(notify_fd);
+    }
+    notify_fd = -1;
+    dir_watch = -1;
+}
+
+static CachedHunt *hunt_for_watch(int wd) {
+    for (size_t i = 0; i < hunt_count; i++) {
+        if (hunts[i]->watch == wd) {
+            return hunts[i];
+        }
+    }
+    return NULL;
+}
+
+static void handle_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost: trust nothing
+        for (size_t i = 0; i < hunt_count; i++) {
+            invalidate(hunts[i]);
+        }
+        rescan();
+        return;
+    }
+
+    if (ev->wd == dir_watch) {
+        if (!(ev->mask & IN_ISDIR) || ev->len == 0) {
+            return;
+        }
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_hunt(ev->name);
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            int found;
+            size_t i = find_position(ev->name, &found);
+            if (found) {
+                remove_at(i);
+            }
+        }
+        return;
+    }
+
+    CachedHunt *h = hunt_for_watch(ev->wd);
+    if (!h) {
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        // The directory went away or the watch was dropped
+        h->watch = -1;
+        invalidate(h);
+    } else if (ev->len > 0 && store_is_data_file(ev->name)) {
+        invalidate(h);
+    }
+}
+
+void cache_refresh(void) {
+    if (dir_watch == -1) {
+        rescan();
+    }
+    if (notify_fd == -1) {
+        return;
+    }
+
+    char buf[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(notify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break; // EAGAIN: drained
+        }
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+// Hunts without a watch are checked against the file's size and mtime
+static void revalidate(CachedHunt *h) {
+    if (h->watch != -1 || !h->counted) {
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", h->name, TREASURE_FILE);
+    struct stat st;
+    int has_data = stat(path, &st) == 0;
+    if (has_data != h->has_data ||
+        (has_data && (st.st_size != h->stamp_size ||
+                      st.st_mtim.tv_sec != h->stamp_mtime.tv_sec ||
+                      st.st_mtim.tv_nsec != h->stamp_mtime.tv_nsec))) {
+        invalidate(h);
+    }
+}
+
+// Stats treasures.dat and remembers its stamp. Returns 1 if it exists.
+static int stamp_hunt(CachedHunt *h) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", h->name, TREASURE_FILE);
+    struct stat st;
+    h->has_data = stat(path, &st) == 0;
+    if (h->has_data) {
+        h->stamp_size = st.st_size;
+        h->stamp_mtime = st.st_mtim;
+    }
+    return h->has_data;
+}
+
+// Live and dead records of each segment, and where a load puts them
+typedef struct {
+    size_t live;
+    size_t dead;
+    size_t string_bytes;
+    size_t first_record;
+    size_t first_string;
+} SegmentCount;
+
+typedef struct {
+    CachedHunt *hunt;
+    SegmentCount *counts;
+    int with_strings;
+} CountJob;
+
+static void count_segment(const TreasureMap *map, size_t segment, void *arg) {
+    CountJob *job = arg;
+    SegmentCount *c = &job->counts[segment];
+    TreasureView t;
+    for (size_t pos = 0; store_next_in(map, segment, &pos, &t); ) {
+        if (t.dead) {
+            c->dead++;
+            continue;
+        }
+        c->live++;
+        if (job->with_strings) {
+            c->string_bytes += strlen(t.id) + strlen(t.user_name) + strlen(t.clue) + 3;
+        }
+    }
+}
+
+// Counts every segment in parallel. Returns the per-segment counts
+// (malloc'd) and the totals, or NULL if out of memory.
+static SegmentCount *count_segments(const TreasureMap *map, CachedHunt *h, int with_strings,
+                                    size_t *live, size_t *dead, size_t *string_bytes) {
+    CountJob job = { h, calloc(map->count ? map->count : 1, sizeof(SegmentCount)), with_strings };
+    if (!job.counts) {
+        return NULL;
+    }
+    store_scan(map, count_segment, &job);
+    *live = *dead = *string_bytes = 0;
+    for (size_t i = 0; i < map->count; i++) {
+        job.counts[i].first_record = *live;
+        job.counts[i].first_string = *string_bytes;
+        *live += job.counts[i].live;
+        *dead += job.counts[i].dead;
+        *string_bytes += job.counts[i].string_bytes;
+    }
+    return job.counts;
+}
+
+static void count_hunt(CachedHunt *h) {
+    h->live = 0;
+    h->dead = 0;
+    h->counted = 1;
+    if (!stamp_hunt(h)) {
+        return;
+    }
+    if (index_stats(h->name, &h->live, &h->dead) == 0) {
+        return;
+    }
+    // No usable index: count with a scan
+    HuntLock lock;
+    if (!hunt_lock(h->name, HUNT_READ, &lock)) {
+        return;
+    }
+    TreasureMap map;
+    if (store_map(h->name, &map, STORE_SCAN) == -1) {
+        hunt_unlock(&lock);
+        return;
+    }
+    size_t live, dead, string_bytes;
+    SegmentCount *counts = count_segments(&map, h, 0, &live, &dead, &string_bytes);
+    if (counts) {
+        h->live = (long)live;
+        h->dead = (long)dead;
+        free(counts);
+    }
+    stats_io(map.size, (uint64_t)(h->live + h->dead));
+    store_unmap(&map);
+    hunt_unlock(&lock);
+}
+
+CachedHunt **cache_hunts(size_t *count) {
+    for (size_t i = 0; i < hunt_count; i++) {
+        revalidate(hunts[i]);
+        if (!hunts[i]->counted) {
+            count_hunt(hunts[i]);
+        }
+    }
+    *count = hunt_count;
+    return hunts;
+}
+
+static uint32_t add_string(char *strings, size_t *used, const char *s) {
+    size_t len = strlen(s) + 1;
+    uint32_t off = (uint32_t)*used;
+    memcpy(strings + *used, s, len);
+    *used += len;
+    return off;
+}
+
+static void copy_segment(const TreasureMap *map, size_t segment, void *arg) {
+    CountJob *job = arg;
+    CachedHunt *h = job->hunt;
+    size_t n = job->counts[segment].first_record;
+    size_t used = job->counts[segment].first_string;
+    TreasureView t;
+    for (size_t pos = 0; store_next_in(map, segment, &pos, &t); ) {
+        if (t.dead) {
+            continue;
+        }
+        CachedTreasure *r = &h->records[n++];
+        r->id = add_string(h->strings, &used, t.id);
+        r->user_name = add_string(h->strings, &used, t.user_name);
+        r->clue = add_string(h->strings, &used, t.clue);
+        r->latitude = t.latitude;
+        r->longitude = t.longitude;
+        r->value = t.value;
+    }
+}
+
+// Copies the hunt's live records into contiguous arrays
+static int load_records_locked(CachedHunt *h) {
+    if (!stamp_hunt(h)) {
+        h->counted = 1;
+        h->live = h->dead = 0;
+        return -1;
+    }
+    TreasureMap map;
+    if (store_map(h->name, &map, STORE_SCAN) == -1) {
+        return -1;
+    }
+
+    // First pass sizes the arrays exactly and tells each segment where
+    // its records go
+    size_t live, dead, string_bytes;
+    SegmentCount *counts = count_segments(&map, h, 1, &live, &dead, &string_bytes);
+    if (!counts) {
+        store_unmap(&map);
+        errno = ENOMEM;
+        return -1;
+    }
+    stats_io(map.size, live + dead);
+    if (string_bytes > UINT32_MAX) {
+        free(counts);
+        store_unmap(&map);
+        errno = EFBIG;
+        return -1;
+    }
+
+    size_t slot_count = CACHE_MIN_SLOTS;
+    while (slot_count < live * 2) {
+        slot_count *= 2;
+    }
+    h->records = malloc((live ? live : 1) * sizeof(CachedTreasure));
+    h->strings = malloc(string_bytes ? string_bytes : 1);
+    h->slots = calloc(slot_count, sizeof(uint32_t));
+    if (!h->records || !h->strings || !h->slots) {
+        free(h->records);
+        free(h->strings);
+        free(h->slots);
+        h->records = NULL;
+        h->strings = NULL;
+        h->slots = NULL;
+        free(counts);
+        store_unmap(&map);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Second pass copies the segments in parallel, each into its own range
+    CountJob job = { h, counts, 1 };
+    store_scan(&map, copy_segment, &job);
+    free(counts);
+    store_unmap(&map);
+
+    size_t n = live;
+    size_t mask = slot_count - 1;
+    for (size_t i = 0; i < n; i++) {
+        size_t slot = hash_id(CACHE_STR(h, h->records[i].id)) & mask;
+        while (h->slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        h->slots[slot] = (uint32_t)(i + 1);
+    }
+
+    h->count = n;
+    h->slot_count = slot_count;
+    h->live = (long)live;
+    h->dead = (long)dead;
+    h->counted = 1;
+    h->bytes = (live ? live : 1) * sizeof(CachedTreasure) + (string_bytes ? string_bytes : 1) +
+               slot_count * sizeof(uint32_t);
+    resident_bytes += h->bytes;
+    return 0;
+}
+
+static int load_records(CachedHunt *h) {
+    HuntLock lock;
+    if (!hunt_lock(h->name, HUNT_READ, &lock)) {
+        return -1;
+    }
+    int ret = load_records_locked(h);
+    hunt_unlock(&lock);
+    return ret;
+}
+
+// Evicts least recently used hunts (never keep) until within budget
+static void enforce_budget(const CachedHunt *keep) {
+    while (resident_bytes > budget_bytes) {
+        CachedHunt *victim = NULL;
+        for (size_t i = 0; i < hunt_count; i++) {
+            CachedHunt *h = hunts[i];
+            if (h != keep && h->records && (!victim || h->last_used < victim->last_used)) {
+                victim = h;
+            }
+        }
+        if (!victim) {
+            break; // keep alone is over budget; it goes when the next hunt loads
+        }
+        drop_records(victim);
+    }
+}
+
+CachedHunt *cache_hunt(const char *name) {
+    CachedHunt *h = lookup(name);
+    if (!h) {
+        return NULL;
+    }
+    revalidate(h);
+    if (!h->records && load_records(h) == -1) {
+        return NULL;
+    }
+    h->last_used = ++clock_tick;
+    enforce_budget(h);
+    return h;
+}
+
+CachedHunt *cache_resident(const char *name) {
+    CachedHunt *h = lookup(name);
+    if (!h) {
+        return NULL;
+    }
+    revalidate(h);
+    if (!h->records) {
+        return NULL;
+    }
+    h->last_used = ++clock_tick;
+    return h;
+}
+
+const CachedTreasure *cache_find(const CachedHunt *hunt, const char *id) {
+    if (!hunt->records) {
+        return NULL;
+    }
+    size_t mask = hunt->slot_count - 1;
+    size_t slot = hash_id(id) & mask;
+    while (hunt->slots[slot] != 0) {
+        const CachedTreasure *r = &hunt->records[hunt->slots[slot] - 1];
+        if (strcmp(CACHE_STR(hunt, r->id), id) == 0) {
+            return r;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef TREASURE_CACHE_H
+#define TREASURE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>//for NAME_MAX
+#include <time.h>
+
+// In-memory copy of the hunts the monitor serves. The hunt list and each
+// hunt's live/removed counts are kept for every hunt; the records themselves
+// are loaded on first use and stay resident, least recently used hunts being
+// evicted whole once the memory budget is exceeded. inotify on the working
+// directory and on every hunt directory tells which hunts changed, so only
+// those are reloaded. The cache is not thread safe.
+
+#define DEFAULT_CACHE_MB 128
+
+// One live treasure; the strings are offsets into CachedHunt.strings
+typedef struct {
+    uint32_t id;
+    uint32_t user_name;
+    uint32_t clue;
+    float latitude;
+    float longitude;
+    int32_t value;
+} CachedTreasure;
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    int watch;                // inotify watch on the directory, -1 = none
+    int has_data;             // the directory holds a treasures.dat
+    int counted;              // live/dead/has_data are current
+    long live;
+    long dead;
+    off_t stamp_size;         // treasures.dat as of the last count, used to
+    struct timespec stamp_mtime; //   revalidate hunts without a watch
+
+    // Resident records (NULL while not loaded), in file order
+    CachedTreasure *records;
+    size_t count;
+    char *strings;
+    uint32_t *slots;          // ID hash table: record index + 1, 0 = empty
+    size_t slot_count;        // power of two
+    size_t bytes;             // memory charged to the budget
+    unsigned long last_used;
+    unsigned long scan_mark;  // last directory scan that saw the hunt
+    unsigned long generation; // bumped whenever treasures.dat changes
+} CachedHunt;
+
+#define CACHE_STR(hunt, off) ((hunt)->strings + (off))
+
+// Sets up the cache for the current directory. budget is in bytes; 0 takes
+// TREASURE_CACHE_MB from the environment (default DEFAULT_CACHE_MB).
+// Returns 0, or -1 if the directory can not be read.
+int cache_init(size_t budget);
+void cache_free(void);
+
+// Applies pending change notifications. Call before serving a command.
+void cache_refresh(void);
+
+// Every hunt directory, sorted by name, with counted metadata.
+// The array stays valid until the next cache call.
+CachedHunt **cache_hunts(size_t *count);
+
+// The hunt with its records resident, or NULL if it has no readable
+// treasure file. Valid until the next cache call.
+CachedHunt *cache_hunt(const char *name);
+
+// The hunt if its records are resident and current, or NULL; unlike
+// cache_hunt() it never loads them. Valid until the next cache call.
+CachedHunt *cache_resident(const char *name);
+
+// Live treasure with the given ID, or NULL
+const CachedTreasure *cache_find(const CachedHunt *hunt, const char *id);
+
+#endif
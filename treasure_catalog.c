@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "treasure.h"
+#include "treasure_store.h"
+#include "treasure_index.h"
+#include "treasure_lock.h"
+#include "treasure_catalog.h"
+
+#define CATALOG_MAGIC "TRCAT01"
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t entry_size;         // sizeof(CatalogEntry) when written
+    uint64_t reserved;
+} CatalogHeader;
+
+// The catalog is shared by every hunt, so it is guarded by the .lock of the
+// directory that holds the hunts, with the same record locks as a hunt
+#define CATALOG_DIR "."
+
+static int compare_entry(const void *a, const void *b) {
+    return strcmp(((const CatalogEntry *)a)->name, ((const CatalogEntry *)b)->name);
+}
+
+// The hunt as it is on disk now. Counts come from the index header when it
+// is current and from a scan otherwise.
+static void describe_hunt(const char *hunt_id, CatalogEntry *e) {
+    memset(e, 0, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", hunt_id);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return;
+    }
+    e->flags = CATALOG_HAS_DATA;
+    e->mtime_sec = st.st_mtim.tv_sec;
+    e->mtime_nsec = st.st_mtim.tv_nsec;
+
+    long live, dead;
+    if (index_stats(hunt_id, &live, &dead) == 0) {
+        e->live = live;
+        e->dead = dead;
+        return;
+    }
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        return;
+    }
+    TreasureView t;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        if (t.dead) {
+            e->dead++;
+        } else {
+            e->live++;
+        }
+    }
+    store_unmap(&map);
+}
+
+// Every hunt directory, sorted by name. d_type is only a hint: some
+// filesystems leave it DT_UNKNOWN, and then the entry is stat'ed.
+static long scan_hunts(CatalogEntry **entries) {
+    DIR *dir = opendir(CATALOG_DIR);
+    if (!dir) {
+        return -1;
+    }
+    size_t count = 0, capacity = 64;
+    CatalogEntry *list = malloc(capacity * sizeof(CatalogEntry));
+    struct dirent *entry;
+    while (list && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (entry->d_type != DT_DIR) {
+            struct stat st;
+            if (entry->d_type != DT_UNKNOWN || stat(entry->d_name, &st) == -1 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            CatalogEntry *bigger = realloc(list, capacity * sizeof(CatalogEntry));
+            if (!bigger) {
+                free(list);
+                list = NULL;
+                break;
+            }
+            list = bigger;
+        }
+        describe_hunt(entry->d_name, &list[count++]);
+    }
+    closedir(dir);
+    if (!list) {
+        errno = ENOMEM;
+        return -1;
+    }
+    qsort(list, count, sizeof(CatalogEntry), compare_entry);
+    *entries = list;
+    return (long)count;
+}
+
+// Reads the whole catalog; the caller holds the catalog lock
+static long read_catalog(CatalogEntry **entries) {
+    int fd = open(CATALOG_FILE, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    CatalogHeader h;
+    CatalogEntry *list = NULL;
+    size_t bytes = 0;
+    int ok = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             memcmp(h.magic, CATALOG_MAGIC, sizeof(h.magic)) == 0 &&
+             h.entry_size == sizeof(CatalogEntry);
+    if (ok) {
+        bytes = (size_t)h.count * sizeof(CatalogEntry);
+        list = malloc(bytes ? bytes : 1);
+        ok = list && read(fd, list, bytes) == (ssize_t)bytes;
+    }
+    close(fd);
+    if (!ok) {
+        free(list);
+        errno = EPROTO;
+        return -1;
+    }
+    *entries = list;
+    return (long)h.count;
+}
+
+// Replaces the catalog with the given sorted entries; caller holds the lock
+static int write_catalog(const CatalogEntry *entries, size_t count) {
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", CATALOG_FILE, (int)getpid());
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) {
+        return 0;
+    }
+    CatalogHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+    h.count = (uint32_t)count;
+    h.entry_size = sizeof(CatalogEntry);
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             (count == 0 || fwrite(entries, sizeof(CatalogEntry), count, f) == count);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temp_path, CATALOG_FILE) == -1) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// First catalog, from the hunts already there
+static int build_catalog(void) {
+    CatalogEntry *entries;
+    long count = scan_hunts(&entries);
+    if (count == -1) {
+        return 0;
+    }
+    int ok = write_catalog(entries, (size_t)count);
+    free(entries);
+    return ok;
+}
+
+// Position of name in the sorted entries, or where it would be inserted
+static size_t find_entry(const CatalogEntry *entries, size_t count, const char *name, int *found) {
+    size_t lo = 0, hi = count;
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(entries[mid].name, name);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Overwrites the entry in place when the hunt is already listed.
+// Returns 1 if it was, 0 if not, -1 on error.
+static int update_in_place(const CatalogEntry *e) {
+    int fd = open(CATALOG_FILE, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    CatalogHeader h;
+    if (fstat(fd, &st) == -1 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, CATALOG_MAGIC, sizeof(h.magic)) != 0 || h.entry_size != sizeof(CatalogEntry) ||
+        (size_t)st.st_size < sizeof(h) + (size_t)h.count * sizeof(CatalogEntry)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    if (h.count == 0) {
+        close(fd);
+        return 0;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    const CatalogEntry *entries = (const CatalogEntry *)((const char *)base + sizeof(h));
+    int found;
+    size_t i = find_entry(entries, h.count, e->name, &found);
+    munmap(base, (size_t)st.st_size);
+
+    int ret = 0;
+    if (found) {
+        off_t offset = (off_t)(sizeof(h) + i * sizeof(CatalogEntry));
+        ret = pwrite(fd, e, sizeof(*e), offset) == (ssize_t)sizeof(*e) ? 1 : -1;
+    }
+    close(fd);
+    return ret;
+}
+
+int catalog_update(const char *hunt_id) {
+    CatalogEntry e;
+    describe_hunt(hunt_id, &e);
+
+    HuntLock lock;
+    if (!hunt_lock(CATALOG_DIR, HUNT_REWRITE, &lock)) {
+        return 0;
+    }
+    int ok;
+    int updated = update_in_place(&e);
+    if (updated == 1) {
+        ok = 1;
+    } else if (updated == -1 && errno == ENOENT) {
+        ok = build_catalog();
+    } else {
+        // A new hunt (or a catalog that can not be read): rewrite it
+        CatalogEntry *entries = NULL;
+        long count = read_catalog(&entries);
+        if (count == -1) {
+            ok = build_catalog();
+        } else {
+            CatalogEntry *bigger = realloc(entries, ((size_t)count + 1) * sizeof(CatalogEntry));
+            ok = bigger != NULL;
+            if (ok) {
+                entries = bigger;
+                int found;
+                size_t i = find_entry(entries, (size_t)count, e.name, &found);
+                if (found) {
+                    entries[i] = e;
+                } else {
+                    memmove(&entries[i + 1], &entries[i], ((size_t)count - i) * sizeof(CatalogEntry));
+                    entries[i] = e;
+                    count++;
+                }
+                ok = write_catalog(entries, (size_t)count);
+            }
+            free(entries);
+        }
+    }
+    hunt_unlock(&lock);
+    if (!ok) {
+        perror("Error updating hunt catalog");
+    }
+    return ok;
+}
+
+int catalog_remove(const char *hunt_id) {
+    HuntLock lock;
+    if (!hunt_lock(CATALOG_DIR, HUNT_REWRITE, &lock)) {
+        return 0;
+    }
+    CatalogEntry *entries;
+    long count = read_catalog(&entries);
+    int ok;
+    if (count == -1) {
+        ok = build_catalog(); // the hunt is gone already, so the scan skips it
+    } else {
+        int found;
+        size_t i = find_entry(entries, (size_t)count, hunt_id, &found);
+        ok = 1;
+        if (found) {
+            memmove(&entries[i], &entries[i + 1], ((size_t)count - i - 1) * sizeof(CatalogEntry));
+            ok = write_catalog(entries, (size_t)count - 1);
+        }
+        free(entries);
+    }
+    hunt_unlock(&lock);
+    if (!ok) {
+        perror("Error updating hunt catalog");
+    }
+    return ok;
+}
+
+int catalog_rebuild(void) {
+    HuntLock lock;
+    if (!hunt_lock(CATALOG_DIR, HUNT_REWRITE, &lock)) {
+        return 0;
+    }
+    int ok = build_catalog();
+    hunt_unlock(&lock);
+    if (!ok) {
+        perror("Error writing hunt catalog");
+    }
+    return ok;
+}
+
+long catalog_read(CatalogEntry **entries) {
+    HuntLock lock;
+    if (!hunt_lock(CATALOG_DIR, HUNT_READ, &lock)) {
+        return -1;
+    }
+    long count = read_catalog(entries);
+    hunt_unlock(&lock);
+    return count;
+}
+
+static int same_entry(const CatalogEntry *a, const CatalogEntry *b) {
+    return a->flags == b->flags && a->live == b->live && a->dead == b->dead &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+long catalog_verify(FILE *out, int repair) {
+    HuntLock lock;
+    if (!hunt_lock(CATALOG_DIR, repair ? HUNT_REWRITE : HUNT_READ, &lock)) {
+        return -1;
+    }
+
+    CatalogEntry *found, *listed = NULL;
+    long found_count = scan_hunts(&found);
+    if (found_count == -1) {
+        hunt_unlock(&lock);
+        perror("Error scanning hunts");
+        return -1;
+    }
+    long listed_count = read_catalog(&listed);
+    long differences = 0;
+    if (listed_count == -1) {
+        fprintf(out, "No usable catalog (%s)\n", strerror(errno));
+        listed_count = 0;
+        differences++;
+    }
+
+    // Both lists are sorted by name: walk them side by side
+    long i = 0, j = 0;
+    while (i < found_count || j < listed_count) {
+        int cmp = i == found_count ? 1 : j == listed_count ? -1 : strcmp(found[i].name, listed[j].name);
+        if (cmp < 0) {
+            fprintf(out, "Hunt '%s' is missing from the catalog\n", found[i].name);
+            differences++;
+            i++;
+        } else if (cmp > 0) {
+            fprintf(out, "Hunt '%s' is in the catalog but does not exist\n", listed[j].name);
+            differences++;
+            j++;
+        } else {
+            if (!same_entry(&found[i], &listed[j])) {
+                fprintf(out, "Hunt '%s' is out of date: catalog has %lld treasures (%lld removed), "
+                        "hunt has %lld (%lld removed)\n", found[i].name,
+                        (long long)listed[j].live, (long long)listed[j].dead,
+                        (long long)found[i].live, (long long)found[i].dead);
+                differences++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    if (repair && differences > 0 && !write_catalog(found, (size_t)found_count)) {
+        perror("Error writing hunt catalog");
+        differences = -1;
+    }
+    hunt_unlock(&lock);
+    free(found);
+    free(listed);
+    return differences;
+}
@@ -0,0 +1,47 @@
+#ifndef TREASURE_CATALOG_H
+#define TREASURE_CATALOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+// Catalog of every hunt in the current directory, so listing the hunts is
+// one read instead of a readdir and a stat per directory. Entries are kept
+// sorted by name; a change to one hunt rewrites its entry in place, and
+// only creating or removing a hunt rewrites the file.
+#define CATALOG_FILE "hunts.cat"
+
+#define CATALOG_HAS_DATA 0x01    // the hunt has a treasures.dat
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t live;
+    int64_t dead;
+    int64_t mtime_sec;           // of treasures.dat
+    int64_t mtime_nsec;
+} CatalogEntry;
+
+// Sets the hunt's entry to its current counts and modification time,
+// adding it if needed. A missing catalog is first built from a full scan.
+// Returns 1, or 0 on error.
+int catalog_update(const char *hunt_id);
+
+// Drops the hunt's entry. Returns 1, or 0 on error.
+int catalog_remove(const char *hunt_id);
+
+// Rewrites the catalog from a scan of every hunt, for tools that create
+// many hunts at once. Returns 1, or 0 on error.
+int catalog_rebuild(void);
+
+// Every entry, sorted by name, in a malloc'd array. Returns the count, or
+// -1 if there is no catalog (or it can not be read).
+long catalog_read(CatalogEntry **entries);
+
+// Compares the catalog with the hunt directories and prints every
+// difference to out; with repair the catalog is rewritten from the scan.
+// Returns the number of differences, or -1 on error.
+long catalog_verify(FILE *out, int repair);
+
+#endif
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "treasure_column.h"
+#include "treasure_store.h"
+#include "treasure_score.h"
+#include "treasure_lock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLUMN_X86 1
+#include <immintrin.h>
+#endif
+
+#define COLUMN_MAGIC "TRCOLS02"
+#define COLUMN_MIN_CAPACITY 1024
+
+// values.col: this header, then the user column and the value column,
+// count entries each. Version 01 files also held a private dictionary and
+// are rebuilt like stale ones.
+typedef struct {
+    char magic[8];
+    DataStamp stamp;       // treasures.dat the columns were built from
+    uint64_t count;
+    uint64_t user_count;   // every users.dict ID in the user column is below this
+} ColumnFileHeader;
+
+#define ISA_SCALAR 0
+#define ISA_SSE41  1
+#define ISA_AVX2   2
+
+static const char *isa_names[] = { "scalar", "sse4.1", "avx2" };
+
+static void column_path(char *buf, size_t size, const char *hunt_id) {
+    snprintf(buf, size, "%s/%s", hunt_id, COLUMN_FILE);
+}
+
+// ---- building ----
+
+// One segment's share of the columns, built by its own store_scan call
+typedef struct {
+    uint32_t *users;
+    int32_t *values;
+    size_t count;
+    uint32_t user_count;   // every ID in users is below this
+    int failed;
+} ColumnPart;
+
+static void build_segment(const TreasureMap *map, size_t segment, void *arg) {
+    ColumnPart *part = &((ColumnPart *)arg)[segment];
+    size_t capacity = 0;
+    TreasureView t;
+    for (size_t pos = 0; store_next_in(map, segment, &pos, &t); ) {
+        if (t.dead) {
+            continue;
+        }
+        if (part->count == capacity) {
+            capacity = capacity ? capacity * 2 : COLUMN_MIN_CAPACITY;
+            uint32_t *users = realloc(part->users, capacity * sizeof(uint32_t));
+            part->users = users ? users : part->users;
+            int32_t *values = realloc(part->values, capacity * sizeof(int32_t));
+            part->values = values ? values : part->values;
+            if (!users || !values) {
+                part->failed = 1;
+                return;
+            }
+        }
+        // v1 and v2 records name their user; the column wants the ID
+        uint32_t user = t.user_id != USER_NONE ? t.user_id : users_intern(t.user_name);
+        if (user == USER_NONE) {
+            part->failed = 1;
+            return;
+        }
+        part->users[part->count] = user;
+        part->values[part->count] = t.value;
+        part->user_count = user >= part->user_count ? user + 1 : part->user_count;
+        part->count++;
+    }
+}
+
+// Builds the file image of the hunt's columns in memory (malloc'd), the
+// segments scanned in parallel and joined in order. Returns 0, or -1 if
+// the hunt can not be read.
+static int build_columns(const char *hunt_id, const DataStamp *stamp, char **image, size_t *size) {
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        return -1;
+    }
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        hunt_unlock(&lock);
+        return -1;
+    }
+    size_t part_count = map.count;
+    ColumnPart *parts = calloc(part_count ? part_count : 1, sizeof(ColumnPart));
+    if (parts) {
+        store_scan(&map, build_segment, parts);
+    }
+    store_unmap(&map);
+    hunt_unlock(&lock);
+
+    int ok = parts != NULL;
+    size_t count = 0;
+    uint32_t user_count = 0;
+    for (size_t i = 0; ok && i < part_count; i++) {
+        ok = !parts[i].failed;
+        count += parts[i].count;
+        user_count = parts[i].user_count > user_count ? parts[i].user_count : user_count;
+    }
+
+    *size = sizeof(ColumnFileHeader) + count * (sizeof(uint32_t) + sizeof(int32_t));
+    *image = ok ? malloc(*size) : NULL;
+    if (*image) {
+        ColumnFileHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, COLUMN_MAGIC, sizeof(h.magic));
+        h.stamp = *stamp;
+        h.count = count;
+        h.user_count = user_count;
+        memcpy(*image, &h, sizeof(h));
+        uint32_t *users = (uint32_t *)(*image + sizeof(h));
+        int32_t *values = (int32_t *)(users + count);
+        for (size_t i = 0; i < part_count; i++) {
+            memcpy(users, parts[i].users, parts[i].count * sizeof(uint32_t));
+            memcpy(values, parts[i].values, parts[i].count * sizeof(int32_t));
+            users += parts[i].count;
+            values += parts[i].count;
+        }
+    }
+    for (size_t i = 0; parts && i < part_count; i++) {
+        free(parts[i].users);
+        free(parts[i].values);
+    }
+    free(parts);
+    if (!*image) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Writers in the same process (monitor workers) get temp files of their own
+static _Atomic unsigned temp_serial;
+
+static int write_columns(const char *hunt_id, const char *image, size_t size) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    column_path(path, sizeof(path), hunt_id);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.%u.tmp", hunt_id, COLUMN_FILE, (int)getpid(),
+             atomic_fetch_add(&temp_serial, 1));
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int ok = write(fd, image, size) == (ssize_t)size;
+    close(fd);
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Points cols at the columns in a file image. Returns 0, or -1 if the
+// image is corrupt or was built from another version of the data.
+static int attach(ColumnSet *cols, char *image, size_t size, const DataStamp *expected) {
+    ColumnFileHeader h;
+    if (size < sizeof(h)) {
+        return -1;
+    }
+    memcpy(&h, image, sizeof(h));
+    if (memcmp(h.magic, COLUMN_MAGIC, sizeof(h.magic)) != 0 || !score_same_stamp(&h.stamp, expected) ||
+        h.user_count > USER_NONE || h.count > size / 8 || sizeof(h) + h.count * 8 != size) {
+        return -1;
+    }
+    char *p = image + sizeof(h);
+    cols->users = (const uint32_t *)p;
+    p += h.count * sizeof(uint32_t);
+    cols->values = (const int32_t *)p;
+    cols->count = h.count;
+    cols->user_count = h.user_count;
+    for (size_t i = 0; i < cols->count; i++) {
+        if (cols->users[i] >= cols->user_count) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Maps values.col if it matches the data. Returns 0, or -1.
+static int map_columns(const char *hunt_id, const DataStamp *stamp, ColumnSet *cols) {
+    char path[PATH_MAX];
+    column_path(path, sizeof(path), hunt_id);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(ColumnFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    if (attach(cols, addr, (size_t)st.st_size, stamp) == -1) {
+        munmap(addr, (size_t)st.st_size);
+        return -1;
+    }
+    madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+    cols->addr = addr;
+    cols->size = (size_t)st.st_size;
+    cols->mapped = 1;
+    return 0;
+}
+
+int column_open(const char *hunt_id, ColumnSet *cols) {
+    memset(cols, 0, sizeof(*cols));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+    if (access(path, R_OK) == -1) {
+        return -1;
+    }
+
+    DataStamp stamp;
+    score_stamp(hunt_id, &stamp);
+    if (map_columns(hunt_id, &stamp, cols) == 0) {
+        return 0;
+    }
+
+    // Missing or stale: build the columns from a scan under the append
+    // lock, which keeps removes out (like score_load_hunt: a remove can
+    // leave the stamp as it was)
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+        return -1;
+    }
+    score_stamp(hunt_id, &stamp);
+    if (map_columns(hunt_id, &stamp, cols) == 0) {
+        hunt_unlock(&lock); // another reader built them while this one waited
+        return 0;
+    }
+    char *image;
+    size_t size;
+    int built = build_columns(hunt_id, &stamp, &image, &size) == 0;
+    if (built) {
+        write_columns(hunt_id, image, size);
+    }
+    hunt_unlock(&lock);
+    if (!built) {
+        return -1;
+    }
+    attach(cols, image, size, &stamp);
+    cols->addr = image;
+    cols->size = size;
+    return 0;
+}
+
+void column_close(ColumnSet *cols) {
+    if (cols->mapped) {
+        munmap(cols->addr, cols->size);
+    } else {
+        free(cols->addr);
+    }
+    memset(cols, 0, sizeof(*cols));
+}
+
+long column_user(const ColumnSet *cols, const char *user_name) {
+    uint32_t id = users_find(user_name);
+    return id == USER_NONE || id >= cols->user_count ? -1 : (long)id;
+}
+
+// ---- kernels ----
+
+static void stats_init(ColumnStats *out) {
+    out->count = 0;
+    out->sum = 0;
+    out->min = INT32_MAX;
+    out->max = INT32_MIN;
+}
+
+static void stats_scalar(const int32_t *values, size_t n, ColumnStats *out) {
+    stats_init(out);
+    for (size_t i = 0; i < n; i++) {
+        int32_t v = values[i];
+        out->sum += v;
+        out->min = v < out->min ? v : out->min;
+        out->max = v > out->max ? v : out->max;
+    }
+    out->count = (int64_t)n;
+}
+
+static void user_stats_scalar(const uint32_t *users, const int32_t *values, size_t n, uint32_t user,
+                              ColumnStats *out) {
+    stats_init(out);
+    for (size_t i = 0; i < n; i++) {
+        if (users[i] == user) {
+            int32_t v = values[i];
+            out->count++;
+            out->sum += v;
+            out->min = v < out->min ? v : out->min;
+            out->max = v > out->max ? v : out->max;
+        }
+    }
+}
+
+#ifdef COLUMN_X86
+// The vector loops leave the last n % width values to the scalar code;
+// the partial results are then combined lane by lane.
+
+__attribute__((target("sse4.1")))
+static void stats_sse41(const int32_t *values, size_t n, ColumnStats *out) {
+    __m128i sum = _mm_setzero_si128();
+    __m128i min = _mm_set1_epi32(INT32_MAX);
+    __m128i max = _mm_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(v));
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+        min = _mm_min_epi32(min, v);
+        max = _mm_max_epi32(max, v);
+    }
+    stats_scalar(values + i, n - i, out);
+    int64_t sums[2];
+    int32_t mins[4], maxs[4];
+    _mm_storeu_si128((__m128i *)sums, sum);
+    _mm_storeu_si128((__m128i *)mins, min);
+    _mm_storeu_si128((__m128i *)maxs, max);
+    out->count = (int64_t)n;
+    out->sum += sums[0] + sums[1];
+    for (int k = 0; k < 4; k++) {
+        out->min = mins[k] < out->min ? mins[k] : out->min;
+        out->max = maxs[k] > out->max ? maxs[k] : out->max;
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void user_stats_sse41(const uint32_t *users, const int32_t *values, size_t n, uint32_t user,
+                             ColumnStats *out) {
+    __m128i target = _mm_set1_epi32((int32_t)user);
+    __m128i count = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    __m128i min_fill = _mm_set1_epi32(INT32_MAX), max_fill = _mm_set1_epi32(INT32_MIN);
+    __m128i min = min_fill, max = max_fill;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i u = _mm_loadu_si128((const __m128i *)(users + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i match = _mm_cmpeq_epi32(u, target);   // all ones where the user matches
+        __m128i kept = _mm_and_si128(v, match);
+        count = _mm_sub_epi32(count, match);
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(kept));
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(_mm_srli_si128(kept, 8)));
+        min = _mm_min_epi32(min, _mm_blendv_epi8(min_fill, v, match));
+        max = _mm_max_epi32(max, _mm_blendv_epi8(max_fill, v, match));
+    }
+    user_stats_scalar(users + i, values + i, n - i, user, out);
+    int64_t sums[2];
+    uint32_t counts[4];
+    int32_t mins[4], maxs[4];
+    _mm_storeu_si128((__m128i *)sums, sum);
+    _mm_storeu_si128((__m128i *)counts, count);
+    _mm_storeu_si128((__m128i *)mins, min);
+    _mm_storeu_si128((__m128i *)maxs, max);
+    out->sum += sums[0] + sums[1];
+    for (int k = 0; k < 4; k++) {
+        out->count += counts[k];
+        out->min = mins[k] < out->min ? mins[k] : out->min;
+        out->max = maxs[k] > out->max ? maxs[k] : out->max;
+    }
+}
+
+__attribute__((target("avx2")))
+static void stats_avx2(const int32_t *values, size_t n, ColumnStats *out) {
+    __m256i sum = _mm256_setzero_si256();
+    __m256i min = _mm256_set1_epi32(INT32_MAX);
+    __m256i max = _mm256_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+        min = _mm256_min_epi32(min, v);
+        max = _mm256_max_epi32(max, v);
+    }
+    stats_scalar(values + i, n - i, out);
+    int64_t sums[4];
+    int32_t mins[8], maxs[8];
+    _mm256_storeu_si256((__m256i *)sums, sum);
+    _mm256_storeu_si256((__m256i *)mins, min);
+    _mm256_storeu_si256((__m256i *)maxs, max);
+    out->count = (int64_t)n;
+    out->sum += sums[0] + sums[1] + sums[2] + sums[3];
+    for (int k = 0; k < 8; k++) {
+        out->min = mins[k] < out->min ? mins[k] : out->min;
+        out->max = maxs[k] > out->max ? maxs[k] : out->max;
+    }
+}
+
+__attribute__((target("avx2")))
+static void user_stats_avx2(const uint32_t *users, const int32_t *values, size_t n, uint32_t user,
+                            ColumnStats *out) {
+    __m256i target = _mm256_set1_epi32((int32_t)user);
+    __m256i count = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    __m256i min_fill = _mm256_set1_epi32(INT32_MAX), max_fill = _mm256_set1_epi32(INT32_MIN);
+    __m256i min = min_fill, max = max_fill;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i u = _mm256_loadu_si256((const __m256i *)(users + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+        __m256i match = _mm256_cmpeq_epi32(u, target);
+        __m256i kept = _mm256_and_si256(v, match);
+        count = _mm256_sub_epi32(count, match);
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(kept)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(kept, 1)));
+        min = _mm256_min_epi32(min, _mm256_blendv_epi8(min_fill, v, match));
+        max = _mm256_max_epi32(max, _mm256_blendv_epi8(max_fill, v, match));
+    }
+    user_stats_scalar(users + i, values + i, n - i, user, out);
+    int64_t sums[4];
+    uint32_t counts[8];
+    int32_t mins[8], maxs[8];
+    _mm256_storeu_si256((__m256i *)sums, sum);
+    _mm256_storeu_si256((__m256i *)counts, count);
+    _mm256_storeu_si256((__m256i *)mins, min);
+    _mm256_storeu_si256((__m256i *)maxs, max);
+    out->sum += sums[0] + sums[1] + sums[2] + sums[3];
+    for (int k = 0; k < 8; k++) {
+        out->count += counts[k];
+        out->min = mins[k] < out->min ? mins[k] : out->min;
+        out->max = maxs[k] > out->max ? maxs[k] : out->max;
+    }
+}
+#endif
+
+static int best_isa(void) {
+#ifdef COLUMN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return ISA_SSE41;
+    }
+#endif
+    return ISA_SCALAR;
+}
+
+static int isa_by_name(const char *name) {
+    for (int i = 0; i < (int)(sizeof(isa_names) / sizeof(isa_names[0])); i++) {
+        if (strcmp(isa_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static _Atomic int selected_isa = -1;
+
+static int current_isa(void) {
+    int isa = atomic_load_explicit(&selected_isa, memory_order_relaxed);
+    if (isa == -1) {
+        isa = best_isa();
+        const char *env = getenv("TREASURE_SIMD");
+        int wanted = env ? isa_by_name(env) : -1;
+        if (wanted != -1 && wanted < isa) {
+            isa = wanted;
+        }
+        atomic_store_explicit(&selected_isa, isa, memory_order_relaxed);
+    }
+    return isa;
+}
+
+const char *column_isa(void) {
+    return isa_names[current_isa()];
+}
+
+int column_use_isa(const char *name) {
+    int wanted = isa_by_name(name);
+    if (wanted == -1) {
+        return -1;
+    }
+    int best = best_isa();
+    atomic_store_explicit(&selected_isa, wanted < best ? wanted : best, memory_order_relaxed);
+    return 0;
+}
+
+void column_stats(const int32_t *values, size_t n, ColumnStats *out) {
+    switch (current_isa()) {
+#ifdef COLUMN_X86
+    case ISA_AVX2:
+        stats_avx2(values, n, out);
+        return;
+    case ISA_SSE41:
+        stats_sse41(values, n, out);
+        return;
+#endif
+    default:
+        stats_scalar(values, n, out);
+    }
+}
+
+void column_user_stats(const uint32_t *users, const int32_t *values, size_t n, uint32_t user,
+                       ColumnStats *out) {
+    switch (current_isa()) {
+#ifdef COLUMN_X86
+    case ISA_AVX2:
+        user_stats_avx2(users, values, n, user, out);
+        return;
+    case ISA_SSE41:
+        user_stats_sse41(users, values, n, user, out);
+        return;
+#endif
+    default:
+        user_stats_scalar(users, values, n, user, out);
+    }
+}
+
+int64_t column_sum(const int32_t *values, size_t n) {
+    ColumnStats s;
+    column_stats(values, n, &s);
+    return s.sum;
+}
+
+int32_t column_min(const int32_t *values, size_t n) {
+    ColumnStats s;
+    column_stats(values, n, &s);
+    return s.min;
+}
+
+int32_t column_max(const int32_t *values, size_t n) {
+    ColumnStats s;
+    column_stats(values, n, &s);
+    return s.max;
+}
+
+void column_group_sum(const uint32_t *users, const int32_t *values, size_t n,
+                      int64_t *sums, int64_t *counts) {
+    for (size_t i = 0; i < n; i++) {
+        sums[users[i]] += values[i];
+        counts[users[i]]++;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef TREASURE_COLUMN_H
+#define TREASURE_COLUMN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "treasure.h"
+
+// Columnar copy of the two fields the aggregates read, kept next to
+// treasures.dat: the value of every live treasure as a packed int32 column
+// and its owner as a uint32 column of users.dict IDs. A scan over them
+// reads 8 bytes per treasure instead of the whole record. Like scores.dat
+// the file remembers the data file stamp it was built from and is rebuilt
+// by the first reader after the hunt changed.
+#define COLUMN_FILE "values.col"
+
+// The columns of one hunt, mapped read-only
+typedef struct {
+    const int32_t *values;
+    const uint32_t *users;           // users.dict ID, one per value
+    size_t count;
+    size_t user_count;               // every ID in users is below this
+    void *addr;                      // the mapping or a malloc'd copy
+    size_t size;
+    int mapped;                      // addr is a mapping of values.col
+} ColumnSet;
+
+// Aggregates over a value column
+typedef struct {
+    int64_t count;
+    int64_t sum;
+    int32_t min;                     // INT32_MAX / INT32_MIN when count is 0
+    int32_t max;
+} ColumnStats;
+
+// Maps the hunt's columns, rebuilding values.col first if it is missing
+// or stale. Returns 0, or -1 if the hunt has no readable treasure file.
+int column_open(const char *hunt_id, ColumnSet *cols);
+void column_close(ColumnSet *cols);
+
+// users.dict ID of a user, or -1 if the user can own none of the treasures
+long column_user(const ColumnSet *cols, const char *user_name);
+
+// Kernels. Each has an AVX2, an SSE4.1 and a scalar version; the best one
+// the CPU supports is used, or the one TREASURE_SIMD (avx2, sse4.1 or
+// scalar) asks for if that is lower. Other CPUs always get the scalar one.
+int64_t column_sum(const int32_t *values, size_t n);
+int32_t column_min(const int32_t *values, size_t n);   // INT32_MAX for n = 0
+int32_t column_max(const int32_t *values, size_t n);   // INT32_MIN for n = 0
+void column_stats(const int32_t *values, size_t n, ColumnStats *out);
+
+// The same aggregates over the values whose user is `user`
+void column_user_stats(const uint32_t *users, const int32_t *values, size_t n, uint32_t user,
+                       ColumnStats *out);
+
+// Per-user sum and count: sums[users[i]] += values[i], counts[users[i]]++.
+// The arrays have user_count zeroed entries, one per ID. Scalar only: the
+// updates are scattered, which neither SSE nor AVX2 can store.
+void column_group_sum(const uint32_t *users, const int32_t *values, size_t n,
+                      int64_t *sums, int64_t *counts);
+
+// Name of the kernel set in use: "avx2", "sse4.1" or "scalar"
+const char *column_isa(void);
+
+// Switches to a kernel set by name, for benchmarks. A set the CPU lacks
+// falls back to the best one it has. Returns 0, or -1 for an unknown name.
+int column_use_isa(const char *name);
+
+#endif
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE // strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+#include "treasure_filter.h"
+
+#define OP_NONE 0
+#define OP_EQ   1
+#define OP_NE   2
+#define OP_LT   3
+#define OP_LE   4
+#define OP_GT   5
+#define OP_GE   6
+#define OP_IN   7
+#define OP_LIKE 8
+
+#define FIELD_SIZE 16
+
+// ---- match routines, from the most specialized ----
+
+static int match_all(const Filter *f, const TreasureView *t) {
+    (void)f;
+    (void)t;
+    return 1;
+}
+
+static int match_value(const Filter *f, const TreasureView *t) {
+    return t->value >= f->value_min && t->value <= f->value_max;
+}
+
+static int match_ranges(const Filter *f, const TreasureView *t) {
+    return t->value >= f->value_min && t->value <= f->value_max &&
+           t->latitude >= f->lat_min && t->latitude <= f->lat_max &&
+           t->longitude >= f->lon_min && t->longitude <= f->lon_max;
+}
+
+// v3 records compare the user ID, older ones the name
+static int same_user(const Filter *f, const TreasureView *t) {
+    if (t->user_id != USER_NONE) {
+        return t->user_id == f->user_id;
+    }
+    return strncmp(t->user_name, f->user_name, NAME_SIZE) == 0;
+}
+
+static int match_user(const Filter *f, const TreasureView *t) {
+    return same_user(f, t) == (f->user_op == FILTER_EQ);
+}
+
+static int match_general(const Filter *f, const TreasureView *t) {
+    return match_ranges(f, t) &&
+           (f->user_op == 0 || match_user(f, t)) &&
+           (f->id[0] == '\0' || strcmp(t->id, f->id) == 0) &&
+           (f->clue[0] == '\0' || strcasestr(t->clue, f->clue) != NULL);
+}
+
+// ---- parsing ----
+
+static const char *skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static int read_op(const char **p) {
+    static const struct { const char *text; int op; } ops[] = {
+        { "<=", OP_LE }, { ">=", OP_GE }, { "!=", OP_NE }, { "<", OP_LT },
+        { ">", OP_GT }, { "=", OP_EQ }, { "~", OP_LIKE },
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        size_t len = strlen(ops[i].text);
+        if (strncmp(*p, ops[i].text, len) == 0) {
+            *p += len;
+            return ops[i].op;
+        }
+    }
+    if (strncmp(*p, "in", 2) == 0 && ((*p)[2] == ' ' || (*p)[2] == '[')) {
+        *p += 2;
+        return OP_IN;
+    }
+    return OP_NONE;
+}
+
+// Copies one operand into buf: a "quoted" string, or everything up to the
+// next space. *len is set to its full length. Returns the position after
+// it, or NULL if it is empty or does not fit (it is never cut short).
+static const char *read_operand(const char *p, char *buf, size_t size, size_t *len) {
+    size_t n;
+    if (*p == '"') {
+        const char *end = strchr(p + 1, '"');
+        if (!end) {
+            *len = 0;
+            return NULL;
+        }
+        n = (size_t)(end - p - 1);
+        p++;
+    } else {
+        n = strcspn(p, " \t");
+    }
+    *len = n;
+    if (n == 0 || n >= size) {
+        return NULL;
+    }
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return p + n + (p[n] == '"');
+}
+
+// "[a,b]" with optional spaces. Returns the position after it, or NULL.
+static const char *read_range(const char *p, char *lo, char *hi, size_t size) {
+    if (*p++ != '[') {
+        return NULL;
+    }
+    p = skip_spaces(p);
+    size_t n = strcspn(p, ", \t]");
+    if (n == 0 || n >= size) {
+        return NULL;
+    }
+    snprintf(lo, size, "%.*s", (int)n, p);
+    p = skip_spaces(p + n);
+    if (*p++ != ',') {
+        return NULL;
+    }
+    p = skip_spaces(p);
+    n = strcspn(p, " \t]");
+    if (n == 0 || n >= size) {
+        return NULL;
+    }
+    snprintf(hi, size, "%.*s", (int)n, p);
+    p = skip_spaces(p + n);
+    return *p == ']' ? p + 1 : NULL;
+}
+
+// Values past int32 are clamped to one step outside it, which keeps their
+// meaning for every comparison and leaves room for the +-1 of < and >
+static int parse_int(const char *s, long long *out) {
+    char *end;
+    errno = 0;
+    long long x = strtoll(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0') {
+        return 0;
+    }
+    *out = x > INT32_MAX ? INT32_MAX + 1LL : x < INT32_MIN ? INT32_MIN - 1LL : x;
+    return 1;
+}
+
+static int parse_float(const char *s, float *out) {
+    char *end;
+    double d = strtod(s, &end);
+    *out = (float)d;
+    return end != s && *end == '\0' && isfinite(d);
+}
+
+// Narrows [*min, *max] by one integer comparison
+static int apply_int(int op, const char *a, const char *b, int32_t *min, int32_t *max) {
+    long long x, y = 0;
+    if (!parse_int(a, &x) || (op == OP_IN && !parse_int(b, &y))) {
+        return 0;
+    }
+    long long lo = INT32_MIN, hi = INT32_MAX;
+    switch (op) {
+        case OP_EQ: lo = hi = x; break;
+        case OP_LT: hi = x - 1; break;
+        case OP_LE: hi = x; break;
+        case OP_GT: lo = x + 1; break;
+        case OP_GE: lo = x; break;
+        case OP_IN: lo = x; hi = y; break;
+        default: return 0;
+    }
+    // A bound past int32 still means "none" or "all"
+    if (lo > *min) {
+        *min = lo > INT32_MAX ? INT32_MAX : (int32_t)lo;
+        if (lo > INT32_MAX) {
+            *max = INT32_MIN; // nothing can match
+        }
+    }
+    if (hi < *max) {
+        *max = hi < INT32_MIN ? INT32_MIN : (int32_t)hi;
+        if (hi < INT32_MIN) {
+            *min = INT32_MAX;
+        }
+    }
+    return 1;
+}
+
+// Same for a float field; strict bounds move to the next float
+static int apply_float(int op, const char *a, const char *b, float *min, float *max) {
+    float x, y = 0;
+    if (!parse_float(a, &x) || (op == OP_IN && !parse_float(b, &y))) {
+        return 0;
+    }
+    float lo = -FLT_MAX, hi = FLT_MAX;
+    switch (op) {
+        case OP_EQ: lo = hi = x; break;
+        case OP_LT: hi = nextafterf(x, -INFINITY); break;
+        case OP_LE: hi = x; break;
+        case OP_GT: lo = nextafterf(x, INFINITY); break;
+        case OP_GE: lo = x; break;
+        case OP_IN: lo = x; hi = y; break;
+        default: return 0;
+    }
+    *min = lo > *min ? lo : *min;
+    *max = hi < *max ? hi : *max;
+    return 1;
+}
+
+// Adds one predicate to f. Returns 0, or -1 with a message in error.
+static int apply(Filter *f, const char *field, int op, const char *a, const char *b,
+                 char *error, size_t error_size) {
+    int ok;
+    if (strcmp(field, "value") == 0) {
+        ok = apply_int(op, a, b, &f->value_min, &f->value_max);
+    } else if (strcmp(field, "lat") == 0 || strcmp(field, "latitude") == 0) {
+        ok = apply_float(op, a, b, &f->lat_min, &f->lat_max);
+    } else if (strcmp(field, "lon") == 0 || strcmp(field, "longitude") == 0) {
+        ok = apply_float(op, a, b, &f->lon_min, &f->lon_max);
+    } else if ((strcmp(field, "user") == 0 && strlen(a) >= sizeof(f->user_name)) ||
+               (strcmp(field, "id") == 0 && strlen(a) >= sizeof(f->id))) {
+        // Cut short it could match another user or ID that starts the same
+        snprintf(error, error_size, "Filter value for '%s' is longer than %zu characters", field,
+                 strcmp(field, "user") == 0 ? sizeof(f->user_name) - 1 : sizeof(f->id) - 1);
+        return -1;
+    } else if (strcmp(field, "user") == 0) {
+        ok = (op == OP_EQ || op == OP_NE) && f->user_op == 0;
+        if (ok) {
+            f->user_op = op == OP_EQ ? FILTER_EQ : FILTER_NE;
+            snprintf(f->user_name, sizeof(f->user_name), "%s", a);
+            f->user_id = users_find(f->user_name);
+        }
+    } else if (strcmp(field, "id") == 0) {
+        ok = op == OP_EQ && f->id[0] == '\0';
+        snprintf(f->id, sizeof(f->id), "%s", a);
+    } else if (strcmp(field, "clue") == 0) {
+        ok = op == OP_LIKE && f->clue[0] == '\0';
+        snprintf(f->clue, sizeof(f->clue), "%s", a);
+    } else {
+        snprintf(error, error_size, "Unknown filter field '%s' (value, lat, lon, user, id, clue)", field);
+        return -1;
+    }
+    if (!ok) {
+        snprintf(error, error_size, "Bad filter on '%s': numbers take = < <= > >= in [a,b], "
+                 "user = or != (once), id = (once), clue ~ (once)", field);
+        return -1;
+    }
+    return 0;
+}
+
+// Picks the match routine for the predicates f has
+static void compile(Filter *f) {
+    int value = f->value_min != INT32_MIN || f->value_max != INT32_MAX;
+    int geo = f->lat_min != -FLT_MAX || f->lat_max != FLT_MAX ||
+              f->lon_min != -FLT_MAX || f->lon_max != FLT_MAX;
+    int text = f->id[0] != '\0' || f->clue[0] != '\0';
+    if (text || (f->user_op != 0 && (value || geo))) {
+        f->match = match_general;
+    } else if (f->user_op != 0) {
+        f->match = match_user;
+    } else if (geo) {
+        f->match = match_ranges;
+    } else if (value) {
+        f->match = match_value;
+    } else {
+        f->match = match_all;
+    }
+}
+
+int filter_parse(const char *text, Filter *f, char *error, size_t error_size) {
+    memset(f, 0, sizeof(*f));
+    f->value_min = INT32_MIN;
+    f->value_max = INT32_MAX;
+    f->lat_min = f->lon_min = -FLT_MAX;
+    f->lat_max = f->lon_max = FLT_MAX;
+    f->user_id = USER_NONE;
+
+    const char *p = skip_spaces(text);
+    while (*p) {
+        char field[FIELD_SIZE];
+        size_t n = 0;
+        while (isalpha((unsigned char)*p) && n + 1 < sizeof(field)) {
+            field[n++] = (char)*p++;
+        }
+        field[n] = '\0';
+        if (isalpha((unsigned char)*p)) {
+            snprintf(error, error_size, "Filter field name too long near '%.40s' (value, lat, lon, user, id, clue)",
+                     p - n);
+            return -1;
+        }
+        p = skip_spaces(p);
+
+        char a[CLUE_SIZE], b[CLUE_SIZE] = "";
+        int op = n > 0 ? read_op(&p) : OP_NONE;
+        const char *next = NULL;
+        size_t len = 0;
+        if (op != OP_NONE) {
+            p = skip_spaces(p);
+            next = op == OP_IN ? read_range(p, a, b, sizeof(a)) : read_operand(p, a, sizeof(a), &len);
+        }
+        if (!next && len >= sizeof(a)) {
+            snprintf(error, error_size, "Filter value near '%.40s' is longer than %zu characters", p,
+                     sizeof(a) - 1);
+            return -1;
+        }
+        if (!next) {
+            snprintf(error, error_size, "Bad filter near '%.40s': expected field, operator and value", p);
+            return -1;
+        }
+        if (apply(f, field, op, a, b, error, error_size) == -1) {
+            return -1;
+        }
+        p = skip_spaces(next);
+    }
+    compile(f);
+    return 0;
+}
+
+int filter_join(int argc, char *const argv[], char *buf, size_t size) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < argc; i++) {
+        int n = snprintf(buf + used, size - used, "%s%s", i > 0 ? " " : "", argv[i]);
+        if (n < 0 || (size_t)n >= size - used) {
+            return -1;
+        }
+        used += (size_t)n;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef TREASURE_FILTER_H
+#define TREASURE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "treasure_store.h"
+
+// Record filters for listings and scores: space separated predicates that
+// must all hold, checked on each decoded record during the scan, before
+// anything is formatted.
+//   value=N  value<N  value<=N  value>N  value>=N  value in [a,b]
+//   lat, lon   (degrees) with the same operators
+//   user=NAME  user!=NAME  id=ID  clue~TEXT (case-insensitive substring,
+//   "quoted" if it has spaces)
+// Comparisons on one field fold into a single range, and the filter is
+// compiled into the cheapest match routine that covers its predicates.
+typedef struct Filter Filter;
+
+struct Filter {
+    int (*match)(const Filter *f, const TreasureView *t);
+    int32_t value_min, value_max;    // inclusive
+    float lat_min, lat_max;
+    float lon_min, lon_max;
+    int user_op;                     // 0 = any user, else FILTER_EQ / FILTER_NE
+    uint32_t user_id;                // users.dict ID of user_name, USER_NONE if it has none
+    char user_name[NAME_SIZE];
+    char id[ID_SIZE];                // "" = any
+    char clue[CLUE_SIZE];            // "" = any
+};
+
+#define FILTER_EQ 1
+#define FILTER_NE 2
+
+#define FILTER_TEXT_SIZE 512             // longest filter text accepted
+
+// Compiles text (may be empty: everything matches) into f. Returns 0, or
+// -1 with a message for the user in error.
+int filter_parse(const char *text, Filter *f, char *error, size_t error_size);
+
+// 1 if a live record passes the filter
+#define FILTER_MATCH(f, t) ((f)->match((f), (t)))
+
+// Joins argv[0..argc) with spaces, for filters given as program arguments
+// (a clue with spaces keeps its quotes inside one: 'clue~"old tree"').
+// Returns 0, or -1 if they do not fit in size bytes.
+int filter_join(int argc, char *const argv[], char *buf, size_t size);
+
+#endif
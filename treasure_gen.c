@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include "treasure.h"
+#include "treasure_store.h"
+#include "treasure_catalog.h"
+
+// Writes synthetic hunts for benchmarking: <dir>/hunt_0000, hunt_0001, ...
+// each holding a treasures.dat with IDs t0 .. t<records-1>. The same seed
+// always gives the same data, so runs stay comparable.
+
+#define GEN_BUFFER_SIZE (1024 * 1024)
+
+static const char *words[] = {
+    "old", "oak", "tree", "river", "stone", "bridge", "north", "south", "east", "west",
+    "under", "behind", "near", "red", "door", "hill", "cave", "well", "tower", "gate",
+    "church", "market", "garden", "fountain", "statue", "clock", "lamp", "bench", "wall", "road",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double random_unit(void) {
+    return (double)(next_random() >> 11) / (double)(1ull << 53);
+}
+
+// Words from the list, separated by spaces, up to length characters
+static void random_clue(char *clue, size_t length) {
+    size_t used = 0;
+    while (1) {
+        const char *w = words[next_random() % WORD_COUNT];
+        size_t len = strlen(w);
+        if (used + (used ? 1 : 0) + len > length) {
+            break;
+        }
+        if (used) {
+            clue[used++] = ' ';
+        }
+        memcpy(clue + used, w, len);
+        used += len;
+    }
+    clue[used] = '\0';
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int generate_hunt(const char *hunt_id, long records, long users, size_t clue_length) {
+    if (mkdir(hunt_id, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating hunt directory");
+        return 0;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "%s already exists, generate into an empty directory\n", path);
+        return 0;
+    }
+
+    int version;
+    int fd = store_open_append(hunt_id, &version);
+    if (fd == -1) {
+        perror("Error opening treasure file");
+        return 0;
+    }
+    char *buf = malloc(GEN_BUFFER_SIZE);
+    if (!buf) {
+        perror("Error allocating write buffer");
+        close(fd);
+        return 0;
+    }
+
+    // Points spread over about 100 km, so spatial queries find neighbours
+    double center_lat = 45.0 + random_unit() * 2.0;
+    double center_lon = 25.0 + random_unit() * 2.0;
+
+    int ok = 1;
+    size_t used = 0;
+    Treasure t;
+    memset(&t, 0, sizeof(t));
+    for (long i = 0; ok && i < records; i++) {
+        snprintf(t.id, sizeof(t.id), "t%ld", i);
+        snprintf(t.user_name, sizeof(t.user_name), "user%ld", (long)(next_random() % (uint64_t)users));
+        t.latitude = (float)(center_lat + random_unit() - 0.5);
+        t.longitude = (float)(center_lon + random_unit() - 0.5);
+        random_clue(t.clue, clue_length);
+        t.value = 1 + (int)(next_random() % 100);
+
+        if (used + RECORD_MAX_SIZE > GEN_BUFFER_SIZE) {
+            ok = write_all(fd, buf, used);
+            used = 0;
+            fd = ok ? store_roll(hunt_id, fd, &version) : fd;
+            ok = fd != -1;
+        }
+        size_t len = store_encode(&t, version, buf + used);
+        ok = len > 0;
+        used += len;
+    }
+    if (ok) {
+        ok = write_all(fd, buf, used);
+    }
+    if (!ok) {
+        perror("Error writing treasure file");
+    }
+    free(buf);
+    if (fd != -1) {
+        close(fd);
+    }
+    return ok;
+}
+
+static int register_users(long users) {
+    char (*names)[NAME_SIZE] = calloc((size_t)users, NAME_SIZE);
+    uint32_t *ids = malloc((size_t)users * sizeof(uint32_t));
+    int ok = names && ids;
+    for (long i = 0; ok && i < users; i++) {
+        snprintf(names[i], NAME_SIZE, "user%ld", i);
+    }
+    ok = ok && users_intern_all((const char (*)[NAME_SIZE])names, (size_t)users, ids) == 0;
+    free(names);
+    free(ids);
+    return ok;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s <dir> [-H hunts] [-n records_per_hunt] [-u users] [-c clue_length] [-s seed]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    long hunts = 10, records = 1000, users = 100, clue_length = 40;
+    unsigned long long seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:n:u:c:s:")) != -1) {
+        switch (opt) {
+            case 'H': hunts = strtol(optarg, NULL, 10); break;
+            case 'n': records = (long)strtod(optarg, NULL); break; // accepts 1e6
+            case 'u': users = strtol(optarg, NULL, 10); break;
+            case 'c': clue_length = strtol(optarg, NULL, 10); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || hunts < 1 || records < 1 || users < 1 ||
+        clue_length < 1 || clue_length >= CLUE_SIZE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *dir = argv[optind];
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating output directory");
+        return 1;
+    }
+    if (chdir(dir) == -1) {
+        perror("Error entering output directory");
+        return 1;
+    }
+
+    // Every user in users.dict up front, in order and with one sync,
+    // instead of one append per new user while the records are written
+    if (!register_users(users)) {
+        perror("Error writing users.dict");
+        return 1;
+    }
+
+    rng_state = seed * 0x9E3779B97F4A7C15ull + 1;
+    for (long h = 0; h < hunts; h++) {
+        char hunt_id[32];
+        snprintf(hunt_id, sizeof(hunt_id), "hunt_%04ld", h);
+        if (!generate_hunt(hunt_id, records, users, (size_t)clue_length)) {
+            return 1;
+        }
+    }
+    if (!catalog_rebuild()) {
+        return 1;
+    }
+    printf("Generated %ld hunts of %ld treasures in %s\n", hunts, records, dir);
+    return 0;
+}
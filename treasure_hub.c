@@ -8,25 +8,36 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+#include "treasure_proto.h"
 
 #define HUB_INPUT_SIZE 256
-#define COMMAND_FILE ".monitor_command"
-#define RESPONSE_FILE ".monitor_response"
+#define HUB_PAGE_SIZE 20      // treasures per list_treasures page
 
 volatile pid_t monitor_pid = 0;
 volatile bool monitor_running = false;
 volatile bool waiting_for_monitor = false;
+int request_fd = -1;    // REQUEST frames to the monitor
+int response_fd = -1;   // DATA/END frames from the monitor
+uint32_t next_request_id = 1;
 
 // Function prototypes
 void handle_sigchld(int sig);
 void start_monitor();
 void stop_monitor();
 void list_hunts();
-void list_treasures();
+void list_treasures(const char *args);
 void view_treasure();
-void calculate_score();
+void calculate_score(const char *top_n);
+void leaderboard(const char *top_n);
+void rank(const char *user_name);
+void near_treasures(const char *args);
+void search_treasures(const char *args);
+void show_values(const char *args);
+void show_stats(const char *args);
 void send_command_to_monitor(const char *cmd, const char *arg);
-void read_monitor_response();
+void send_paged_command(const char *cmd, const char *arg, char *next_cursor, size_t cursor_size);
+void read_monitor_response(uint32_t request_id, char *next_cursor, size_t cursor_size);
 void setup_signal_handlers();
 
 // Signal handler for SIGCHLD
@@ -39,6 +50,9 @@ void handle_sigchld(int sig) {
         monitor_running = false;
         monitor_pid = 0;
         waiting_for_monitor = false;
+        close(request_fd);
+        close(response_fd);
+        request_fd = response_fd = -1;
         
         if (WIFEXITED(status)) {
             printf("\nMonitor process terminated with status %d\n", WEXITSTATUS(status));
@@ -49,36 +63,50 @@ void handle_sigchld(int sig) {
 }
 
 // Start the monitor process
-int pipefd[2];
-
 void start_monitor() {
     if (monitor_running) {
         printf("Monitor is already running\n");
         return;
     }
 
-    if (pipe(pipefd) == -1) {
+    int request_pipe[2], response_pipe[2];
+    if (pipe(request_pipe) == -1) {
+        perror("pipe");
+        return;
+    }
+    if (pipe(response_pipe) == -1) {
         perror("pipe");
+        close(request_pipe[0]);
+        close(request_pipe[1]);
         return;
     }
 
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork");
+        close(request_pipe[0]);
+        close(request_pipe[1]);
+        close(response_pipe[0]);
+        close(response_pipe[1]);
         return;
     }
 
     if (pid == 0) {
-        // Child: monitor
-        close(pipefd[0]); // close read end
-        //dup2(pipefd[1], STDOUT_FILENO); // send stdout to pipe
-        close(pipefd[1]);
-        execl("./treasure_monitor", "treasure_monitor", NULL);
+        // Child: monitor reads requests and writes responses
+        close(request_pipe[1]);
+        close(response_pipe[0]);
+        char req_arg[16], resp_arg[16];
+        snprintf(req_arg, sizeof(req_arg), "%d", request_pipe[0]);
+        snprintf(resp_arg, sizeof(resp_arg), "%d", response_pipe[1]);
+        execl("./treasure_monitor", "treasure_monitor", req_arg, resp_arg, NULL);
         perror("execl");
         exit(EXIT_FAILURE);
     } else {
-        // Parent: hub
-        close(pipefd[1]); // we only read from the pipe
+        // Parent: hub writes requests and reads responses
+        close(request_pipe[0]);
+        close(response_pipe[1]);
+        request_fd = request_pipe[1];
+        response_fd = response_pipe[0];
         monitor_pid = pid;
         monitor_running = true;
         printf("Monitor started with PID %d\n", pid);
@@ -112,19 +140,66 @@ void list_hunts() {
     send_command_to_monitor("list_hunts", NULL);
 }
 
-// Send list_treasures command to monitor
-void list_treasures() {
+// List a hunt's treasures a page at a time: "list_treasures [hunt
+// [page_size [cursor]]] [where filter]". A page size of 0 streams the
+// whole hunt at once. The filter goes along with every page request and
+// is applied by the monitor, so pages hold only matches.
+void list_treasures(const char *args) {
     if (!monitor_running) {
         printf("No monitor is running\n");
         return;
     }
     
-    printf("Enter hunt ID: ");
-    char hunt_id[HUB_INPUT_SIZE];
-    fgets(hunt_id, HUB_INPUT_SIZE, stdin);
-    hunt_id[strcspn(hunt_id, "\n")] = '\0'; // Remove newline
-    
-    send_command_to_monitor("list_treasures", hunt_id);
+    char hunt_id[HUB_INPUT_SIZE] = "";
+    char cursor[HUB_INPUT_SIZE] = "";
+    char where[HUB_INPUT_SIZE] = "";
+    long page_size = HUB_PAGE_SIZE;
+    if (args && *args) {
+        const char *filter = strncmp(args, "where ", 6) == 0 ? args : strstr(args, " where ");
+        if (filter) {
+            // keeps the leading " where " (added if the line starts with the filter)
+            snprintf(where, sizeof(where), "%s%s", filter == args ? " " : "", filter);
+        }
+        char head[HUB_INPUT_SIZE];
+        snprintf(head, sizeof(head), "%.*s", filter ? (int)(filter - args) : (int)strlen(args), args);
+        sscanf(head, "%255s %ld %255s", hunt_id, &page_size, cursor);
+    } else {
+        printf("Enter hunt ID: ");
+        if (!fgets(hunt_id, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        hunt_id[strcspn(hunt_id, "\n")] = '\0'; // Remove newline
+    }
+    if (hunt_id[0] == '\0') {
+        printf("Error: no hunt ID given\n");
+        return;
+    }
+
+    char arg[HUB_INPUT_SIZE * 3];
+    if (page_size <= 0) {
+        if (snprintf(arg, sizeof(arg), "%s%s", hunt_id, where) >= (int)sizeof(arg)) {
+            printf("Error: list_treasures arguments are too long\n");
+            return;
+        }
+        send_command_to_monitor("list_treasures", arg);
+        return;
+    }
+    while (monitor_running) {
+        if (snprintf(arg, sizeof(arg), "%s %ld %s%s", hunt_id, page_size, cursor, where) >= (int)sizeof(arg)) {
+            printf("Error: list_treasures arguments are too long\n");
+            return;
+        }
+        send_paged_command("list_treasures", arg, cursor, sizeof(cursor));
+        if (cursor[0] == '\0') {
+            break; // last page
+        }
+        printf("Enter for the next page, q to stop: ");
+        fflush(stdout);
+        char answer[HUB_INPUT_SIZE];
+        if (!fgets(answer, HUB_INPUT_SIZE, stdin) || answer[0] == 'q') {
+            break;
+        }
+    }
 }
 
 // Send view_treasure command to monitor
@@ -151,46 +226,150 @@ void view_treasure() {
 }
 
 
-void calculate_score() {
-    send_command_to_monitor("calculate_score", NULL);
+// Optional top_n limits every hunt's block to its best players
+void calculate_score(const char *top_n) {
+    send_command_to_monitor("calculate_score", top_n && *top_n ? top_n : NULL);
 }
 
+// Best players over all hunts, 10 unless top_n is given (0 = all)
+void leaderboard(const char *top_n) {
+    send_command_to_monitor("leaderboard", top_n && *top_n ? top_n : NULL);
+}
 
-// Send command to monitor via file and signal
-void send_command_to_monitor(const char *cmd, const char *arg) {
-    FILE* cmd_file = fopen(COMMAND_FILE, "w");
-    if (!cmd_file) {
-        perror("fopen command file");
-        return;
+// Position of one player in the cross-hunt leaderboard
+void rank(const char *user_name) {
+    char name[HUB_INPUT_SIZE];
+    if (user_name && *user_name) {
+        snprintf(name, sizeof(name), "%s", user_name);
+    } else {
+        printf("Enter user name: ");
+        if (!fgets(name, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        name[strcspn(name, "\n")] = '\0'; // Remove newline
+    }
+    send_command_to_monitor("rank", name);
+}
+// Treasures around a point: "near <hunt> <lat> <lon> <radius_m>"
+void near_treasures(const char *args) {
+    char arg[HUB_INPUT_SIZE * 2];
+    if (args && *args) {
+        snprintf(arg, sizeof(arg), "%s", args);
+    } else {
+        char hunt_id[HUB_INPUT_SIZE], point[HUB_INPUT_SIZE];
+        printf("Enter hunt ID: ");
+        if (!fgets(hunt_id, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        hunt_id[strcspn(hunt_id, "\n")] = '\0'; // Remove newline
+        printf("Enter latitude, longitude and radius in metres: ");
+        if (!fgets(point, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        point[strcspn(point, "\n")] = '\0';
+        snprintf(arg, sizeof(arg), "%s %s", hunt_id, point);
     }
+    send_command_to_monitor("near", arg);
+}
 
-    if (arg) {
-        fprintf(cmd_file, "%s %s", cmd, arg);
+// Treasures by clue words: "search <hunt|*> <words...>"
+void search_treasures(const char *args) {
+    char arg[HUB_INPUT_SIZE * 2];
+    if (args && *args) {
+        snprintf(arg, sizeof(arg), "%s", args);
     } else {
-        fprintf(cmd_file, "%s", cmd);
+        char hunt_id[HUB_INPUT_SIZE], words[HUB_INPUT_SIZE];
+        printf("Enter hunt ID (* for all hunts): ");
+        if (!fgets(hunt_id, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        hunt_id[strcspn(hunt_id, "\n")] = '\0'; // Remove newline
+        printf("Enter words to search for: ");
+        if (!fgets(words, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        words[strcspn(words, "\n")] = '\0';
+        snprintf(arg, sizeof(arg), "%s %s", hunt_id, words);
     }
+    send_command_to_monitor("search", arg);
+}
 
-    fflush(cmd_file);                   // flush buffer
-    fclose(cmd_file);
+// Value aggregates of a hunt or one of its users: "values <hunt> [user]"
+void show_values(const char *args) {
+    char arg[HUB_INPUT_SIZE * 2];
+    if (args && *args) {
+        snprintf(arg, sizeof(arg), "%s", args);
+    } else {
+        printf("Enter hunt ID and optionally a user name: ");
+        if (!fgets(arg, HUB_INPUT_SIZE, stdin)) {
+            return;
+        }
+        arg[strcspn(arg, "\n")] = '\0'; // Remove newline
+    }
+    send_command_to_monitor("values", arg);
+}
 
-    usleep(100000);
+// Monitor latency and I/O counters; "stats reset" starts them over
+void show_stats(const char *args) {
+    send_command_to_monitor("stats", args && *args ? args : NULL);
+}
+
+// Send command to monitor as a REQUEST frame and wait for its answer
+void send_command_to_monitor(const char *cmd, const char *arg) {
+    send_paged_command(cmd, arg, NULL, 0);
+}
 
-    kill(monitor_pid, SIGUSR2);        // signal after write
+// Same, keeping the cursor the answer ends with (if any) in next_cursor
+void send_paged_command(const char *cmd, const char *arg, char *next_cursor, size_t cursor_size) {
+    char request[HUB_INPUT_SIZE * 3];
+    int len;
+    if (arg) {
+        len = snprintf(request, sizeof(request), "%s %s", cmd, arg);
+    } else {
+        len = snprintf(request, sizeof(request), "%s", cmd);
+    }
 
-    read_monitor_response();           // read fresh response
+    if (next_cursor) {
+        next_cursor[0] = '\0';
+    }
+    if (len < 0 || (size_t)len >= sizeof(request)) {
+        printf("Error: command too long for the monitor\n");
+        return;
+    }
+    uint32_t request_id = next_request_id++;
+    if (proto_send(request_fd, request_id, FRAME_REQUEST, request, (size_t)len) == -1) {
+        perror("Error sending command to monitor");
+        return;
+    }
+
+    read_monitor_response(request_id, next_cursor, cursor_size);
 }
 
-// Read and display monitor response
-void read_monitor_response() {
+// Read and display monitor response: DATA frames until the END frame.
+// Frames are printed as they arrive, so a long answer is never held here.
+void read_monitor_response(uint32_t request_id, char *next_cursor, size_t cursor_size) {
     printf("\n=== Monitor Response ===\n");
 
-    char buffer[512];
-    ssize_t n;
-    while ((n = read(pipefd[0], buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[n] = '\0';
-        printf("%s", buffer);
+    while (1) {
+        FrameHeader h;
+        char *payload;
+        int r = proto_recv(response_fd, &h, &payload);
+        if (r != 1) {
+            printf("Error: monitor closed the connection\n");
+            break;
+        }
+        if (h.request_id == request_id && h.type == FRAME_DATA) {
+            fwrite(payload, 1, h.length, stdout);
+            size_t prefix = strlen(PROTO_CURSOR_PREFIX);
+            if (next_cursor && strncmp(payload, PROTO_CURSOR_PREFIX, prefix) == 0) {
+                snprintf(next_cursor, cursor_size, "%.*s", (int)strcspn(payload + prefix, "\n"), payload + prefix);
+            }
+        }
+        free(payload);
+        if (h.request_id == request_id && h.type == FRAME_END) {
+            break;
+        }
     }
-    usleep(50000); //sync with the monitor
     printf("=========================\n");
 }
 
@@ -207,10 +386,12 @@ void setup_signal_handlers() {
         exit(EXIT_FAILURE);
     }
     
-    // Ignore SIGUSR1 and SIGUSR2 in hub (handled in monitor)
+    // Ignore SIGUSR1 and SIGUSR2 in hub (handled in monitor), and SIGPIPE so a
+    // dead monitor shows up as a failed write
     sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGUSR1, &sa, NULL) == -1 || sigaction(SIGUSR2, &sa, NULL) == -1) {
-        perror("sigaction SIGUSR1/SIGUSR2");
+    if (sigaction(SIGUSR1, &sa, NULL) == -1 || sigaction(SIGUSR2, &sa, NULL) == -1 ||
+        sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction SIGUSR1/SIGUSR2/SIGPIPE");
         exit(EXIT_FAILURE);
     }
 }
@@ -220,7 +401,7 @@ int main() {
     setup_signal_handlers();
     
     printf("=== Treasure Hunt Hub ===\n");
-    printf("Commands(in a possible usage order):\n 1.start_monitor\n 2.list_hunts\n 3.list_treasures\n 4.calculate_score\n 5.view_treasure\n 6.stop_monitor\n 7.exit\n");
+    printf("Commands(in a possible usage order):\n 1.start_monitor\n 2.list_hunts\n 3.list_treasures [hunt [page_size [cursor]]] [where filter]\n 4.calculate_score [top_n]\n 5.leaderboard [top_n]\n 6.rank [user]\n 7.near [hunt lat lon radius_m]\n 8.search [hunt|* words]\n 9.view_treasure\n 10.values [hunt [user]]\n 11.stats [reset]\n 12.stop_monitor\n 13.exit\n");
     
     while (1) {
         printf("\nhub> ");
@@ -233,6 +414,12 @@ int main() {
         
         input[strcspn(input, "\n")] = '\0'; // Remove newline
         
+        // Optional arguments after the command, e.g. "calculate_score 5"
+        char *args = strchr(input, ' ');
+        if (args) {
+            *args++ = '\0';
+        }
+        
         if (strcmp(input, "start_monitor") == 0) {
             start_monitor();
         } else if (strcmp(input, "list_hunts") == 0) {
@@ -246,20 +433,56 @@ int main() {
                 printf("No monitor running!!\n\n");
                 continue;
             }
-            list_treasures();
+            list_treasures(args);
         }else if (strcmp(input, "calculate_score") == 0) {
             if(!monitor_running){
                 printf("No monitor running!!\n\n");
                 continue;
             }
-            calculate_score();
+            calculate_score(args);
             clearerr(stdin); // ✅ restores input stream if it was set to EOF
+        } else if (strcmp(input, "leaderboard") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            leaderboard(args);
+        } else if (strcmp(input, "rank") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            rank(args);
+        } else if (strcmp(input, "near") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            near_treasures(args);
+        } else if (strcmp(input, "search") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            search_treasures(args);
         }else if (strcmp(input, "view_treasure") == 0) {
             if(!monitor_running){
                 printf("No monitor running!!\n\n");
                 continue;
             }
             view_treasure();
+        } else if (strcmp(input, "values") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            show_values(args);
+        } else if (strcmp(input, "stats") == 0) {
+            if(!monitor_running){
+                printf("No monitor running!!\n\n");
+                continue;
+            }
+            show_stats(args);
         } else if (strcmp(input, "stop_monitor") == 0) {
             if(!monitor_running){
                 printf("No monitor running, so you can't stop it!!\n\n");
@@ -277,9 +500,5 @@ int main() {
         }
     }
     
-    // Cleanup
-    unlink(COMMAND_FILE);
-    unlink(RESPONSE_FILE);
-    
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "treasure.h"
+#include "treasure_store.h"
+#include "treasure_import.h"
+
+#define IMPORT_BUFFER_SIZE (1024 * 1024)
+#define IDSET_MIN_CAPACITY 1024
+
+// Fields a record must provide, as bits in a mask
+#define F_ID    0x01
+#define F_USER  0x02
+#define F_LAT   0x04
+#define F_LON   0x08
+#define F_CLUE  0x10
+#define F_VALUE 0x20
+#define F_ALL   0x3f
+
+// Set of treasure IDs already in the hunt or earlier in the batch, so
+// duplicates are rejected without one index probe per line
+typedef struct {
+    char (*slots)[ID_SIZE];  // empty slot = empty string (IDs are never empty)
+    size_t capacity;
+    size_t count;
+} IdSet;
+
+static uint32_t hash_id(const char *id) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < ID_SIZE && id[i]; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int idset_init(IdSet *set, size_t capacity) {
+    set->capacity = capacity;
+    set->count = 0;
+    set->slots = calloc(capacity, ID_SIZE);
+    return set->slots != NULL;
+}
+
+// Returns 1 if inserted, 0 if the ID was already there, -1 on allocation failure
+static int idset_add(IdSet *set, const char *id) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        IdSet bigger;
+        if (!idset_init(&bigger, set->capacity * 2)) {
+            return -1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i][0] != '\0') {
+                idset_add(&bigger, set->slots[i]);
+            }
+        }
+        free(set->slots);
+        *set = bigger;
+    }
+
+    size_t mask = set->capacity - 1;
+    size_t slot = hash_id(id) & mask;
+    while (set->slots[slot][0] != '\0') {
+        if (strncmp(set->slots[slot], id, ID_SIZE) == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    strncpy(set->slots[slot], id, ID_SIZE - 1);
+    set->count++;
+    return 1;
+}
+
+static int copy_string(char *dst, size_t size, const char *src) {
+    size_t len = strlen(src);
+    if (len >= size) {
+        return 0;
+    }
+    memcpy(dst, src, len + 1);
+    return 1;
+}
+
+// Stores one named field into t. Returns 0 if the value does not fit.
+static int set_field(Treasure *t, const char *key, const char *value, unsigned *seen) {
+    char *end;
+    if (strcmp(key, "id") == 0) {
+        if (value[0] == '\0' || !copy_string(t->id, ID_SIZE, value)) {
+            return 0;
+        }
+        *seen |= F_ID;
+    } else if (strcmp(key, "user_name") == 0 || strcmp(key, "user") == 0) {
+        if (!copy_string(t->user_name, NAME_SIZE, value)) {
+            return 0;
+        }
+        *seen |= F_USER;
+    } else if (strcmp(key, "latitude") == 0 || strcmp(key, "lat") == 0) {
+        t->latitude = strtof(value, &end);
+        if (end == value || *end != '\0') {
+            return 0;
+        }
+        *seen |= F_LAT;
+    } else if (strcmp(key, "longitude") == 0 || strcmp(key, "lon") == 0) {
+        t->longitude = strtof(value, &end);
+        if (end == value || *end != '\0') {
+            return 0;
+        }
+        *seen |= F_LON;
+    } else if (strcmp(key, "clue") == 0) {
+        if (!copy_string(t->clue, CLUE_SIZE, value)) {
+            return 0;
+        }
+        *seen |= F_CLUE;
+    } else if (strcmp(key, "value") == 0) {
+        long v = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || v < INT32_MIN || v > INT32_MAX) {
+            return 0;
+        }
+        t->value = (int)v;
+        *seen |= F_VALUE;
+    }
+    // unknown keys are ignored
+    return 1;
+}
+
+// Splits a CSV line in place. Quoted fields may contain commas and "" for a
+// literal quote. Returns the number of fields.
+static int split_csv(char *line, char **fields, int max) {
+    int n = 0;
+    char *p = line;
+    while (n < max) {
+        char *out = p;
+        fields[n++] = p;
+        if (*p == '"') {
+            p++;
+            while (*p) {
+                if (*p == '"' && p[1] == '"') {
+                    *out++ = '"';
+                    p += 2;
+                } else if (*p == '"') {
+                    p++;
+                    break;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+        }
+        while (*p && *p != ',') {
+            *out++ = *p++;
+        }
+        if (*p == '\0') {
+            *out = '\0';
+            return n;
+        }
+        *out = '\0';
+        p++;
+    }
+    return n + 1; // too many fields
+}
+
+static int parse_csv(char *line, Treasure *t) {
+    static const char *keys[] = { "id", "user_name", "latitude", "longitude", "clue", "value" };
+    char *fields[6];
+    if (split_csv(line, fields, 6) != 6) {
+        return 0;
+    }
+    unsigned seen = 0;
+    for (int i = 0; i < 6; i++) {
+        if (!set_field(t, keys[i], fields[i], &seen)) {
+            return 0;
+        }
+    }
+    return seen == F_ALL;
+}
+
+static const char *skip_ws(const char *p) {
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Reads a JSON string starting at the opening quote.
+// Returns the position after the closing quote, or NULL.
+static const char *json_string(const char *p, char *out, size_t size) {
+    size_t len = 0;
+    if (*p++ != '"') {
+        return NULL;
+    }
+    while (*p && *p != '"') {
+        char c = *p++;
+        if (c == '\\') {
+            switch (*p++) {
+                case '"':  c = '"';  break;
+                case '\\': c = '\\'; break;
+                case '/':  c = '/';  break;
+                case 'b':  c = '\b'; break;
+                case 'f':  c = '\f'; break;
+                case 'n':  c = '\n'; break;
+                case 'r':  c = '\r'; break;
+                case 't':  c = '\t'; break;
+                case 'u': {
+                    // Only the ASCII range is kept, anything else becomes '?'
+                    char hex[5] = {0};
+                    for (int i = 0; i < 4; i++) {
+                        if (!isxdigit((unsigned char)p[i])) {
+                            return NULL;
+                        }
+                        hex[i] = p[i];
+                    }
+                    p += 4;
+                    long code = strtol(hex, NULL, 16);
+                    c = code > 0 && code < 0x80 ? (char)code : '?';
+                    break;
+                }
+                default:
+                    return NULL;
+            }
+        }
+        if (len + 1 >= size) {
+            return NULL;
+        }
+        out[len++] = c;
+    }
+    if (*p != '"') {
+        return NULL;
+    }
+    out[len] = '\0';
+    return p + 1;
+}
+
+// Reads a bare JSON token (number, true, false, null)
+static const char *json_token(const char *p, char *out, size_t size) {
+    size_t len = 0;
+    while (*p && *p != ',' && *p != '}' && !isspace((unsigned char)*p)) {
+        if (len + 1 >= size) {
+            return NULL;
+        }
+        out[len++] = *p++;
+    }
+    out[len] = '\0';
+    return len > 0 ? p : NULL;
+}
+
+static int parse_json(const char *line, Treasure *t) {
+    char key[32], value[CLUE_SIZE + 1];
+    unsigned seen = 0;
+    const char *p = skip_ws(line);
+    if (*p++ != '{') {
+        return 0;
+    }
+    p = skip_ws(p);
+    if (*p == '}') {
+        return 0;
+    }
+    while (1) {
+        p = json_string(skip_ws(p), key, sizeof(key));
+        if (!p) {
+            return 0;
+        }
+        p = skip_ws(p);
+        if (*p++ != ':') {
+            return 0;
+        }
+        p = skip_ws(p);
+        p = *p == '"' ? json_string(p, value, sizeof(value)) : json_token(p, value, sizeof(value));
+        if (!p || !set_field(t, key, value, &seen)) {
+            return 0;
+        }
+        p = skip_ws(p);
+        if (*p == '}') {
+            break;
+        }
+        if (*p++ != ',') {
+            return 0;
+        }
+    }
+    return seen == F_ALL && *skip_ws(p + 1) == '\0';
+}
+
+// Seeds the ID set with the live treasures already in the hunt
+static int load_existing_ids(const char *hunt_id, IdSet *set) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        return 0;
+    }
+    TreasureView v;
+    int ok = 1;
+    for (size_t pos = 0; ok && store_next(&map, &pos, &v); ) {
+        if (!v.dead) {
+            ok = idset_add(set, v.id) != -1;
+        }
+    }
+    store_unmap(&map);
+    return ok;
+}
+
+long import_treasures(const char *hunt_id, FILE *in, long *skipped, ScoreTable *scores) {
+    *skipped = 0;
+
+    IdSet ids;
+    if (!idset_init(&ids, IDSET_MIN_CAPACITY)) {
+        return -1;
+    }
+    if (!load_existing_ids(hunt_id, &ids)) {
+        free(ids.slots);
+        return -1;
+    }
+
+    int version;
+    int fd = store_open_append(hunt_id, &version);
+    char *buf = malloc(IMPORT_BUFFER_SIZE);
+    if (fd == -1 || !buf) {
+        if (fd != -1) {
+            close(fd);
+        }
+        free(buf);
+        free(ids.slots);
+        return -1;
+    }
+
+    size_t used = 0;
+    long imported = 0, line_no = 0;
+    int ok = 1;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+
+    while (ok && (len = getline(&line, &line_cap, in)) != -1) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *start = skip_ws(line);
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+
+        Treasure t;
+        memset(&t, 0, sizeof(t));
+        int parsed;
+        if (*start == '{') {
+            parsed = parse_json(start, &t);
+        } else {
+            // An optional CSV header line names the columns
+            if (line_no == 1 && strncasecmp(start, "id,", 3) == 0) {
+                continue;
+            }
+            parsed = parse_csv(line, &t);
+        }
+        if (!parsed) {
+            fprintf(stderr, "Line %ld: malformed treasure, skipped\n", line_no);
+            (*skipped)++;
+            continue;
+        }
+
+        int added = idset_add(&ids, t.id);
+        if (added == -1) {
+            ok = 0;
+            break;
+        }
+        if (added == 0) {
+            fprintf(stderr, "Line %ld: duplicate treasure ID '%s', skipped\n", line_no, t.id);
+            (*skipped)++;
+            continue;
+        }
+
+        if (used + RECORD_MAX_SIZE > IMPORT_BUFFER_SIZE) {
+            ok = write(fd, buf, used) == (ssize_t)used;
+            used = 0;
+            // A full segment is sealed between buffers
+            fd = ok ? store_roll(hunt_id, fd, &version) : fd;
+            if (fd == -1) {
+                ok = 0;
+                break;
+            }
+        }
+        size_t len = store_encode(&t, version, buf + used);
+        if (len == 0) {
+            ok = 0;
+            break;
+        }
+        used += len;
+        imported++;
+        if (scores && score_add(scores, t.user_name, t.value) == -1) {
+            ok = 0;
+        }
+    }
+    if (ok && used > 0) {
+        ok = write(fd, buf, used) == (ssize_t)used;
+    }
+
+    free(line);
+    free(buf);
+    free(ids.slots);
+    if (fd != -1) {
+        close(fd);
+    }
+    return ok ? imported : -1;
+}
@@ -0,0 +1,19 @@
+#ifndef TREASURE_IMPORT_H
+#define TREASURE_IMPORT_H
+
+#include <stdio.h>
+#include "treasure_score.h"
+
+// Bulk loader behind treasure_manager --import. Every line of `in` is one
+// treasure, either CSV:
+//     id,user_name,latitude,longitude,clue,value
+// (fields may be double quoted, an optional header line is skipped) or a
+// JSON object with the same keys. Records are encoded into a large buffer
+// and written through a single descriptor.
+//
+// Returns the number of treasures imported (or -1 on an I/O error) and the
+// number of rejected lines (malformed or duplicate ID) in *skipped. If
+// scores is not NULL the imported values are added to it per user.
+long import_treasures(const char *hunt_id, FILE *in, long *skipped, ScoreTable *scores);
+
+#endif
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "treasure.h"
+#include "treasure_index.h"
+#include "treasure_store.h"
+
+// The index is an open addressing hash table stored as a fixed header
+// followed by `capacity` slots. Linear probing, FNV-1a on the treasure ID.
+
+#define INDEX_MAGIC "TRIDX01"
+#define INDEX_MIN_CAPACITY 64
+#define SLOT_EMPTY   ((int64_t)-1)
+#define SLOT_DELETED ((int64_t)-2)
+
+typedef struct {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t count;      // live entries
+    uint32_t used;       // live + deleted slots (drives growth)
+    uint32_t dead;       // tombstoned records still in treasures.dat
+    int64_t data_size;   // store_data_end() of the data the index describes
+} IndexHeader;
+
+typedef struct {
+    char id[ID_SIZE];
+    int64_t offset;
+} IndexSlot;
+
+static void build_path(char *buf, size_t size, const char *hunt_id, const char *file) {
+    snprintf(buf, size, "%s/%s", hunt_id, file);
+}
+
+static uint32_t hash_id(const char *id) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < ID_SIZE && id[i]; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static off_t slot_pos(uint32_t slot) {
+    return (off_t)sizeof(IndexHeader) + (off_t)slot * sizeof(IndexSlot);
+}
+
+// Opens the index and checks it still describes the data file. A record
+// just appended at appended_at (-1 = none) is allowed to be missing from it.
+// Returns the fd, or -1 if the index is missing, corrupt or stale.
+static int open_index(const char *hunt_id, int flags, IndexHeader *h, int64_t appended_at) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, INDEX_FILE);
+
+    int fd = open(path, flags);
+    if (fd == -1) {
+        return -1;
+    }
+    if (pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h) ||
+        memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->capacity == 0 ||
+        (h->data_size != store_data_end(hunt_id) && (appended_at < 0 || h->data_size != appended_at))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Finds the slot holding `id`, or the first reusable slot on its probe chain.
+// Returns 1 if found, 0 if not, -1 on I/O error.
+static int probe(int fd, const IndexHeader *h, const char *id, uint32_t *slot_out, IndexSlot *s) {
+    uint32_t mask = h->capacity - 1;
+    uint32_t slot = hash_id(id) & mask;
+    int64_t free_slot = -1;
+
+    for (uint32_t i = 0; i < h->capacity; i++) {
+        if (pread(fd, s, sizeof(*s), slot_pos(slot)) != (ssize_t)sizeof(*s)) {
+            return -1;
+        }
+        if (s->offset == SLOT_EMPTY) {
+            *slot_out = free_slot >= 0 ? (uint32_t)free_slot : slot;
+            return 0;
+        }
+        if (s->offset == SLOT_DELETED) {
+            if (free_slot < 0) {
+                free_slot = slot;
+            }
+        } else if (strncmp(s->id, id, ID_SIZE) == 0) {
+            *slot_out = slot;
+            return 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (free_slot < 0) {
+        return -1;
+    }
+    *slot_out = (uint32_t)free_slot;
+    return 0;
+}
+
+// In-memory insert used while rebuilding or growing; keeps the first
+// occurrence of a duplicated ID, like a front-to-back scan would.
+static int table_put(IndexSlot *slots, uint32_t capacity, const char *id, int64_t offset) {
+    uint32_t mask = capacity - 1;
+    uint32_t slot = hash_id(id) & mask;
+    while (slots[slot].offset != SLOT_EMPTY) {
+        if (strncmp(slots[slot].id, id, ID_SIZE) == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    memset(slots[slot].id, 0, ID_SIZE);
+    strncpy(slots[slot].id, id, ID_SIZE - 1);
+    slots[slot].offset = offset;
+    return 1;
+}
+
+static IndexSlot *table_alloc(uint32_t capacity) {
+    IndexSlot *slots = malloc((size_t)capacity * sizeof(IndexSlot));
+    if (!slots) {
+        perror("Error allocating index");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < capacity; i++) {
+        slots[i].offset = SLOT_EMPTY;
+    }
+    return slots;
+}
+
+static uint32_t capacity_for(uint32_t count) {
+    uint32_t capacity = INDEX_MIN_CAPACITY;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+// Writes a whole table to a temp file and renames it over the index
+static int write_table(const char *hunt_id, IndexSlot *slots, uint32_t capacity, uint32_t count, uint32_t dead, int64_t data_size) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, INDEX_FILE);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, INDEX_FILE, (int)getpid());
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error creating index file");
+        return 0;
+    }
+
+    IndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.capacity = capacity;
+    h.count = count;
+    h.used = count;
+    h.dead = dead;
+    h.data_size = data_size;
+
+    size_t table_size = (size_t)capacity * sizeof(IndexSlot);
+    if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) ||
+        write(fd, slots, table_size) != (ssize_t)table_size) {
+        perror("Error writing index file");
+        close(fd);
+        unlink(temp_path);
+        return 0;
+    }
+    close(fd);
+
+    if (rename(temp_path, path) == -1) {
+        perror("Error replacing index file");
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Rehashes the live entries of an open index into a table twice as big
+static int grow_index(const char *hunt_id, int fd, const IndexHeader *h) {
+    size_t table_size = (size_t)h->capacity * sizeof(IndexSlot);
+    IndexSlot *old_slots = malloc(table_size);
+    if (!old_slots) {
+        perror("Error allocating index");
+        return 0;
+    }
+    if (pread(fd, old_slots, table_size, slot_pos(0)) != (ssize_t)table_size) {
+        free(old_slots);
+        return 0;
+    }
+
+    uint32_t capacity = capacity_for(h->count * 2);
+    IndexSlot *slots = table_alloc(capacity);
+    if (!slots) {
+        free(old_slots);
+        return 0;
+    }
+    for (uint32_t i = 0; i < h->capacity; i++) {
+        if (old_slots[i].offset >= 0) {
+            table_put(slots, capacity, old_slots[i].id, old_slots[i].offset);
+        }
+    }
+    int ok = write_table(hunt_id, slots, capacity, h->count, h->dead, h->data_size);
+    free(old_slots);
+    free(slots);
+    return ok;
+}
+
+int index_stats(const char *hunt_id, long *live, long *dead) {
+    IndexHeader h;
+    int fd = open_index(hunt_id, O_RDONLY, &h, -1);
+    if (fd == -1) {
+        return -1;
+    }
+    close(fd);
+    *dead = h.dead;
+    *live = h.count;
+    return 0;
+}
+
+int index_lookup(const char *hunt_id, const char *treasure_id, off_t *offset) {
+    IndexHeader h;
+    int fd = open_index(hunt_id, O_RDONLY, &h, -1);
+    if (fd == -1) {
+        return -1;
+    }
+
+    uint32_t slot;
+    IndexSlot s;
+    int found = probe(fd, &h, treasure_id, &slot, &s);
+    close(fd);
+
+    if (found == 1) {
+        *offset = (off_t)s.offset;
+    }
+    return found;
+}
+
+int index_insert(const char *hunt_id, const char *treasure_id, off_t offset) {
+    IndexHeader h;
+    int fd = open_index(hunt_id, O_RDWR, &h, (int64_t)offset);
+    if (fd == -1) {
+        // Missing or stale: the record is already on disk, so a rebuild picks it up
+        return index_rebuild(hunt_id);
+    }
+
+    uint32_t slot;
+    IndexSlot s;
+    int found = probe(fd, &h, treasure_id, &slot, &s);
+    if (found == -1) {
+        close(fd);
+        return index_rebuild(hunt_id);
+    }
+
+    if (!found) {
+        if (s.offset != SLOT_DELETED) {
+            h.used++;
+        }
+        memset(s.id, 0, ID_SIZE);
+        strncpy(s.id, treasure_id, ID_SIZE - 1);
+        h.count++;
+    }
+    s.offset = offset;
+    h.data_size = store_data_end(hunt_id);
+
+    int ok = pwrite(fd, &s, sizeof(s), slot_pos(slot)) == (ssize_t)sizeof(s) &&
+             pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    if (ok && (uint64_t)h.used * 4 > (uint64_t)h.capacity * 3) {
+        ok = grow_index(hunt_id, fd, &h);
+    }
+    close(fd);
+
+    if (!ok) {
+        perror("Error updating index");
+    }
+    return ok;
+}
+
+int index_remove(const char *hunt_id, const char *treasure_id) {
+    IndexHeader h;
+    int fd = open_index(hunt_id, O_RDWR, &h, -1);
+    if (fd == -1) {
+        return index_rebuild(hunt_id);
+    }
+
+    uint32_t slot;
+    IndexSlot s;
+    int found = probe(fd, &h, treasure_id, &slot, &s);
+    int ok = 1;
+    if (found == 1) {
+        s.offset = SLOT_DELETED;
+        h.count--;
+        h.dead++; // the record itself stays in place as a tombstone
+        ok = pwrite(fd, &s, sizeof(s), slot_pos(slot)) == (ssize_t)sizeof(s);
+    }
+    h.data_size = store_data_end(hunt_id);
+    if (ok) {
+        ok = pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    }
+    close(fd);
+
+    if (!ok) {
+        perror("Error updating index");
+    }
+    return ok;
+}
+
+int index_rebuild(const char *hunt_id) {
+    int64_t data_size = store_data_end(hunt_id);
+
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        perror("Error opening treasure file");
+        return 0;
+    }
+
+    // Records are variable length, so size the table with a first pass
+    TreasureView t;
+    uint32_t records = 0;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        records++;
+    }
+
+    uint32_t capacity = capacity_for(records);
+    IndexSlot *slots = table_alloc(capacity);
+    if (!slots) {
+        store_unmap(&map);
+        return 0;
+    }
+
+    uint32_t count = 0, dead = 0;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        if (t.dead) {
+            dead++;
+        } else {
+            count += table_put(slots, capacity, t.id, (int64_t)t.offset);
+        }
+    }
+    store_unmap(&map);
+
+    int ok = write_table(hunt_id, slots, capacity, count, dead, data_size);
+    free(slots);
+    return ok;
+}
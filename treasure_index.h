@@ -0,0 +1,17 @@
+#ifndef TREASURE_INDEX_H
+#define TREASURE_INDEX_H
+
+#include <sys/types.h>
+
+// On-disk hash index (treasure ID -> record offset) kept next to treasures.dat
+#define INDEX_FILE "treasures.idx"
+
+// 1 = found (offset filled), 0 = not in the hunt, -1 = index missing or stale
+int index_lookup(const char *hunt_id, const char *treasure_id, off_t *offset);
+int index_insert(const char *hunt_id, const char *treasure_id, off_t offset);
+int index_remove(const char *hunt_id, const char *treasure_id);
+int index_rebuild(const char *hunt_id);
+// Live and tombstoned record counts, or -1 if the index is missing or stale
+int index_stats(const char *hunt_id, long *live, long *dead);
+
+#endif
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE // F_OFD_SETLKW
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "treasure.h"
+#include "treasure_journal.h"
+#include "treasure_store.h"
+
+// treasures.wal:  header | entries
+// Each entry is a JournalEntry followed by the record exactly as it was
+// written to treasures.dat, padded to 8 bytes. The checksum covers the
+// entry's offset, length and record bytes, so a torn entry is recognised.
+//
+// Positions in the journal are counted as LSNs that keep growing across
+// checkpoints: the entry at file position p has LSN base + p. `synced` is
+// the LSN up to which the journal is known to be on disk; it only
+// coordinates the appenders and is not itself relied on after a crash.
+//
+// Two OFD locks on the journal serialise the writers, also between
+// processes: byte 0 (APPEND) around writing an entry and its record, byte 1
+// (SYNC) around the fdatasync and every header update.
+
+#define JOURNAL_MAGIC "TRWAL01"
+#define ENTRY_MAGIC 0x4a455254u   // "TREJ"
+#define BOOT_ID_SIZE 40
+#define JOURNAL_CHECKPOINT (1024 * 1024) // journal bytes before the data file is synced
+
+#define LOCK_APPEND 0
+#define LOCK_SYNC   1
+
+typedef struct {
+    char magic[8];
+    char boot_id[BOOT_ID_SIZE]; // the boot the entries were written in
+    uint64_t base;              // LSN of the first entry
+    uint64_t synced;
+} JournalHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;            // record bytes
+    int64_t offset;             // logical offset of the record (see treasure_store.h)
+    uint64_t checksum;
+} JournalEntry;
+
+#define ENTRY_SIZE(len) (sizeof(JournalEntry) + (((len) + 7) & ~(size_t)7))
+
+// An entry with room for the largest record
+typedef union {
+    JournalEntry e;
+    char bytes[ENTRY_SIZE(RECORD_MAX_SIZE)];
+} EntryBuffer;
+
+static void build_path(char *buf, size_t size, const char *hunt_id, const char *file) {
+    snprintf(buf, size, "%s/%s", hunt_id, file);
+}
+
+int journal_mode(void) {
+    const char *env = getenv("TREASURE_SYNC");
+    if (!env || strcmp(env, "none") == 0) {
+        return SYNC_NONE;
+    }
+    if (strcmp(env, "op") == 0) {
+        return SYNC_OP;
+    }
+    if (strcmp(env, "group") == 0) {
+        return SYNC_GROUP;
+    }
+    fprintf(stderr, "Unknown TREASURE_SYNC '%s', using none\n", env);
+    return SYNC_NONE;
+}
+
+static long sync_window_us(void) {
+    const char *env = getenv("TREASURE_SYNC_WINDOW_US");
+    if (env) {
+        char *end;
+        long value = strtol(env, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            return value;
+        }
+    }
+    return DEFAULT_SYNC_WINDOW_US;
+}
+
+static uint64_t checksum(const JournalEntry *e, const char *record) {
+    uint64_t h = 14695981039346656037ull;
+    const unsigned char *parts[2] = { (const unsigned char *)&e->offset, (const unsigned char *)record };
+    size_t sizes[2] = { sizeof(e->offset), e->length };
+    for (int p = 0; p < 2; p++) {
+        for (size_t i = 0; i < sizes[p]; i++) {
+            h ^= parts[p][i];
+            h *= 1099511628211ull;
+        }
+    }
+    return h ^ e->length;
+}
+
+// Changes whenever the machine restarts; empty if it can not be read
+static void current_boot_id(char *boot_id) {
+    memset(boot_id, 0, BOOT_ID_SIZE);
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f) {
+        if (fgets(boot_id, BOOT_ID_SIZE, f)) {
+            boot_id[strcspn(boot_id, "\n")] = '\0';
+        }
+        fclose(f);
+    }
+}
+
+static int lock_byte(int fd, int byte, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// fsync on the directory makes a newly created file's entry durable
+static void sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// The journaled record is on disk, possibly removed since (the tombstone
+// is not journaled and must survive the replay)
+static int same_record(int version, const char *current, const char *record, size_t len) {
+    size_t marker = version == STORE_V1 ? offsetof(Treasure, id) : offsetof(RecordHeader, flags);
+    for (size_t i = 0; i < len; i++) {
+        if (current[i] != record[i] && i != marker) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int read_header(int fd, JournalHeader *h) {
+    return pread(fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h) &&
+           memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) == 0;
+}
+
+// Opens the journal and takes the APPEND lock, creating it if needed.
+// Returns the fd or -1.
+static int open_journal(const char *hunt_id, JournalHeader *h) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, JOURNAL_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (!lock_byte(fd, LOCK_APPEND, F_WRLCK)) {
+        close(fd);
+        return -1;
+    }
+    if (read_header(fd, h)) {
+        return fd;
+    }
+
+    // New (or unreadable) journal: it can only hold entries that never
+    // got past their sync, so start it over
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+    current_boot_id(h->boot_id);
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h) ||
+        fdatasync(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    sync_dir(hunt_id);
+    return fd;
+}
+
+// Syncs treasures.dat and empties the journal. The caller holds APPEND.
+static int checkpoint(int fd, int data_fd, JournalHeader *h) {
+    if (fdatasync(data_fd) == -1) {
+        return 0;
+    }
+    lock_byte(fd, LOCK_SYNC, F_WRLCK);
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok) {
+        read_header(fd, h);
+        h->base += (uint64_t)st.st_size - sizeof(*h);
+        h->synced = h->base;
+        current_boot_id(h->boot_id);
+        ok = ftruncate(fd, sizeof(*h)) == 0 &&
+             pwrite(fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h) &&
+             fdatasync(fd) == 0;
+    }
+    lock_byte(fd, LOCK_SYNC, F_UNLCK);
+    return ok;
+}
+
+// Waits until the journal is on disk up to lsn
+static int commit(int fd, uint64_t lsn, int mode) {
+    if (mode == SYNC_OP) {
+        return fdatasync(fd) == 0;
+    }
+
+    // Whoever holds SYNC syncs everything journaled so far; appenders that
+    // queued behind it usually find their entry already covered. The window
+    // gives more appenders the time to queue.
+    long window = sync_window_us();
+    if (window > 0) {
+        usleep((useconds_t)window);
+    }
+    lock_byte(fd, LOCK_SYNC, F_WRLCK);
+    JournalHeader h;
+    struct stat st;
+    int ok = read_header(fd, &h) && fstat(fd, &st) == 0;
+    if (ok && h.synced < lsn) {
+        uint64_t end = h.base + (uint64_t)st.st_size - sizeof(h);
+        ok = fdatasync(fd) == 0;
+        if (ok) {
+            h.synced = end;
+            ok = pwrite(fd, &h.synced, sizeof(h.synced), offsetof(JournalHeader, synced)) ==
+                 (ssize_t)sizeof(h.synced);
+        }
+    }
+    lock_byte(fd, LOCK_SYNC, F_UNLCK);
+    return ok;
+}
+
+int journal_write(const char *hunt_id, const Treasure *t, int mode, off_t *offset,
+                  JournalCommit *pending) {
+    pending->fd = -1;
+    JournalHeader h;
+    int fd = open_journal(hunt_id, &h);
+    if (fd == -1) {
+        return 0;
+    }
+
+    char data_path[PATH_MAX];
+    build_path(data_path, sizeof(data_path), hunt_id, TREASURE_FILE);
+    struct stat st;
+    int created = stat(data_path, &st) == -1 || st.st_size == 0;
+
+    int version;
+    int data_fd = store_open_append(hunt_id, &version);
+    if (data_fd == -1) {
+        close(fd);
+        return 0;
+    }
+
+    EntryBuffer buf;
+    memset(&buf, 0, sizeof(buf));
+    JournalEntry *e = &buf.e;
+    char *record = buf.bytes + sizeof(JournalEntry);
+    e->magic = ENTRY_MAGIC;
+    e->length = (uint32_t)store_encode(t, version, record);
+
+    struct stat wal;
+    off_t end = store_append_offset(data_fd);
+    int ok = e->length > 0 && end != -1 && fstat(fd, &wal) == 0;
+    if (ok) {
+        // APPEND is held, so the file ends where the record will go
+        e->offset = (int64_t)end;
+        e->checksum = checksum(e, record);
+        size_t size = ENTRY_SIZE(e->length);
+        ok = pwrite(fd, buf.bytes, size, wal.st_size) == (ssize_t)size &&
+             write(data_fd, record, e->length) == (ssize_t)e->length;
+        wal.st_size += (off_t)size;
+        *offset = (off_t)e->offset;
+    }
+
+    uint64_t lsn = h.base + (uint64_t)wal.st_size - sizeof(h);
+    int durable = 0;
+    if (ok && created) {
+        // A new data file has to exist after a crash for the replay to work
+        ok = fdatasync(data_fd) == 0;
+        sync_dir(hunt_id);
+    }
+    if (ok && wal.st_size > JOURNAL_CHECKPOINT) {
+        ok = checkpoint(fd, data_fd, &h);
+        durable = ok;
+    }
+    close(data_fd);
+    lock_byte(fd, LOCK_APPEND, F_UNLCK);
+
+    if (ok && !durable) {
+        pending->fd = fd;
+        pending->lsn = lsn;
+        pending->mode = mode;
+    } else {
+        close(fd);
+    }
+    return ok;
+}
+
+int journal_commit(JournalCommit *pending) {
+    if (pending->fd == -1) {
+        return 1; // a checkpoint already made it durable
+    }
+    int ok = commit(pending->fd, pending->lsn, pending->mode);
+    close(pending->fd);
+    pending->fd = -1;
+    return ok;
+}
+
+int journal_stale(const char *hunt_id) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, JOURNAL_FILE);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    JournalHeader h;
+    char boot_id[BOOT_ID_SIZE];
+    current_boot_id(boot_id);
+    int stale = !read_header(fd, &h) || boot_id[0] == '\0' || strcmp(boot_id, h.boot_id) != 0;
+    close(fd);
+    return stale;
+}
+
+int journal_recover(const char *hunt_id, int force) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, JOURNAL_FILE);
+    if (access(path, F_OK) == -1) {
+        return 0; // never written durably
+    }
+
+    JournalHeader h;
+    int fd = open_journal(hunt_id, &h);
+    if (fd == -1) {
+        return -1;
+    }
+    char boot_id[BOOT_ID_SIZE];
+    current_boot_id(boot_id);
+    if (!force && boot_id[0] != '\0' && strcmp(boot_id, h.boot_id) == 0) {
+        close(fd);
+        return 0; // no crash since the entries were written
+    }
+
+    char data_path[PATH_MAX];
+    build_path(data_path, sizeof(data_path), hunt_id, TREASURE_FILE);
+    int data_fd = open(data_path, O_RDWR);
+    if (data_fd == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Write back every intact entry whose record did not make it to disk
+    int changed = 0, ok = 1;
+    struct stat st;
+    fstat(fd, &st);
+    EntryBuffer buf;
+    char current[RECORD_MAX_SIZE];
+    int version;
+    off_t base;
+    size_t data_start;
+    if (store_file_layout(data_fd, &version, &base, &data_start) == -1) {
+        ok = 0;
+    }
+    for (off_t pos = sizeof(h); ok && pos + (off_t)sizeof(JournalEntry) <= st.st_size; ) {
+        JournalEntry *e = &buf.e;
+        char *record = buf.bytes + sizeof(JournalEntry);
+        if (pread(fd, e, sizeof(JournalEntry), pos) != (ssize_t)sizeof(JournalEntry) ||
+            e->magic != ENTRY_MAGIC || e->length > RECORD_MAX_SIZE ||
+            pread(fd, record, e->length, pos + sizeof(JournalEntry)) != (ssize_t)e->length ||
+            checksum(e, record) != e->checksum) {
+            break; // torn entry: it was never acknowledged
+        }
+        pos += (off_t)ENTRY_SIZE(e->length);
+        // Offsets are logical; one before treasures.dat is in a sealed
+        // segment, which was synced when it was sealed
+        off_t local = (off_t)e->offset - base;
+        if (local < (off_t)data_start) {
+            continue;
+        }
+        if (pread(data_fd, current, e->length, local) != (ssize_t)e->length ||
+            !same_record(version, current, record, e->length)) {
+            ok = pwrite(data_fd, record, e->length, local) == (ssize_t)e->length;
+            changed = 1;
+        }
+    }
+
+    // Cut a partly written record off the end of treasures.dat, otherwise
+    // everything appended after it would be unreadable
+    TreasureMap map;
+    if (ok && store_map(hunt_id, &map, STORE_SCAN) == 0) {
+        size_t end = 0, size = 0;
+        if (map.count > 0) {
+            size_t active = map.count - 1;
+            TreasureView t;
+            for (size_t pos = 0; store_next_in(&map, active, &pos, &t); ) {
+                end = pos - (size_t)map.segments[active].base;
+            }
+            if (end == 0) {
+                end = map.segments[active].data_start;
+            }
+            size = map.segments[active].size;
+        }
+        store_unmap(&map);
+        if (size > end) {
+            ok = ftruncate(data_fd, (off_t)end) == 0;
+            changed = 1;
+        }
+    }
+
+    if (ok) {
+        ok = checkpoint(fd, data_fd, &h);
+    }
+    close(data_fd);
+    close(fd);
+    if (!ok) {
+        perror("Error recovering treasure file");
+        return -1;
+    }
+    return changed;
+}
+
+int journal_checkpoint(const char *hunt_id) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, JOURNAL_FILE);
+    if (access(path, F_OK) == -1) {
+        return 1; // nothing journaled
+    }
+
+    JournalHeader h;
+    int fd = open_journal(hunt_id, &h);
+    if (fd == -1) {
+        return 0;
+    }
+    char data_path[PATH_MAX];
+    build_path(data_path, sizeof(data_path), hunt_id, TREASURE_FILE);
+    int data_fd = open(data_path, O_RDONLY);
+    int ok = data_fd != -1 && checkpoint(fd, data_fd, &h);
+    if (data_fd != -1) {
+        close(data_fd);
+    }
+    close(fd);
+    sync_dir(hunt_id);
+    return ok;
+}
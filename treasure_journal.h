@@ -0,0 +1,61 @@
+#ifndef TREASURE_JOURNAL_H
+#define TREASURE_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "treasure.h"
+
+// Write-ahead journal for durable appends, kept next to treasures.dat.
+// A durable append writes the encoded record to treasures.wal, then to
+// treasures.dat, and returns once the journal entry is on disk. The data
+// file itself is only synced when the journal is checkpointed (emptied),
+// so after a crash everything appended since is still in the journal.
+#define JOURNAL_FILE "treasures.wal"
+
+// TREASURE_SYNC selects how appends reach the disk:
+//  none  - plain write, the page cache decides (the default)
+//  op    - every append waits for its own fdatasync of the journal
+//  group - appends waiting at the same time share one fdatasync (group
+//          commit); TREASURE_SYNC_WINDOW_US delays each commit by that many
+//          microseconds so more appends can join
+#define SYNC_NONE  0
+#define SYNC_OP    1
+#define SYNC_GROUP 2
+#define DEFAULT_SYNC_WINDOW_US 0
+
+int journal_mode(void);
+
+// A durable append that is written but maybe not on disk yet
+typedef struct {
+    int fd;              // the journal, -1 once there is nothing to wait for
+    uint64_t lsn;        // journal position the entry ends at
+    int mode;
+} JournalCommit;
+
+// First half of a durable append, under the caller's append lock: writes t
+// to the journal and to the hunt in the given (op or group) mode. Returns 1
+// with the record offset and what to wait for in pending, or 0 on error.
+int journal_write(const char *hunt_id, const Treasure *t, int mode, off_t *offset,
+                  JournalCommit *pending);
+
+// Second half, after the hunt lock is released so other appends to the
+// hunt can join the same sync: waits until the entry is on disk and closes
+// the journal. Returns 1 if it is durable, 0 on error.
+int journal_commit(JournalCommit *pending);
+
+// 1 if the machine rebooted since the journal was last used, so
+// journal_recover() has work to do
+int journal_stale(const char *hunt_id);
+
+// Replays the journal after a crash: journaled records missing from
+// treasures.dat are written back and a torn record at its end is cut off.
+// Runs when the machine rebooted since the journal was last used, or
+// always with force. Returns 1 if treasures.dat changed (its indexes then
+// need a rebuild), 0 if not, -1 on error.
+int journal_recover(const char *hunt_id, int force);
+
+// Makes everything written to treasures.dat so far durable and empties
+// the journal, for bulk loads that bypass journal_write(). 1 = ok.
+int journal_checkpoint(const char *hunt_id);
+
+#endif
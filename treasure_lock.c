@@ -0,0 +1,98 @@
+#define _GNU_SOURCE // F_OFD_SETLKW
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>//for PATH_MAX
+#include "treasure_lock.h"
+
+#define DATA_BYTE   0
+#define APPEND_BYTE 1
+
+// The lock this thread holds, so nested calls (a rebuild inside an add,
+// a scan inside a rewrite) do not wait on it
+static __thread struct {
+    char hunt_id[PATH_MAX];
+    int mode;
+    int depth;
+} held;
+
+static int lock_byte(int fd, int byte, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int hunt_lock(const char *hunt_id, int mode, HuntLock *lock) {
+    lock->fd = -1;
+    lock->nested = 0;
+    lock->tracked = 0;
+    if (held.depth > 0 && strcmp(held.hunt_id, hunt_id) == 0) {
+        if (mode > held.mode) {
+            // Waiting here could deadlock with another upgrader, and going
+            // on under the weaker lock would let writers overlap
+            fprintf(stderr, "Lock on hunt '%s' can not be upgraded\n", hunt_id);
+            errno = EDEADLK;
+            return 0;
+        }
+        held.depth++;
+        lock->nested = 1;
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, LOCK_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1 && mode == HUNT_READ) {
+        fd = open(path, O_RDONLY); // read-only hunt directory
+    }
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror("Error opening hunt lock"); // a missing hunt is the caller's to report
+        }
+        return 0;
+    }
+
+    int ok = lock_byte(fd, DATA_BYTE, mode == HUNT_REWRITE ? F_WRLCK : F_RDLCK);
+    if (ok && mode == HUNT_APPEND) {
+        ok = lock_byte(fd, APPEND_BYTE, F_WRLCK);
+    }
+    if (!ok) {
+        perror("Error locking hunt");
+        close(fd);
+        return 0;
+    }
+
+    lock->fd = fd;
+    if (held.depth == 0) {
+        snprintf(held.hunt_id, sizeof(held.hunt_id), "%s", hunt_id);
+        held.mode = mode;
+        held.depth = 1;
+        lock->tracked = 1;
+    }
+    return 1;
+}
+
+void hunt_unlock(HuntLock *lock) {
+    if (lock->nested) {
+        held.depth--;
+    } else if (lock->fd != -1) {
+        close(lock->fd); // drops both bytes
+        if (lock->tracked) {
+            held.depth = 0;
+        }
+    }
+    lock->fd = -1;
+    lock->nested = 0;
+    lock->tracked = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef TREASURE_LOCK_H
+#define TREASURE_LOCK_H
+
+// Coordination between processes working on the same hunt, through fcntl
+// record locks on <hunt>/.lock:
+//  byte 0 - the data file: shared while it is read or appended to,
+//           exclusive while it is rewritten (compaction, migration, recovery)
+//  byte 1 - the append lock: one writer at a time appends and updates the
+//           index files that follow treasures.dat
+// They are open file description locks, so they also separate threads.
+#define LOCK_FILE ".lock"
+
+#define HUNT_READ    1   // scans and point reads
+#define HUNT_APPEND  2   // adds, removes, imports, index rebuilds
+#define HUNT_REWRITE 3   // replacing treasures.dat
+
+typedef struct {
+    int fd;              // -1 when nothing was locked
+    int nested;          // inside a lock this thread already holds
+    int tracked;         // the thread's outermost lock
+} HuntLock;
+
+// Blocks until the hunt is locked in the given mode. Locking a hunt the
+// calling thread already holds nests inside the outer lock, which must be
+// at least as strong: an upgrade is refused. Returns 1, or 0 if the hunt
+// is missing (errno ENOENT, left to the caller to report) or the lock can
+// not be taken (reported here); the caller must not touch the hunt then.
+int hunt_lock(const char *hunt_id, int mode, HuntLock *lock);
+void hunt_unlock(HuntLock *lock);
+
+#endif
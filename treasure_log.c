@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include "treasure_log.h"
+
+// Binary log: the magic, then per entry
+//   uint32 time (seconds since the epoch) | uint8 op | uint8 length | detail
+// The text form is rebuilt from these when the log is printed.
+#define LOG_MAGIC "TRLOG01"
+#define LOG_MAGIC_SIZE 8
+#define LOG_ENTRY_HEADER 6
+#define LOG_DETAIL_MAX 255
+
+#define LOG_BUFFER_SIZE 4096
+
+static const char *op_prefix[] = {
+    "Hunt created", "ADD treasure ", "REMOVE treasure ", "COMPACT ", "MIGRATE ", "IMPORT ",
+    "RECOVER from journal",
+};
+#define OP_COUNT (sizeof(op_prefix) / sizeof(op_prefix[0]))
+
+static struct {
+    char hunt_id[PATH_MAX];
+    int fd;                     // -1 = no log open
+    int binary;
+    char buf[LOG_BUFFER_SIZE];
+    size_t used;
+    time_t stamp_sec;           // the second `stamp` was formatted for
+    char stamp[20];
+} logger = { .fd = -1, .stamp_sec = -1 };
+
+static int exit_hook;
+
+static void log_close(void) {
+    log_flush();
+    if (logger.fd != -1) {
+        close(logger.fd);
+        logger.fd = -1;
+    }
+}
+
+// "YYYY-mm-dd HH:MM:SS", formatted once per second
+static const char *timestamp(time_t now) {
+    if (now != logger.stamp_sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(logger.stamp, sizeof(logger.stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        logger.stamp_sec = now;
+    }
+    return logger.stamp;
+}
+
+// Points logged_hunt-<hunt> at the log, unless the link is already there
+static void link_log(const char *hunt_id, const char *log_path) {
+    char symlink_name[PATH_MAX];
+    snprintf(symlink_name, sizeof(symlink_name), "logged_hunt-%s", hunt_id);
+
+    struct stat st;
+    if (lstat(symlink_name, &st) == 0) {
+        return;
+    }
+    if (symlink(log_path, symlink_name) == -1 && errno != EEXIST) {
+        perror("Error creating symbolic link");
+    }
+}
+
+static int open_log(const char *hunt_id) {
+    if (logger.fd != -1 && strcmp(logger.hunt_id, hunt_id) == 0) {
+        return 1;
+    }
+    log_close();
+
+    char log_path[PATH_MAX];
+    snprintf(log_path, sizeof(log_path), "%s/%s", hunt_id, LOG_FILE);
+    int fd = open(log_path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error opening log file");
+        return 0;
+    }
+
+    // An existing log keeps its form; a new one follows TREASURE_LOG_FORMAT
+    char magic[LOG_MAGIC_SIZE];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n > 0) {
+        logger.binary = n == LOG_MAGIC_SIZE && memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) == 0;
+    } else {
+        const char *format = getenv("TREASURE_LOG_FORMAT");
+        logger.binary = format && strcmp(format, "binary") == 0;
+        if (logger.binary) {
+            memcpy(logger.buf, LOG_MAGIC, LOG_MAGIC_SIZE);
+            logger.used = LOG_MAGIC_SIZE;
+        }
+    }
+
+    snprintf(logger.hunt_id, sizeof(logger.hunt_id), "%s", hunt_id);
+    logger.fd = fd;
+    if (!exit_hook) {
+        atexit(log_close);
+        exit_hook = 1;
+    }
+    link_log(hunt_id, log_path);
+    return 1;
+}
+
+void log_flush(void) {
+    size_t done = 0;
+    while (logger.fd != -1 && done < logger.used) {
+        ssize_t n = write(logger.fd, logger.buf + done, logger.used - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing log file");
+            break;
+        }
+        done += (size_t)n;
+    }
+    logger.used = 0;
+}
+
+void log_operation(const char *hunt_id, int op, const char *detail) {
+    if (op < 0 || (size_t)op >= OP_COUNT || !open_log(hunt_id)) {
+        return;
+    }
+    if (!detail) {
+        detail = "";
+    }
+
+    time_t now = time(NULL);
+    char entry[LOG_ENTRY_HEADER + 512];
+    size_t len;
+    if (logger.binary) {
+        size_t detail_len = strlen(detail);
+        if (detail_len > LOG_DETAIL_MAX) {
+            detail_len = LOG_DETAIL_MAX;
+        }
+        uint32_t when = (uint32_t)now;
+        memcpy(entry, &when, sizeof(when));
+        entry[4] = (char)op;
+        entry[5] = (char)detail_len;
+        memcpy(entry + LOG_ENTRY_HEADER, detail, detail_len);
+        len = LOG_ENTRY_HEADER + detail_len;
+    } else {
+        int n = snprintf(entry, sizeof(entry), "[%s] %s%s\n", timestamp(now), op_prefix[op], detail);
+        len = n < (int)sizeof(entry) ? (size_t)n : sizeof(entry) - 1;
+        entry[len - 1] = '\n'; // keep one entry per line even if cut short
+    }
+
+    if (logger.used + len > sizeof(logger.buf)) {
+        log_flush();
+    }
+    memcpy(logger.buf + logger.used, entry, len);
+    logger.used += len;
+}
+
+int log_print(const char *hunt_id, FILE *out) {
+    if (logger.fd != -1 && strcmp(logger.hunt_id, hunt_id) == 0) {
+        log_flush();
+    }
+
+    char log_path[PATH_MAX];
+    snprintf(log_path, sizeof(log_path), "%s/%s", hunt_id, LOG_FILE);
+    FILE *in = fopen(log_path, "r");
+    if (!in) {
+        return -1;
+    }
+
+    char magic[LOG_MAGIC_SIZE];
+    if (fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+        memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) == 0) {
+        unsigned char header[LOG_ENTRY_HEADER];
+        char detail[LOG_DETAIL_MAX + 1];
+        while (fread(header, 1, sizeof(header), in) == sizeof(header)) {
+            size_t detail_len = header[5];
+            if (fread(detail, 1, detail_len, in) != detail_len) {
+                break; // torn last entry
+            }
+            detail[detail_len] = '\0';
+            uint32_t when;
+            memcpy(&when, header, sizeof(when));
+            const char *prefix = header[4] < OP_COUNT ? op_prefix[header[4]] : "";
+            fprintf(out, "[%s] %s%s\n", timestamp((time_t)when), prefix, detail);
+        }
+    } else {
+        rewind(in);
+        char line[512];
+        while (fgets(line, sizeof(line), in)) {
+            fputs(line, out);  // Log already contains formatted time
+        }
+    }
+    fclose(in);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef TREASURE_LOG_H
+#define TREASURE_LOG_H
+
+#include <stdio.h>
+
+// Operation log kept in <hunt>/logged_hunt, with a logged_hunt-<hunt>
+// symlink to it in the working directory.
+//
+// The log stays open for the life of the process and entries are buffered,
+// going to disk when the buffer fills, on log_flush() and at exit. A new
+// log is written as text, or in a compact binary form when
+// TREASURE_LOG_FORMAT=binary; an existing log keeps the form it has.
+#define LOG_FILE "logged_hunt"
+
+// What an entry records; the detail text follows the operation's prefix
+#define LOG_CREATE  0   // "Hunt created"
+#define LOG_ADD     1   // "ADD treasure <id>"
+#define LOG_REMOVE  2   // "REMOVE treasure <id>"
+#define LOG_COMPACT 3   // "COMPACT <detail>"
+#define LOG_MIGRATE 4   // "MIGRATE <detail>"
+#define LOG_IMPORT  5   // "IMPORT <detail>"
+#define LOG_RECOVER 6   // "RECOVER from journal"
+
+void log_operation(const char *hunt_id, int op, const char *detail);
+
+// Writes out the buffered entries. Call before fork() so the child does not
+// inherit (and repeat) them.
+void log_flush(void);
+
+// Prints the hunt's log as text, decoding a binary log.
+// Returns 0, or -1 if the hunt has no log.
+int log_print(const char *hunt_id, FILE *out);
+
+#endif
@@ -10,22 +10,45 @@
 #include <limits.h>//for PATH_MAX
 #include <stddef.h>
 #include "treasure.h" //for the treasure structure(header file to have where i need)
+#include "treasure_index.h" //ID -> offset index kept next to treasures.dat
+#include "treasure_store.h" //mmap read path for treasures.dat
+#include "treasure_import.h" //bulk loader for --import
+#include "treasure_score.h" //per-user totals kept in scores.dat
+#include "treasure_spatial.h" //location -> offset grid index for --near
+#include "treasure_search.h" //clue word -> offsets index for --search
+#include "treasure_log.h" //buffered operation log (logged_hunt)
+#include "treasure_journal.h" //write-ahead journal for TREASURE_SYNC=op|group
+#include "treasure_lock.h" //fcntl locks between processes sharing a hunt
+#include "treasure_catalog.h" //hunts.cat, the list of hunts with their counts
+#include "treasure_filter.h" //value/user/location predicates for --list
 
-#define LOG_FILE "logged_hunt"
-#define TREASURE_FILE "treasures.dat"
+#define DEFAULT_COMPACT_THRESHOLD 0.25 //fraction of dead records that triggers compaction
 
 // Function prototypes
 void print_usage();//in case someone dose not know the functions
 int create_hunt_directory(const char* hunt_id);//if the dir for the hunt 
-void log_operation(const char* hunt_id, const char* operation); //add the specific message to the log file, also with the time when the operation was performed
 void add_treasure(const char* hunt_id);//add a treasure to a specific hunt dir
-void list_treasures(const char* hunt_id);
+void list_treasures(const char* hunt_id, const Filter *filter);
 void view_treasure(const char *hunt_id, const char* treasure_id);
 void remove_treasure(const char* hunt_id, const char* treasure_id);
 void remove_hunt(const char* hunt_id);
 int hunt_exists(const char* hunt_id);
 void view_log(const char* hunt_id); //added function for a better view of the log-file
 void get_treasure_input(Treasure *t);
+int find_treasure_offset(const char *hunt_id, const char *treasure_id, off_t *offset);
+void rebuild_index(const char *hunt_id);
+void migrate_hunt(const char *hunt_id);
+void import_hunt(const char *hunt_id, const char *source);
+int parse_threshold(const char *text, double *threshold);
+double compact_threshold();
+double dead_fraction(const char *hunt_id);
+long compact_treasures(const char *hunt_id, double threshold);
+void compact_hunt(const char *hunt_id, double threshold);
+void near_treasures(const char *hunt_id, double latitude, double longitude, double radius_m);
+void search_treasures(const char *hunt_id, const char *query);
+void recover_hunt(const char *hunt_id, int force);
+void compact_in_background(const char *hunt_id);
+int verify_catalog(int repair);
 
 //-------------------------------------------------------------------------//
 //  THE FUNCTION IMPLEMENTATION
@@ -34,30 +57,34 @@ void print_usage() {
     printf("Usage: treasure_manager <operation> <hunt_id> [treasure_id]\n");
     printf("Operations:\n");
     printf("  --add                Add a new treasure to the hunt\n");
-    printf("  --list               List all treasures in the hunt\n");
+    printf("  --list [filter...]   List the treasures in the hunt, e.g. value>=50 user!=bob\n");
     printf("  --view <treasure_id> View details of a specific treasure\n");
     printf("  --remove_treasure <treasure_id> Remove a specific treasure\n");
     printf("  --remove_hunt        Remove an entire hunt\n");
     //for visibility i added a function to print the content of the log in terminal, so i don't have to open the file
     printf("  --view_log          View the operation log for a hunt\n");
+    printf("  --rebuild_index      Rebuild the treasure ID index of a hunt\n");
+    printf("  --compact [threshold] Drop removed treasures once their fraction passes threshold\n");
+    printf("  --migrate            Convert a hunt to the current (v3) file format\n");
+    printf("  --import <file|->    Bulk load CSV or JSON-lines treasures (- reads stdin)\n");
+    printf("  --near <lat> <lon> <radius_m> List treasures within radius_m metres, nearest first\n");
+    printf("  --search <words...>  List treasures whose clue contains all the words\n");
+    printf("  --recover            Replay the write-ahead journal and cut a torn last record\n");
+    printf("Usage: treasure_manager --verify_catalog [--repair]\n");
+    printf("  Compare hunts.cat with the hunt directories, and with --repair rewrite it\n");
 }
 
 void view_log(const char *hunt_id) {
     char log_path[PATH_MAX];
     snprintf(log_path, sizeof(log_path), "%s/%s", hunt_id, LOG_FILE);
 
-    FILE *log = fopen(log_path, "r");
-    if (!log) {
+    if (access(log_path, R_OK) == -1) {
         printf("No log found for hunt '%s'\n", hunt_id);
         return;
     }
 
     printf("=== Operation Log for Hunt '%s' ===\n", hunt_id);
-    char line[512];
-    while (fgets(line, sizeof(line), log)) {
-        printf("%s", line);  // Log already contains formatted time
-    }
-    fclose(log);
+    log_print(hunt_id, stdout); // decodes a binary log
 }
 
 void get_treasure_input(Treasure *t) {
@@ -105,69 +132,88 @@ int create_hunt_directory(const char *hunt_id) {
             perror("Error creating hunt directory");
             return 0;
         }
-        log_operation(hunt_id, "Hunt created");
+        log_operation(hunt_id, LOG_CREATE, NULL);
+        catalog_update(hunt_id);
     }
     return 1;
 }
 
-void log_operation(const char *hunt_id, const char *operation) {
-    char log_path[PATH_MAX];
-    snprintf(log_path, sizeof(log_path), "%s/%s", hunt_id, LOG_FILE);
-
-    FILE *log = fopen(log_path, "a");
-    if (!log) {
-        perror("Error opening log file");
-        return;
-    }
-
-    time_t now = time(NULL);
-    struct tm *timeinfo = localtime(&now);
-    char timestamp[20];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-    //strftime is a function that format the time, in my case, in human readable format
-
-    fprintf(log, "[%s] %s\n", timestamp, operation);  // Write formatted time
-    fclose(log);
-    
-    // Create/update symbolic link
-    char symlink_name[PATH_MAX];
-    snprintf(symlink_name, sizeof(symlink_name), "logged_hunt-%s", hunt_id);
-    
-    // Remove existing symlink if it exists
-    unlink(symlink_name);
-    
-    if (symlink(log_path, symlink_name) == -1) {
-        perror("Error creating symbolic link");
+// Looks the ID up in the hunt index, rebuilding the index first if it is
+// missing or stale. Returns 1 and fills offset if the treasure exists.
+int find_treasure_offset(const char *hunt_id, const char *treasure_id, off_t *offset) {
+    int found = index_lookup(hunt_id, treasure_id, offset);
+    if (found == -1) {
+        if (!index_rebuild(hunt_id)) {
+            return 0;
+        }
+        found = index_lookup(hunt_id, treasure_id, offset);
     }
+    return found == 1;
 }
 
 void add_treasure(const char *hunt_id) {
     Treasure t;
     get_treasure_input(&t);
     
-    char filepath[PATH_MAX];
-    snprintf(filepath, sizeof(filepath), "%s/%s", hunt_id, TREASURE_FILE);
+    if (t.id[0] == '\0') {
+        printf("Treasure ID can not be empty\n");
+        return;
+    }
     
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (fd == -1) {
-        perror("Error opening treasure file");
+    // Durable modes first repair whatever a crash left behind
+    int mode = journal_mode();
+    if (mode != SYNC_NONE) {
+        recover_hunt(hunt_id, 0);
+    }
+    
+    // Locked only now, not while waiting for the input
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
         return;
     }
     
-    if (write(fd, &t, sizeof(Treasure)) == -1) {
+    off_t existing;
+    if (find_treasure_offset(hunt_id, t.id, &existing)) {
+        printf("Treasure '%s' already exists in hunt '%s'\n", t.id, hunt_id);
+        hunt_unlock(&lock);
+        return;
+    }
+    
+    DataStamp before;
+    score_stamp(hunt_id, &before);
+    
+    off_t offset;
+    JournalCommit pending = { -1, 0, mode };
+    int appended = mode == SYNC_NONE ? store_append(hunt_id, &t, &offset)
+                                     : journal_write(hunt_id, &t, mode, &offset, &pending);
+    if (!appended) {
         perror("Error writing treasure");
+        score_invalidate(hunt_id);
+        hunt_unlock(&lock);
+        return;
     }
     
-    close(fd);
+    index_insert(hunt_id, t.id, offset);
+    spatial_insert(hunt_id, t.latitude, t.longitude, offset);
+    search_add(hunt_id, t.clue, offset);
+    score_update(hunt_id, &before, t.user_name, t.value, 1);
     
-    char log_msg[512];
-    snprintf(log_msg, sizeof(log_msg), "ADD treasure %s", t.id);
-    log_operation(hunt_id, log_msg);
+    log_operation(hunt_id, LOG_ADD, t.id);
+    catalog_update(hunt_id);
+    hunt_unlock(&lock);
+    
+    // The journal sync is waited for without the lock, so adds to the
+    // same hunt can share it
+    if (!journal_commit(&pending)) {
+        perror("Error syncing treasure");
+        return;
+    }
     
     printf("Treasure '%s' added successfully to hunt '%s'\n", t.id, hunt_id);
 }
 
-void list_treasures(const char *hunt_id) {
+// filter is NULL to list everything
+void list_treasures(const char *hunt_id, const Filter *filter) {
     char filepath[PATH_MAX];
     snprintf(filepath, sizeof(filepath), "%s/%s", hunt_id, TREASURE_FILE);
     
@@ -177,56 +223,80 @@ void list_treasures(const char *hunt_id) {
         return;
     }
     
-    printf("\n=== Hunt: %s ===\n", hunt_id);
-    printf("File size: %ld bytes\n", st.st_size);
-    printf("Last modified: %s", ctime(&st.st_mtime));
-    
-    int fd = open(filepath, O_RDONLY);
-    if (fd == -1) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
         perror("Error opening treasure file");
         return;
     }
     
-    Treasure t;
+    printf("\n=== Hunt: %s ===\n", hunt_id);
+    printf("File size: %zu bytes", map.size);
+    if (map.count > 1) {
+        printf(" in %zu segments", map.count);
+    }
+    printf("\nLast modified: %s", ctime(&st.st_mtime));
+    
     printf("\nTreasures:\n");
     printf("ID\t\tUser\t\tValue\tLocation\n");
     printf("------------------------------------------------\n");
     
-    while (read(fd, &t, sizeof(Treasure)) > 0) {
+    TreasureView t;
+    size_t matched = 0;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        if (t.dead || (filter && !FILTER_MATCH(filter, &t))) {
+            continue;
+        }
         printf("%-12s\t%-12s\t%d\t(%.6f, %.6f)\n", 
                t.id, t.user_name, t.value, t.latitude, t.longitude);
+        matched++;
+    }
+    if (filter) {
+        printf("%zu matching treasures\n", matched);
     }
     
-    close(fd);
+    store_unmap(&map);
 }
 
+// Takes the hunt's lock itself: shared for the lookup, and the append
+// lock only if the index has to be rebuilt first
 void view_treasure(const char *hunt_id, const char *treasure_id) {
-    char filepath[PATH_MAX];
-    snprintf(filepath, sizeof(filepath), "%s/%s", hunt_id, TREASURE_FILE);
-    
-    int fd = open(filepath, O_RDONLY);
-    if (fd == -1) {
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        return;
+    }
+    off_t offset;
+    int indexed = index_lookup(hunt_id, treasure_id, &offset);
+    if (indexed == -1) {
+        // Missing or stale index (as in near_treasures)
+        hunt_unlock(&lock);
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return;
+        }
+        indexed = find_treasure_offset(hunt_id, treasure_id, &offset);
+    }
+
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == -1) {
         perror("Error opening treasure file");
+        hunt_unlock(&lock);
         return;
     }
     
-    Treasure t;
-    int found = 0;
-    
-    while (read(fd, &t, sizeof(Treasure)) > 0) {
-        if (strcmp(t.id, treasure_id) == 0) {
-            found = 1;
-            printf("\n=== Treasure Details ===\n");
-            printf("ID: %s\n", t.id);
-            printf("User: %s\n", t.user_name);
-            printf("Location: %.6f latitude, %.6f longitude\n", t.latitude, t.longitude);
-            printf("Clue: %s\n", t.clue);
-            printf("Value: %d\n", t.value);
-            break;
-        }
+    TreasureView t;
+    int found = indexed == 1 && store_at(&map, offset, &t) && !t.dead &&
+                strcmp(t.id, treasure_id) == 0;
+    
+    if (found) {
+        printf("\n=== Treasure Details ===\n");
+        printf("ID: %s\n", t.id);
+        printf("User: %s\n", t.user_name);
+        printf("Location: %.6f latitude, %.6f longitude\n", t.latitude, t.longitude);
+        printf("Clue: %s\n", t.clue);
+        printf("Value: %d\n", t.value);
     }
     
-    close(fd);
+    store_unmap(&map);
+    hunt_unlock(&lock);
     
     if (!found) {
         printf("Treasure '%s' not found in hunt '%s'\n", treasure_id, hunt_id);
@@ -234,56 +304,416 @@ void view_treasure(const char *hunt_id, const char *treasure_id) {
 }
 
 void remove_treasure(const char *hunt_id, const char *treasure_id) {
-    char filepath[PATH_MAX];
-    snprintf(filepath, sizeof(filepath), "%s/%s", hunt_id, TREASURE_FILE);
+    off_t offset;
+    if (!find_treasure_offset(hunt_id, treasure_id, &offset)) {
+        printf("Treasure '%s' not found in hunt '%s'\n", treasure_id, hunt_id);
+        return;
+    }
     
-    char temp_path[PATH_MAX];
-    snprintf(temp_path, sizeof(temp_path), "%s/%s.tmp", hunt_id, TREASURE_FILE);
+    // The owner and value are needed to take the treasure out of the scores
+    TreasureMap map;
+    TreasureView t;
+    char user_name[NAME_SIZE] = "";
+    int value = 0;
+    float latitude = 0, longitude = 0;
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == 0) {
+        if (store_at(&map, offset, &t)) {
+            strncpy(user_name, t.user_name, NAME_SIZE - 1);
+            value = t.value;
+            latitude = t.latitude;
+            longitude = t.longitude;
+        }
+        store_unmap(&map);
+    }
     
-    int input_fd = open(filepath, O_RDONLY);
-    if (input_fd == -1) {
-        perror("Error opening treasure file");
+    DataStamp before;
+    score_stamp(hunt_id, &before);
+    
+    // Tombstone the record in place, compaction reclaims the space later
+    if (!store_mark_dead(hunt_id, offset)) {
+        perror("Error removing treasure");
         return;
     }
     
-    int output_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (output_fd == -1) {
-        perror("Error creating temporary file");
-        close(input_fd);
+    index_remove(hunt_id, treasure_id);
+    if (user_name[0] != '\0') {
+        spatial_remove(hunt_id, latitude, longitude, offset);
+        search_remove(hunt_id, offset);
+        score_update(hunt_id, &before, user_name, -(long long)value, -1);
+    } else {
+        spatial_rebuild(hunt_id);
+        search_rebuild(hunt_id);
+        score_invalidate(hunt_id);
+    }
+    
+    log_operation(hunt_id, LOG_REMOVE, treasure_id);
+    catalog_update(hunt_id);
+    
+    printf("Treasure '%s' removed successfully from hunt '%s'\n", treasure_id, hunt_id);
+}
+
+// Reclaims the space in the background once enough of the file is dead.
+// Call without holding the hunt's lock: the child takes it exclusively.
+void compact_in_background(const char *hunt_id) {
+    if (dead_fraction(hunt_id) <= compact_threshold()) {
         return;
     }
+    fflush(stdout); // the child must not repeat buffered output
+    log_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_REWRITE, &lock)) {
+            exit(EXIT_FAILURE);
+        }
+        long dropped = compact_treasures(hunt_id, compact_threshold());
+        hunt_unlock(&lock);
+        exit(dropped == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    } else if (pid == -1) {
+        perror("Error starting compaction");
+    }
+}
+
+// A dead fraction in [0, 1] with nothing after it. 1 if text is one.
+int parse_threshold(const char *text, double *threshold) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= 0.0 && value <= 1.0)) {
+        return 0;
+    }
+    *threshold = value;
+    return 1;
+}
+
+double compact_threshold() {
+    const char *env = getenv("TREASURE_COMPACT_THRESHOLD");
+    double threshold;
+    if (env && parse_threshold(env, &threshold)) {
+        return threshold;
+    }
+    return DEFAULT_COMPACT_THRESHOLD;
+}
+
+double dead_fraction(const char *hunt_id) {
+    long live, dead;
+    if (index_stats(hunt_id, &live, &dead) == -1) {
+        if (!index_rebuild(hunt_id) || index_stats(hunt_id, &live, &dead) == -1) {
+            return 0.0;
+        }
+    }
+    if (live + dead == 0) {
+        return 0.0;
+    }
+    return (double)dead / (double)(live + dead);
+}
+
+// Rewrites the segments more than threshold dead without their tombstones,
+// each keeping its format. Returns the number of dead records dropped, or
+// -1 on error.
+long compact_treasures(const char *hunt_id, double threshold) {
+    DataStamp before;
+    score_stamp(hunt_id, &before);
+    
+    // Journal entries point at offsets in the old file, so the journal has
+    // to be emptied before the records move
+    if (!journal_checkpoint(hunt_id)) {
+        perror("Error syncing journal");
+        return -1;
+    }
+    long dropped = store_rewrite(hunt_id, 0, threshold);
+    if (dropped == -1) {
+        perror("Error rewriting treasure file");
+        return -1;
+    }
     
-    Treasure t;
-    int found = 0;
+    // Surviving records moved, so re-sync the indexes; the totals are
+    // unchanged and only need the new file's stamp
+    index_rebuild(hunt_id);
+    spatial_rebuild(hunt_id);
+    search_rebuild(hunt_id);
+    score_update(hunt_id, &before, NULL, 0, 0);
     
-    while (read(input_fd, &t, sizeof(Treasure)) > 0) {
-        if (strcmp(t.id, treasure_id) == 0) {
-            found = 1;
-            continue; // Skip writing this treasure to the temp file
+    char log_msg[512];
+    snprintf(log_msg, sizeof(log_msg), "dropped %ld dead treasures", dropped);
+    log_operation(hunt_id, LOG_COMPACT, log_msg);
+    catalog_update(hunt_id);
+    return dropped;
+}
+
+void compact_hunt(const char *hunt_id, double threshold) {
+    double fraction = dead_fraction(hunt_id);
+    if (fraction <= threshold) {
+        printf("Hunt '%s' is %.1f%% dead, below the %.1f%% threshold; nothing to compact\n",
+               hunt_id, fraction * 100.0, threshold * 100.0);
+        return;
+    }
+    
+    long dropped = compact_treasures(hunt_id, threshold);
+    if (dropped == -1) {
+        fprintf(stderr, "Failed to compact hunt '%s'\n", hunt_id);
+        return;
+    }
+    printf("Hunt '%s' compacted, %ld dead treasures reclaimed\n", hunt_id, dropped);
+}
+
+void migrate_hunt(const char *hunt_id) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == -1) {
+        perror("Error opening treasure file");
+        return;
+    }
+    // Segments sealed before an upgrade keep the layout they were written in
+    int version = STORE_VERSION;
+    for (size_t i = 0; i < map.count; i++) {
+        if (map.segments[i].version < version) {
+            version = map.segments[i].version;
         }
-        write(output_fd, &t, sizeof(Treasure));
     }
+    size_t old_size = map.size;
+    store_unmap(&map);
     
-    close(input_fd);
-    close(output_fd);
+    if (version == STORE_VERSION) {
+        printf("Hunt '%s' already uses the v%d format\n", hunt_id, STORE_VERSION);
+        return;
+    }
     
-    if (!found) {
-        printf("Treasure '%s' not found in hunt '%s'\n", treasure_id, hunt_id);
-        unlink(temp_path);
+    DataStamp before;
+    score_stamp(hunt_id, &before);
+    
+    if (!journal_checkpoint(hunt_id)) {
+        perror("Error syncing journal");
         return;
     }
     
-    // Replace original file with temp file
-    if (rename(temp_path, filepath) == -1) {
-        perror("Error replacing treasure file");
+    // Removed treasures are not carried over
+    long dropped = store_rewrite(hunt_id, STORE_VERSION, 1.0);
+    if (dropped == -1) {
+        perror("Error migrating treasure file");
+        return;
+    }
+    index_rebuild(hunt_id);
+    spatial_rebuild(hunt_id);
+    search_rebuild(hunt_id);
+    score_update(hunt_id, &before, NULL, 0, 0);
+    
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == -1) {
+        perror("Error opening treasure file");
         return;
     }
+    size_t new_size = map.size;
+    store_unmap(&map);
     
     char log_msg[512];
-    snprintf(log_msg, sizeof(log_msg), "REMOVE treasure %s", treasure_id);
-    log_operation(hunt_id, log_msg);
+    snprintf(log_msg, sizeof(log_msg), "v%d -> v%d (%zu -> %zu bytes)", version, STORE_VERSION,
+             old_size, new_size);
+    log_operation(hunt_id, LOG_MIGRATE, log_msg);
+    catalog_update(hunt_id);
     
-    printf("Treasure '%s' removed successfully from hunt '%s'\n", treasure_id, hunt_id);
+    printf("Hunt '%s' migrated to v%d: %zu -> %zu bytes, %ld removed treasures dropped\n",
+           hunt_id, STORE_VERSION, old_size, new_size, dropped);
+}
+
+void import_hunt(const char *hunt_id, const char *source) {
+    FILE *in = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+    if (!in) {
+        perror("Error opening import file");
+        return;
+    }
+    
+    int mode = journal_mode();
+    
+    DataStamp before;
+    score_stamp(hunt_id, &before);
+    
+    ScoreTable delta;
+    int have_delta = score_init(&delta) == 0;
+    
+    long skipped;
+    long imported = import_treasures(hunt_id, in, &skipped, have_delta ? &delta : NULL);
+    if (in != stdin) {
+        fclose(in);
+    }
+    
+    // A bulk load is one group: a single sync once everything is written
+    if (mode != SYNC_NONE && !journal_checkpoint(hunt_id)) {
+        perror("Error syncing treasure file");
+    }
+    
+    // Whatever reached the file, bring the index in line with it in one pass,
+    // and fold the batch into the score table in one write
+    index_rebuild(hunt_id);
+    spatial_rebuild(hunt_id);
+    search_rebuild(hunt_id);
+    if (imported != -1 && have_delta) {
+        score_update_batch(hunt_id, &before, &delta);
+    } else {
+        score_invalidate(hunt_id);
+    }
+    if (have_delta) {
+        score_free(&delta);
+    }
+    catalog_update(hunt_id);
+    
+    if (imported == -1) {
+        perror("Error importing treasures");
+        return;
+    }
+    
+    // One summarized log entry for the whole batch
+    char log_msg[512];
+    snprintf(log_msg, sizeof(log_msg), "%ld treasures from %s (%ld skipped)",
+             imported, strcmp(source, "-") == 0 ? "stdin" : source, skipped);
+    log_operation(hunt_id, LOG_IMPORT, log_msg);
+    
+    printf("Imported %ld treasures into hunt '%s', %ld lines skipped\n", imported, hunt_id, skipped);
+}
+
+// Treasures within radius_m metres of a point, nearest first
+void near_treasures(const char *hunt_id, double latitude, double longitude, double radius_m) {
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        return;
+    }
+    SpatialHit *hits;
+    long count = spatial_near(hunt_id, latitude, longitude, radius_m, &hits);
+    if (count == -1) {
+        // Missing or stale spatial index, rebuild it once. That writes the
+        // index, so it waits for the append lock and keeps adds out until
+        // the query is done.
+        hunt_unlock(&lock);
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return;
+        }
+        if (!spatial_rebuild(hunt_id)) {
+            hunt_unlock(&lock);
+            return;
+        }
+        count = spatial_near(hunt_id, latitude, longitude, radius_m, &hits);
+        if (count == -1) {
+            perror("Error reading spatial index");
+            hunt_unlock(&lock);
+            return;
+        }
+    }
+    
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == -1) {
+        perror("Error opening treasure file");
+        hunt_unlock(&lock);
+        free(hits);
+        return;
+    }
+    
+    printf("\nTreasures within %.0f m of (%.6f, %.6f) in hunt '%s':\n", radius_m, latitude, longitude, hunt_id);
+    printf("ID\t\tUser\t\tValue\tDistance\n");
+    printf("------------------------------------------------\n");
+    for (long i = 0; i < count; i++) {
+        TreasureView t;
+        if (store_at(&map, hits[i].offset, &t) && !t.dead) {
+            printf("%-12s\t%-12s\t%d\t%.1f m\n", t.id, t.user_name, t.value, hits[i].distance);
+        }
+    }
+    if (count == 0) {
+        printf("No treasures found\n");
+    }
+    
+    store_unmap(&map);
+    hunt_unlock(&lock);
+    free(hits);
+}
+
+// Treasures whose clue contains every word of query, in file order
+void search_treasures(const char *hunt_id, const char *query) {
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        return;
+    }
+    off_t *offsets;
+    long count = search_clues(hunt_id, query, &offsets);
+    if (count == -1) {
+        // Missing or stale clue index, rebuild it once (under the append
+        // lock, as in near_treasures)
+        hunt_unlock(&lock);
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return;
+        }
+        if (!search_rebuild(hunt_id)) {
+            hunt_unlock(&lock);
+            return;
+        }
+        count = search_clues(hunt_id, query, &offsets);
+        if (count == -1) {
+            perror("Error reading clue index");
+            hunt_unlock(&lock);
+            return;
+        }
+    }
+    
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_LOOKUP) == -1) {
+        perror("Error opening treasure file");
+        hunt_unlock(&lock);
+        free(offsets);
+        return;
+    }
+    
+    printf("\nTreasures matching '%s' in hunt '%s':\n", query, hunt_id);
+    printf("ID\t\tUser\t\tValue\tClue\n");
+    printf("------------------------------------------------\n");
+    long shown = 0;
+    for (long i = 0; i < count; i++) {
+        TreasureView t;
+        if (store_at(&map, offsets[i], &t) && !t.dead) {
+            printf("%-12s\t%-12s\t%d\t%s\n", t.id, t.user_name, t.value, t.clue);
+            shown++;
+        }
+    }
+    if (shown == 0) {
+        printf("No treasures found\n");
+    }
+    
+    store_unmap(&map);
+    hunt_unlock(&lock);
+    free(offsets);
+}
+
+// Replays the journal after a crash (or always with force) and brings the
+// indexes and scores back in line if treasures.dat changed
+void recover_hunt(const char *hunt_id, int force) {
+    if (!force && !journal_stale(hunt_id)) {
+        return;
+    }
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_REWRITE, &lock)) {
+        fprintf(stderr, "Failed to recover hunt '%s'\n", hunt_id);
+        return;
+    }
+    int changed = journal_recover(hunt_id, force);
+    if (changed == 1) {
+        index_rebuild(hunt_id);
+        spatial_rebuild(hunt_id);
+        search_rebuild(hunt_id);
+        score_invalidate(hunt_id);
+        log_operation(hunt_id, LOG_RECOVER, NULL);
+        catalog_update(hunt_id);
+    }
+    hunt_unlock(&lock);
+    if (force) {
+        if (changed == -1) {
+            fprintf(stderr, "Failed to recover hunt '%s'\n", hunt_id);
+        } else {
+            printf(changed ? "Hunt '%s' recovered from its journal\n" : "Hunt '%s' needed no recovery\n", hunt_id);
+        }
+    }
+}
+
+void rebuild_index(const char *hunt_id) {
+    if (!index_rebuild(hunt_id)) {
+        fprintf(stderr, "Failed to rebuild index for hunt '%s'\n", hunt_id);
+        return;
+    }
+    printf("Index rebuilt for hunt '%s'\n", hunt_id);
 }
 
 void remove_hunt(const char *hunt_id) {
@@ -299,10 +729,27 @@ void remove_hunt(const char *hunt_id) {
     char symlink_name[PATH_MAX];
     snprintf(symlink_name, sizeof(symlink_name), "logged_hunt-%s", hunt_id);
     unlink(symlink_name);
+    catalog_remove(hunt_id);
     
     printf("Hunt '%s' removed successfully\n", hunt_id);
 }
 
+// Returns 1 if the catalog matches the hunts (or was repaired), 0 if not
+int verify_catalog(int repair) {
+    long differences = catalog_verify(stdout, repair);
+    if (differences == -1) {
+        fprintf(stderr, "Failed to verify the hunt catalog\n");
+        return 0;
+    }
+    if (differences == 0) {
+        printf("Catalog matches the hunts\n");
+        return 1;
+    }
+    printf(repair ? "%ld differences, catalog rewritten\n" : "%ld differences, run with --repair to fix them\n",
+           differences);
+    return repair;
+}
+
 int hunt_exists(const char *hunt_id) {
     struct stat st;
     return (stat(hunt_id, &st) == 0 && S_ISDIR(st.st_mode));
@@ -311,6 +758,15 @@ int hunt_exists(const char *hunt_id) {
 //-------------------------THE MAIN FUNCTION--------------------//
 
 int main(int argc, char *argv[]) {
+    // The one operation that is not about a single hunt
+    if (argc >= 2 && strcmp(argv[1], "--verify_catalog") == 0) {
+        int repair = argc == 3 && strcmp(argv[2], "--repair") == 0;
+        if (argc > 3 || (argc == 3 && !repair)) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        return verify_catalog(repair) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (argc < 3) {
         print_usage();
         return EXIT_FAILURE;
@@ -331,7 +787,23 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
             return EXIT_FAILURE;
         }
-        list_treasures(hunt_id);
+        // Predicates may come as one argument or several
+        char text[FILTER_TEXT_SIZE], error[128];
+        Filter filter;
+        if (filter_join(argc - 3, argv + 3, text, sizeof(text)) == -1) {
+            fprintf(stderr, "Filter too long\n");
+            return EXIT_FAILURE;
+        }
+        if (filter_parse(text, &filter, error, sizeof(error)) == -1) {
+            fprintf(stderr, "%s\n", error);
+            return EXIT_FAILURE;
+        }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+            return EXIT_FAILURE;
+        }
+        list_treasures(hunt_id, argc > 3 ? &filter : NULL);
+        hunt_unlock(&lock);
     }
     else if (strcmp(operation, "--view") == 0 && argc == 4) {
         if (!hunt_exists(hunt_id)) {
@@ -345,14 +817,25 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
             return EXIT_FAILURE;
         }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return EXIT_FAILURE;
+        }
         remove_treasure(hunt_id, argv[3]);
+        hunt_unlock(&lock);
+        compact_in_background(hunt_id);
     }
     else if (strcmp(operation, "--remove_hunt") == 0) {
         if (!hunt_exists(hunt_id)) {
             fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
             return EXIT_FAILURE;
         }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_REWRITE, &lock)) {
+            return EXIT_FAILURE;
+        }
         remove_hunt(hunt_id);
+        hunt_unlock(&lock);
     }
     else if (strcmp(operation, "--view_log") == 0) {
         if (!hunt_exists(hunt_id)) {
@@ -361,6 +844,100 @@ int main(int argc, char *argv[]) {
         }
         view_log(hunt_id);
     }
+    else if (strcmp(operation, "--rebuild_index") == 0) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return EXIT_FAILURE;
+        }
+        rebuild_index(hunt_id);
+        hunt_unlock(&lock);
+    }
+    else if (strcmp(operation, "--compact") == 0) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        double threshold = compact_threshold();
+        if (argc > 4 || (argc == 4 && !parse_threshold(argv[3], &threshold))) {
+            fprintf(stderr, "The threshold is a dead fraction between 0 and 1\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_REWRITE, &lock)) {
+            return EXIT_FAILURE;
+        }
+        compact_hunt(hunt_id, threshold);
+        hunt_unlock(&lock);
+    }
+    else if (strcmp(operation, "--import") == 0 && argc == 4) {
+        if (!create_hunt_directory(hunt_id)) {
+            fprintf(stderr, "Failed to create/access hunt directory\n");
+            return EXIT_FAILURE;
+        }
+        if (journal_mode() != SYNC_NONE) {
+            recover_hunt(hunt_id, 0);
+        }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            return EXIT_FAILURE;
+        }
+        import_hunt(hunt_id, argv[3]);
+        hunt_unlock(&lock);
+    }
+    else if (strcmp(operation, "--near") == 0 && argc == 6) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        char *end1, *end2, *end3;
+        double latitude = strtod(argv[3], &end1);
+        double longitude = strtod(argv[4], &end2);
+        double radius_m = strtod(argv[5], &end3);
+        if (*end1 || *end2 || *end3 || latitude < -90 || latitude > 90 ||
+            longitude < -180 || longitude > 180 || radius_m < 0) {
+            fprintf(stderr, "Invalid coordinates or radius\n");
+            return EXIT_FAILURE;
+        }
+        near_treasures(hunt_id, latitude, longitude, radius_m);
+    }
+    else if (strcmp(operation, "--search") == 0 && argc >= 4) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        // The words may come as one argument or several
+        char query[CLUE_SIZE];
+        query[0] = '\0';
+        for (int i = 3; i < argc; i++) {
+            size_t len = strlen(query);
+            snprintf(query + len, sizeof(query) - len, "%s%s", len ? " " : "", argv[i]);
+        }
+        search_treasures(hunt_id, query);
+    }
+    else if (strcmp(operation, "--recover") == 0) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        recover_hunt(hunt_id, 1);
+    }
+    else if (strcmp(operation, "--migrate") == 0) {
+        if (!hunt_exists(hunt_id)) {
+            fprintf(stderr, "Hunt '%s' does not exist\n", hunt_id);
+            return EXIT_FAILURE;
+        }
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_REWRITE, &lock)) {
+            return EXIT_FAILURE;
+        }
+        migrate_hunt(hunt_id);
+        hunt_unlock(&lock);
+    }
     else {
         print_usage();
         return EXIT_FAILURE;
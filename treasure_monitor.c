@@ -1,91 +1,214 @@
-// ========================== treasure_monitor.c (stdout flush version) ==========================
+// ========================== treasure_monitor.c (framed pipe version) ==========================
 #include "treasure.h"
+#include "treasure_proto.h"
+#include "treasure_score.h"
+#include "treasure_cache.h"
+#include "treasure_store.h"
+#include "treasure_spatial.h"
+#include "treasure_search.h"
+#include "treasure_lock.h"
+#include "treasure_stats.h"
+#include "treasure_catalog.h"
+#include "treasure_column.h"
+#include "treasure_filter.h"
+#include "treasure_index.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <limits.h>
 
 
 #define MAX_INPUT_SIZE 512
-#define COMMAND_FILE ".monitor_command"
+#define DEFAULT_LEADERBOARD_SIZE 10
+#define MIN_MONITOR_WORKERS 4
+#define VIEW_TEXT_SIZE (ID_SIZE + NAME_SIZE + CLUE_SIZE + 128)
 
-volatile bool running = true;
+int request_fd = -1;   // REQUEST frames from the hub
+int response_fd = -1;  // DATA/END frames back to the hub
 
-// Function prototypes
-void handle_sigusr1(int sig);
-void handle_sigusr2(int sig);
-void setup_signal_handlers();
-void process_command();
-void list_all_hunts();
-void list_hunt_treasures(const char *hunt_id);
-void calculate_score();
-void view_specific_treasure(const char *hunt_id, const char *treasure_id);
-
-// Signal handler for SIGUSR1 (stop)
-void handle_sigusr1(int sig) {
-    (void)sig;
-    running = false;
-}
+// A request read by the event loop, waiting for a worker
+typedef struct Request {
+    uint32_t id;
+    char *command;
+    uint64_t received;       // stats_now() when it was read
+    struct Request *next;
+} Request;
 
-// Signal handler for SIGUSR2 (new command)
-void handle_sigusr2(int sig) {
-    (void)sig;
-    //usleep(5000);
-    process_command();
-}
+// Requests in arrival order; closed once the monitor is stopping
+typedef struct {
+    Request *head;
+    Request *tail;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} RequestQueue;
 
-// Setup signal handlers
-void setup_signal_handlers() {
-    struct sigaction sa;
+RequestQueue queue = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// The cache is not thread safe: workers take cache_lock around every use,
+// and leaderboard_lock around the leaderboard and its per-hunt shares
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t leaderboard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function prototypes
+int setup_signal_handlers();
+int monitor_worker_limit();
+void queue_push(Request *request);
+Request *queue_pop();
+void queue_close();
+void *request_worker(void *arg);
+void cache_enter();
+void cache_leave();
+void process_command(char *cmd, uint32_t request_id, uint64_t received);
+void list_all_hunts(FILE *out);
+CachedHunt *open_hunt(FILE *out, const char *hunt_id);
+void list_hunt_treasures(FILE *out, const char *args);
+void calculate_score(FILE *out, size_t top_n);
+int refresh_leaderboard();
+void show_leaderboard(FILE *out, size_t top_n);
+void show_rank(FILE *out, const char *user_name);
+void near_treasures(FILE *out, char *args);
+long search_hunt(FILE *out, const char *hunt_id, const char *query);
+void search_treasures(FILE *out, char *args);
+int score_worker_limit();
+void format_treasure(char *buf, size_t size, const char *id, const char *user_name,
+                     float latitude, float longitude, const char *clue, int value);
+int find_cached(const CachedHunt *hunt, const char *treasure_id, char *buf, size_t size);
+void view_specific_treasure(FILE *out, const char *hunt_id, const char *treasure_id);
+void show_values(FILE *out, const char *args);
+void show_stats(FILE *out, const char *arg);
 
-    // SIGUSR1 handler
-    sa.sa_handler = handle_sigusr1;
+// Setup signal handlers. SIGUSR1 (stop) is blocked in every thread and read
+// from the returned signalfd by the event loop instead of interrupting a
+// thread wherever it is. Call before starting any thread.
+int setup_signal_handlers() {
+    struct sigaction sa;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
-        perror("sigaction SIGUSR1");
+    sa.sa_flags = 0;
+
+    // Ignore SIGCHLD
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction SIGCHLD");
         exit(EXIT_FAILURE);
     }
 
-    // SIGUSR2 handler
-    sa.sa_handler = handle_sigusr2;
-    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
-        perror("sigaction SIGUSR2");
+    // A hub that went away shows up as a failed write, not a fatal signal
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction SIGPIPE");
         exit(EXIT_FAILURE);
     }
 
-    // Ignore SIGCHLD
-    sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction SIGCHLD");
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &stop, NULL) != 0) {
+        perror("pthread_sigmask");
         exit(EXIT_FAILURE);
     }
+    int fd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Request workers, TREASURE_MONITOR_WORKERS or one per core. Requests also
+// wait on the disk and on hunt locks, so there are never fewer than
+// MIN_MONITOR_WORKERS by default.
+int monitor_worker_limit() {
+    const char *env = getenv("TREASURE_MONITOR_WORKERS");
+    int limit = env ? atoi(env) : 0;
+    if (limit <= 0) {
+        limit = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (limit < MIN_MONITOR_WORKERS) {
+            limit = MIN_MONITOR_WORKERS;
+        }
+    }
+    return limit;
 }
 
-// Process command from hub
-void process_command() {
-    char cmd[MAX_INPUT_SIZE] = {0};
+void queue_push(Request *request) {
+    pthread_mutex_lock(&queue.lock);
+    request->next = NULL;
+    if (queue.tail) {
+        queue.tail->next = request;
+    } else {
+        queue.head = request;
+    }
+    queue.tail = request;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
 
-    FILE *cmd_file = fopen(COMMAND_FILE, "r");
-    if (!cmd_file) {
-        perror("fopen command file");
-        return;
+// Next request, waiting for one; NULL once the queue is closed and empty
+Request *queue_pop() {
+    pthread_mutex_lock(&queue.lock);
+    while (!queue.head && !queue.closed) {
+        pthread_cond_wait(&queue.ready, &queue.lock);
+    }
+    Request *request = queue.head;
+    if (request) {
+        queue.head = request->next;
+        if (!queue.head) {
+            queue.tail = NULL;
+        }
     }
+    pthread_mutex_unlock(&queue.lock);
+    return request;
+}
+
+// No more requests: workers finish the queued ones and return
+void queue_close() {
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Worker thread: runs requests as they come. Each answer is streamed on
+// the shared response pipe; frames are atomic writes, so answers being
+// produced at the same time interleave only at frame boundaries.
+void *request_worker(void *arg) {
+    (void)arg;
+    Request *request;
+    while ((request = queue_pop()) != NULL) {
+        process_command(request->command, request->id, request->received);
+        free(request->command);
+        free(request);
+    }
+    return NULL;
+}
+
+// Takes the cache for this thread, with whatever changed on disk applied
+void cache_enter() {
+    pthread_mutex_lock(&cache_lock);
+    cache_refresh();
+}
+
+void cache_leave() {
+    pthread_mutex_unlock(&cache_lock);
+}
 
-    if (!fgets(cmd, MAX_INPUT_SIZE, cmd_file)) {
-        fclose(cmd_file);
-        unlink(COMMAND_FILE);
+// Run one command from the hub, streaming its output back as frames
+void process_command(char *cmd, uint32_t request_id, uint64_t received) {
+    FILE *out = proto_stream(response_fd, request_id);
+    if (!out) {
+        perror("proto_stream");
         return;
     }
-    fclose(cmd_file);
-    unlink(COMMAND_FILE);
 
     cmd[strcspn(cmd, "\n")] = '\0';
 
@@ -95,170 +218,894 @@ void process_command() {
         *space = '\0';
         arg = space + 1;
     }
+    int command = stats_command(cmd);
+    stats_begin(command);
 
+    uint64_t handler_start = stats_now();
     if (strcmp(cmd, "list_hunts") == 0) {
-        list_all_hunts();
+        list_all_hunts(out);
     } else if (strcmp(cmd, "list_treasures") == 0 && arg) {
-        list_hunt_treasures(arg);
+        list_hunt_treasures(out, arg);
     } else if (strcmp(cmd, "view_treasure") == 0 && arg) {
         char *treasure_space = strchr(arg, ' ');
         if (treasure_space) {
             *treasure_space = '\0';
             char *treasure_id = treasure_space + 1;
-            view_specific_treasure(arg, treasure_id);
+            view_specific_treasure(out, arg, treasure_id);
         } else {
-            printf("Error: Missing treasure ID\n");
+            fprintf(out, "Error: Missing treasure ID\n");
         }
     } else if (strcmp(cmd, "calculate_score") == 0) {
-        calculate_score(); 
-    }else {
-        printf("Error: Unknown or empty command: '%s'\n", cmd);
+        calculate_score(out, arg ? strtoul(arg, NULL, 10) : 0); 
+    } else if (strcmp(cmd, "leaderboard") == 0) {
+        show_leaderboard(out, arg ? strtoul(arg, NULL, 10) : DEFAULT_LEADERBOARD_SIZE);
+    } else if (strcmp(cmd, "rank") == 0 && arg) {
+        show_rank(out, arg);
+    } else if (strcmp(cmd, "near") == 0 && arg) {
+        near_treasures(out, arg);
+    } else if (strcmp(cmd, "search") == 0 && arg) {
+        search_treasures(out, arg);
+    } else if (strcmp(cmd, "values") == 0 && arg) {
+        show_values(out, arg);
+    } else if (strcmp(cmd, "stats") == 0) {
+        show_stats(out, arg);
+    } else {
+        fprintf(out, "Error: Unknown or empty command: '%s'\n", cmd);
     }
-    fflush(stdout);
+    uint64_t handler_ns = stats_now() - handler_start;
+    fclose(out); // flushes the rest and sends the END frame
+    stats_record(command, handler_ns, stats_now() - received);
 }
 
-// List all hunts
-void list_all_hunts() {
-    DIR *dir = opendir(".");
-    struct dirent *entry;
-    printf("Available hunts:\n");
-    if (!dir) {
-        perror("opendir");
-        printf("Error: Could not list hunts\n");
+// List all hunts, from hunts.cat: one read whatever the number of hunts
+void list_all_hunts(FILE *out) {
+    fprintf(out, "Available hunts:\n");
+    CatalogEntry *entries;
+    long listed = catalog_read(&entries);
+    if (listed != -1) {
+        int count = 0;
+        for (long i = 0; i < listed; i++) {
+            if (entries[i].flags & CATALOG_HAS_DATA) {
+                fprintf(out, "- %s (%lld treasures, %lld removed)\n", entries[i].name,
+                        (long long)entries[i].live, (long long)entries[i].dead);
+                count++;
+            }
+        }
+        stats_io(sizeof(CatalogEntry) * (uint64_t)listed, (uint64_t)listed);
+        free(entries);
+        if (count == 0) {
+            fprintf(out, "No hunts found\n");
+        }
+        fflush(out);
         return;
     }
 
+    // No catalog yet (hunts made before it existed): use the cached listing,
+    // formatted in memory and written once the cache is let go
+    char *text = NULL;
+    size_t len = 0;
+    FILE *block = open_memstream(&text, &len);
+    if (!block) {
+        fprintf(out, "Error: Out of memory\n");
+        fflush(out);
+        return;
+    }
+    cache_enter();
+    size_t n;
+    CachedHunt **hunts = cache_hunts(&n);
     int count = 0;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            char path[MAX_INPUT_SIZE];
-            snprintf(path, sizeof(path), "%s/treasures.dat", entry->d_name);
-            struct stat st;
-            if (stat(path, &st) == 0) {
-                int num_treasures = st.st_size / sizeof(Treasure);
-                printf("- %s (%d treasures)\n", entry->d_name, num_treasures);
-                count++;
-            }
+    for (size_t i = 0; i < n; i++) {
+        if (hunts[i]->has_data) {
+            fprintf(block, "- %s (%ld treasures, %ld removed)\n", hunts[i]->name, hunts[i]->live, hunts[i]->dead);
+            count++;
         }
     }
-    closedir(dir);
+    cache_leave();
+    fclose(block);
+    fwrite(text, 1, len, out);
+    free(text);
     if (count == 0) {
-        printf("No hunts found\n");
+        fprintf(out, "No hunts found\n");
+    }
+    fflush(out);
+}
+
+// Get a hunt's resident records, reporting hunts that have no treasure file.
+// The caller holds the cache (cache_enter).
+CachedHunt *open_hunt(FILE *out, const char *hunt_id) {
+    CachedHunt *hunt = cache_hunt(hunt_id);
+    if (!hunt) {
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
     }
-    fflush(stdout);
+    return hunt;
 }
 
-// List all treasures in a hunt
-void list_hunt_treasures(const char *hunt_id) {
-    char path[MAX_INPUT_SIZE];
-    snprintf(path, sizeof(path), "%s/treasures.dat", hunt_id);
-    FILE *treasure_file = fopen(path, "rb");
-    if (!treasure_file) {
-        printf("Error: Could not open hunt '%s'\n", hunt_id);
+// list_treasures <hunt> [limit] [cursor] [where <filter>]: treasures
+// straight from the mapped segments, in file order. A filter is checked
+// on each decoded record before it is formatted or counted against the
+// limit: a page holds `limit` matches, its cursor points at the next one,
+// and only matches cross the pipe. With a limit only that many are
+// sent, followed by a cursor line for the next page; the cursor is the
+// next record's offset tied to the inode of its segment file, since
+// compacting a segment (which writes a new file) moves its records. A
+// segment being sealed keeps its inode. Without a limit the whole
+// hunt is streamed: rows leave in frames as they are formatted and the
+// response pipe blocks the monitor whenever the hub falls behind, so
+// nothing but the stream buffer is held whatever the hunt size.
+void list_hunt_treasures(FILE *out, const char *args) {
+    Filter filter;
+    int filtered = 0;
+    const char *where = strstr(args, " where ");
+    char head[MAX_INPUT_SIZE];
+    snprintf(head, sizeof(head), "%.*s", where ? (int)(where - args) : (int)strlen(args), args);
+    if (where) {
+        char error[128];
+        if (filter_parse(where + strlen(" where "), &filter, error, sizeof(error)) == -1) {
+            fprintf(out, "Error: %s\n", error);
+            return;
+        }
+        filtered = 1;
+    }
+
+    char hunt_id[NAME_MAX + 1];
+    unsigned long limit = 0;
+    char cursor[64] = "";
+    if (sscanf(head, "%255s %lu %63s", hunt_id, &limit, cursor) < 1) {
+        fprintf(out, "Error: Usage: list_treasures <hunt> [limit] [cursor] [where <filter>]\n");
         return;
     }
-    printf("Treasures in hunt '%s':\n", hunt_id);
-    Treasure t;
-    while (fread(&t, sizeof(Treasure), 1, treasure_file) == 1) {
-        printf("- ID: %s, User: %s, Value: %d\n", t.id, t.user_name, t.value);
+
+    size_t pos = 0;
+    unsigned long long cursor_inode = 0, cursor_offset = 0;
+    if (cursor[0] && sscanf(cursor, "%llx.%llx", &cursor_inode, &cursor_offset) != 2) {
+        fprintf(out, "Error: Invalid cursor '%s'\n", cursor);
+        return;
     }
-    fclose(treasure_file);
-    fflush(stdout);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+        return;
+    }
+    struct stat st;
+    TreasureMap map;
+    if (stat(path, &st) == -1 || store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        hunt_unlock(&lock);
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+        return;
+    }
+    if (cursor[0]) {
+        const StoreSegment *seg = store_segment_at(&map, (off_t)cursor_offset);
+        if (!seg || cursor_inode != (unsigned long long)seg->inode ||
+            (off_t)cursor_offset < seg->base + (off_t)seg->data_start) {
+            store_unmap(&map);
+            hunt_unlock(&lock);
+            fprintf(out, "Error: Cursor is out of date, the hunt was compacted; start over\n");
+            return;
+        }
+        // Past the end (a torn record was cut since) just ends the list
+        pos = cursor_offset < (unsigned long long)map.end ? (size_t)cursor_offset : (size_t)map.end;
+    }
+
+    fprintf(out, "Treasures in hunt '%s':\n", hunt_id);
+    size_t start = pos;
+    unsigned long sent = 0, scanned = 0;
+    TreasureView t;
+    int more = 0;
+    while (store_next(&map, &pos, &t)) {
+        scanned++;
+        if (t.dead || (filtered && !FILTER_MATCH(&filter, &t))) {
+            continue;
+        }
+        if (limit > 0 && sent == limit) {
+            more = 1; // a live record is left: the next page starts with it
+            pos = (size_t)t.offset;
+            break;
+        }
+        fprintf(out, "- ID: %s, User: %s, Value: %d\n", t.id, t.user_name, t.value);
+        sent++;
+    }
+    stats_io(pos > start ? pos - start : 0, scanned);
+    unsigned long long next_inode = more ? (unsigned long long)store_segment_at(&map, (off_t)pos)->inode : 0;
+    store_unmap(&map);
+    hunt_unlock(&lock);
+
+    if (sent == 0) {
+        fprintf(out, filtered ? "No matching treasures\n" : "No treasures found\n");
+    }
+    if (more) {
+        // In a frame of its own, so a client finds it without parsing rows
+        fflush(out);
+        fprintf(out, PROTO_CURSOR_PREFIX "%llx.%zx\n", next_inode, pos);
+    }
+    fflush(out);
+}
+
+// One hunt to score and the text block produced for it
+typedef struct {
+    char name[NAME_MAX + 1];
+    char *output;
+    size_t len;
+    int done;
+} ScoreJob;
+
+// State shared by the scoring threads of one calculate_score request
+typedef struct {
+    ScoreJob *jobs;
+    size_t count;
+    size_t next;         // next job to hand out
+    size_t top_n;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} ScoreRun;
+
+// Concurrent scoring threads, TREASURE_SCORE_WORKERS or one per core
+int score_worker_limit() {
+    const char *env = getenv("TREASURE_SCORE_WORKERS");
+    int limit = env ? atoi(env) : 0;
+    if (limit <= 0) {
+        limit = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return limit > 0 ? limit : 1;
+}
+
+// Collect every hunt with a treasure file, sorted so the output order is stable
+ScoreJob *collect_hunts(size_t *count) {
+    cache_enter();
+    size_t n;
+    CachedHunt **hunts = cache_hunts(&n);
+    ScoreJob *jobs = calloc(n ? n : 1, sizeof(ScoreJob));
+    if (!jobs) {
+        cache_leave();
+        perror("calloc");
+        return NULL;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (hunts[i]->has_data) {
+            strcpy(jobs[used++].name, hunts[i]->name); // both are NAME_MAX + 1
+        }
+    }
+    cache_leave();
+    *count = used; // the cache keeps them sorted by name
+    return jobs;
 }
 
-// Calculate the score per player
-void calculate_score() {
-    DIR *dir = opendir(".");
-    if (!dir) {
-        perror("opendir");
+// Scoring thread: takes hunts off the shared list until none are left
+void *score_worker(void *arg) {
+    ScoreRun *run = arg;
+    stats_begin(STAT_CALCULATE);
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        size_t i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->count) {
+            break;
+        }
+
+        ScoreJob *job = &run->jobs[i];
+        FILE *block = open_memstream(&job->output, &job->len);
+        ScoreTable table;
+        if (block && score_init(&table) == 0) {
+            // Directories without a treasure file produce no block
+            if (score_load_hunt(job->name, &table) == 0) {
+                score_print(block, job->name, &table, run->top_n);
+            }
+            score_free(&table);
+            uint64_t bytes, records;
+            score_io(&bytes, &records);
+            stats_io(bytes, records);
+        }
+        if (block) {
+            fclose(block);
+        }
+
+        pthread_mutex_lock(&run->lock);
+        job->done = 1;
+        pthread_cond_signal(&run->job_done);
+        pthread_mutex_unlock(&run->lock);
+    }
+    return NULL;
+}
+
+// Calculate the score per player. Hunts are scored in process by up to
+// score_worker_limit() threads; each hunt's block is printed in name order
+// as soon as it and every hunt before it are done.
+void calculate_score(FILE *out, size_t top_n) {
+    ScoreRun run;
+    memset(&run, 0, sizeof(run));
+    run.jobs = collect_hunts(&run.count);
+    run.top_n = top_n;
+    if (!run.jobs) {
+        fflush(out);
         return;
     }
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.job_done, NULL);
 
-    struct dirent *entry;
-    pid_t child_pids[100];
-    int child_count = 0;
-
-    while ((entry = readdir(dir))) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-
-            int fd[2];
-            pipe(fd);
-            pid_t pid = fork();
-
-            if (pid == 0) {
-                // Child
-                close(fd[0]);
-                dup2(fd[1], STDOUT_FILENO);
-                close(fd[1]);
-                execl("./score_calc", "score_calc", entry->d_name, NULL);
-                perror("execl");
-                exit(EXIT_FAILURE);
-            } else {
-                // Parent
-                close(fd[1]);
-                char buffer[512];
-                ssize_t n;
-                while ((n = read(fd[0], buffer, sizeof(buffer) - 1)) > 0) {
-                    buffer[n] = '\0';
-                    printf("%s", buffer);
-                }
-                close(fd[0]);
+    size_t workers = (size_t)score_worker_limit();
+    if (workers > run.count) {
+        workers = run.count;
+    }
+    pthread_t *threads = malloc((workers ? workers : 1) * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads && started < workers &&
+           pthread_create(&threads[started], NULL, score_worker, &run) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        score_worker(&run); // no threads available, score inline
+    }
+    stats_threads(started);
 
-                child_pids[child_count++] = pid;
+    for (size_t i = 0; i < run.count; i++) {
+        pthread_mutex_lock(&run.lock);
+        while (!run.jobs[i].done) {
+            pthread_cond_wait(&run.job_done, &run.lock);
+        }
+        pthread_mutex_unlock(&run.lock);
 
-                printf("\n");
-                fflush(stdout);
+        if (run.jobs[i].len > 0) {
+            fwrite(run.jobs[i].output, 1, run.jobs[i].len, out);
+            fprintf(out, "\n");
+            fflush(out);
+        }
+        free(run.jobs[i].output);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.job_done);
+    free(run.jobs);
+    fflush(out);
+}
+
+// One hunt's share of the leaderboard, as of a cache generation
+typedef struct {
+    char name[NAME_MAX + 1];
+    unsigned long generation;
+    UserScore *users;        // packed, to be taken back out later
+    size_t count;
+} HuntScores;
+
+// Every user's total over all hunts. Only hunts whose treasures.dat changed
+// since the last query are reloaded: their old share is taken out of the
+// totals and the new one (from scores.dat) added in.
+ScoreTable leaderboard;
+HuntScores *hunt_scores;     // sorted by name, like the cache
+size_t hunt_scores_count;
+
+void take_out(HuntScores *hs) {
+    for (size_t i = 0; i < hs->count; i++) {
+        UserScore *s = &hs->users[i];
+        score_adjust(&leaderboard, s->name, -s->score, -s->treasures);
+    }
+    free(hs->users);
+    hs->users = NULL;
+    hs->count = 0;
+}
+
+// Loads the hunt's current totals into hs and adds them to the leaderboard
+int put_in(HuntScores *hs, const CachedHunt *hunt) {
+    strcpy(hs->name, hunt->name);
+    hs->generation = hunt->generation;
+    ScoreTable scores;
+    if (score_init(&scores) == -1) {
+        return -1;
+    }
+    int loaded = score_load_hunt(hunt->name, &scores);
+    uint64_t bytes, records;
+    score_io(&bytes, &records);
+    stats_io(bytes, records);
+    if (loaded == -1) {
+        score_free(&scores);
+        return 0; // unreadable right now, counts as empty
+    }
+    int ok = score_merge(&leaderboard, &scores);
+    hs->users = score_entries(&scores, &hs->count);
+    score_free(&scores);
+    return ok == 0 && hs->users ? 0 : -1;
+}
+
+// The caller holds leaderboard_lock
+int refresh_leaderboard() {
+    if (!leaderboard.slots && score_init(&leaderboard) == -1) {
+        return -1;
+    }
+    cache_enter();
+    size_t n;
+    CachedHunt **hunts = cache_hunts(&n);
+    HuntScores *next = calloc(n ? n : 1, sizeof(HuntScores));
+    if (!next) {
+        cache_leave();
+        return -1;
+    }
+
+    // Both lists are sorted by name: walk them side by side
+    size_t used = 0, old = 0;
+    int ok = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!hunts[i]->has_data) {
+            continue;
+        }
+        while (old < hunt_scores_count && strcmp(hunt_scores[old].name, hunts[i]->name) < 0) {
+            take_out(&hunt_scores[old++]); // hunt is gone
+        }
+        if (old < hunt_scores_count && strcmp(hunt_scores[old].name, hunts[i]->name) == 0) {
+            if (hunt_scores[old].generation == hunts[i]->generation) {
+                next[used++] = hunt_scores[old++]; // unchanged
+                continue;
             }
+            take_out(&hunt_scores[old++]);
+        }
+        if (ok == 0) {
+            ok = put_in(&next[used++], hunts[i]);
         }
     }
-    closedir(dir);
+    while (old < hunt_scores_count) {
+        take_out(&hunt_scores[old++]);
+    }
+    cache_leave();
 
-    for (int i = 0; i < child_count; ++i) {
-        int status;
-        waitpid(child_pids[i], &status, 0);
-        printf("Waited child %d\n", child_pids[i]);
+    free(hunt_scores);
+    hunt_scores = next;
+    hunt_scores_count = used;
+    if (ok == -1) {
+        // Out of memory half way: start over on the next query
+        for (size_t i = 0; i < hunt_scores_count; i++) {
+            free(hunt_scores[i].users);
+        }
+        hunt_scores_count = 0;
+        score_free(&leaderboard);
     }
+    return ok;
+}
 
-    fflush(stdout);
+// Best top_n users over all hunts (0 = everyone)
+void show_leaderboard(FILE *out, size_t top_n) {
+    pthread_mutex_lock(&leaderboard_lock);
+    UserScore *top = NULL;
+    size_t count;
+    if (refresh_leaderboard() == 0) {
+        top = score_top(&leaderboard, top_n, &count);
+    }
+    pthread_mutex_unlock(&leaderboard_lock);
+    if (!top) {
+        fprintf(out, "Error: Could not build the leaderboard\n");
+        return;
+    }
+    fprintf(out, "Leaderboard (all hunts):\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%4zu. %s: %lld points\n", i + 1, top[i].name, top[i].score);
+    }
+    if (count == 0) {
+        fprintf(out, "No players yet\n");
+    }
+    free(top);
+    fflush(out);
 }
 
-// View specific treasure details
-void view_specific_treasure(const char *hunt_id, const char *treasure_id) {
-    char path[MAX_INPUT_SIZE];
-    snprintf(path, sizeof(path), "%s/treasures.dat", hunt_id);
-    FILE *treasure_file = fopen(path, "rb");
-    if (!treasure_file) {
-        printf("Error: Could not open hunt '%s'\n", hunt_id);
+void show_rank(FILE *out, const char *user_name) {
+    pthread_mutex_lock(&leaderboard_lock);
+    if (refresh_leaderboard() == -1) {
+        pthread_mutex_unlock(&leaderboard_lock);
+        fprintf(out, "Error: Could not build the leaderboard\n");
         return;
     }
-    Treasure t;
-    int found = 0;
-    while (fread(&t, sizeof(Treasure), 1, treasure_file) == 1) {
-        if (strcmp(t.id, treasure_id) == 0) {
-            found = 1;
-            printf("Treasure details:\n");
-            printf("ID: %s\n", t.id);
-            printf("User: %s\n", t.user_name);
-            printf("Location: %.6f, %.6f\n", t.latitude, t.longitude);
-            printf("Clue: %s\n", t.clue);
-            printf("Value: %d\n", t.value);
-            break;
+    long long score;
+    size_t users;
+    size_t rank = score_rank(&leaderboard, user_name, &score, &users);
+    pthread_mutex_unlock(&leaderboard_lock);
+    if (rank == 0) {
+        fprintf(out, "User '%s' has no treasures in any hunt\n", user_name);
+    } else {
+        fprintf(out, "User '%s' is ranked %zu of %zu with %lld points\n", user_name, rank, users, score);
+    }
+    fflush(out);
+}
+
+// A cached treasure and its distance, for the scan without a spatial index
+typedef struct {
+    const CachedTreasure *t;
+    double distance;
+} NearRecord;
+
+int compare_near(const void *a, const void *b) {
+    double x = ((const NearRecord *)a)->distance, y = ((const NearRecord *)b)->distance;
+    return x < y ? -1 : x > y;
+}
+
+// near <hunt> <lat> <lon> <radius_m>: treasures within the radius, nearest first
+void near_treasures(FILE *out, char *args) {
+    char hunt_id[NAME_MAX + 1];
+    double latitude, longitude, radius_m;
+    if (sscanf(args, "%255s %lf %lf %lf", hunt_id, &latitude, &longitude, &radius_m) != 4 || radius_m < 0) {
+        fprintf(out, "Error: Usage: near <hunt> <lat> <lon> <radius_m>\n");
+        return;
+    }
+
+    long count = 0;
+    SpatialHit *hits;
+    TreasureMap map;
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+        return;
+    }
+    long found = spatial_near(hunt_id, latitude, longitude, radius_m, &hits);
+    if (found != -1 && store_map(hunt_id, &map, STORE_LOOKUP) == 0) {
+        fprintf(out, "Treasures within %.0f m of (%.6f, %.6f) in hunt '%s':\n", radius_m, latitude, longitude, hunt_id);
+        stats_io(0, (uint64_t)found);
+        for (long i = 0; i < found; i++) {
+            TreasureView t;
+            if (store_at(&map, hits[i].offset, &t) && !t.dead) {
+                fprintf(out, "- ID: %s, User: %s, Value: %d, Distance: %.1f m\n",
+                        t.id, t.user_name, t.value, hits[i].distance);
+                count++;
+            }
+        }
+        store_unmap(&map);
+        hunt_unlock(&lock);
+        free(hits);
+    } else {
+        // No usable spatial index (the monitor never writes it): scan the cache
+        hunt_unlock(&lock);
+        free(hits);
+        cache_enter();
+        CachedHunt *hunt = open_hunt(out, hunt_id);
+        if (!hunt) {
+            cache_leave();
+            return;
+        }
+        fprintf(out, "Treasures within %.0f m of (%.6f, %.6f) in hunt '%s':\n", radius_m, latitude, longitude, hunt_id);
+        NearRecord *near = malloc((hunt->count ? hunt->count : 1) * sizeof(NearRecord));
+        if (!near) {
+            cache_leave();
+            fprintf(out, "Error: Out of memory\n");
+            return;
+        }
+        stats_io(0, hunt->count);
+        for (size_t i = 0; i < hunt->count; i++) {
+            const CachedTreasure *t = &hunt->records[i];
+            double d = spatial_distance(latitude, longitude, t->latitude, t->longitude);
+            if (d <= radius_m) {
+                near[count].t = t;
+                near[count].distance = d;
+                count++;
+            }
+        }
+        qsort(near, count, sizeof(NearRecord), compare_near);
+        for (long i = 0; i < count; i++) {
+            const CachedTreasure *t = near[i].t;
+            fprintf(out, "- ID: %s, User: %s, Value: %d, Distance: %.1f m\n",
+                    CACHE_STR(hunt, t->id), CACHE_STR(hunt, t->user_name), t->value, near[i].distance);
+        }
+        free(near);
+        cache_leave();
+    }
+    if (count == 0) {
+        fprintf(out, "No treasures found\n");
+    }
+    fflush(out);
+}
+
+// Matching treasures of one hunt, through its clue index when that is
+// current and by scanning the cached records otherwise. Returns the count.
+long search_hunt(FILE *out, const char *hunt_id, const char *query) {
+    long count = 0;
+    off_t *offsets;
+    TreasureMap map;
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+        return 0;
+    }
+    long found = search_clues(hunt_id, query, &offsets);
+    if (found != -1 && store_map(hunt_id, &map, STORE_LOOKUP) == 0) {
+        stats_io(0, (uint64_t)found);
+        for (long i = 0; i < found; i++) {
+            TreasureView t;
+            if (store_at(&map, offsets[i], &t) && !t.dead) {
+                fprintf(out, "- Hunt: %s, ID: %s, User: %s, Value: %d, Clue: %s\n",
+                        hunt_id, t.id, t.user_name, t.value, t.clue);
+                count++;
+            }
+        }
+        store_unmap(&map);
+        hunt_unlock(&lock);
+        free(offsets);
+        return count;
+    }
+    hunt_unlock(&lock);
+    free(offsets);
+
+    cache_enter();
+    CachedHunt *hunt = open_hunt(out, hunt_id);
+    if (!hunt) {
+        cache_leave();
+        return 0;
+    }
+    stats_io(0, hunt->count);
+    for (size_t i = 0; i < hunt->count; i++) {
+        const CachedTreasure *t = &hunt->records[i];
+        if (search_matches(CACHE_STR(hunt, t->clue), query)) {
+            fprintf(out, "- Hunt: %s, ID: %s, User: %s, Value: %d, Clue: %s\n",
+                    hunt_id, CACHE_STR(hunt, t->id), CACHE_STR(hunt, t->user_name), t->value,
+                    CACHE_STR(hunt, t->clue));
+            count++;
+        }
+    }
+    cache_leave();
+    return count;
+}
+
+// search <hunt|*> <words...>: treasures whose clue contains every word
+void search_treasures(FILE *out, char *args) {
+    char *space = strchr(args, ' ');
+    if (!space || space[1] == '\0') {
+        fprintf(out, "Error: Usage: search <hunt|*> <words...>\n");
+        return;
+    }
+    *space = '\0';
+    const char *hunt_id = args;
+    const char *query = space + 1;
+
+    fprintf(out, "Treasures matching '%s':\n", query);
+    long count = 0;
+    if (strcmp(hunt_id, "*") == 0) {
+        size_t n;
+        ScoreJob *hunts = collect_hunts(&n);
+        for (size_t i = 0; hunts && i < n; i++) {
+            count += search_hunt(out, hunts[i].name, query);
+        }
+        free(hunts);
+    } else {
+        count = search_hunt(out, hunt_id, query);
+    }
+    if (count == 0) {
+        fprintf(out, "No treasures found\n");
+    }
+    fflush(out);
+}
+
+// The view_treasure answer for one record, into buf
+void format_treasure(char *buf, size_t size, const char *id, const char *user_name,
+                     float latitude, float longitude, const char *clue, int value) {
+    snprintf(buf, size, "Treasure details:\nID: %s\nUser: %s\nLocation: %.6f, %.6f\nClue: %s\nValue: %d\n",
+             id, user_name, latitude, longitude, clue, value);
+}
+
+// 1 and the answer in buf if the cached hunt has the treasure, else 0
+int find_cached(const CachedHunt *hunt, const char *treasure_id, char *buf, size_t size) {
+    const CachedTreasure *t = cache_find(hunt, treasure_id);
+    if (t) {
+        format_treasure(buf, size, CACHE_STR(hunt, t->id), CACHE_STR(hunt, t->user_name),
+                        t->latitude, t->longitude, CACHE_STR(hunt, t->clue), t->value);
+    }
+    return t != NULL;
+}
+
+// View specific treasure details. A resident hunt answers from the cache;
+// any other is read through its ID index under the read lock, like near and
+// search, instead of being loaded whole under the cache lock. The answer is
+// formatted locally and written once no lock is held, so a slow reader on
+// the response pipe holds up nobody else.
+void view_specific_treasure(FILE *out, const char *hunt_id, const char *treasure_id) {
+    char text[VIEW_TEXT_SIZE];
+    int found = -1; // 1 = found, 0 = not in the hunt, -1 = not known yet
+
+    cache_enter();
+    CachedHunt *hunt = cache_resident(hunt_id);
+    if (hunt) {
+        found = find_cached(hunt, treasure_id, text, sizeof(text));
+    }
+    cache_leave();
+
+    if (found == -1) {
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+            fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+            fflush(out);
+            return;
+        }
+        off_t offset;
+        TreasureMap map;
+        found = index_lookup(hunt_id, treasure_id, &offset);
+        if (found == 1 && store_map(hunt_id, &map, STORE_LOOKUP) == 0) {
+            TreasureView t;
+            found = store_at(&map, offset, &t) && !t.dead && strcmp(t.id, treasure_id) == 0;
+            if (found) {
+                format_treasure(text, sizeof(text), t.id, t.user_name, t.latitude, t.longitude, t.clue, t.value);
+            }
+            store_unmap(&map);
+        } else if (found == 1) {
+            found = -1;
         }
+        hunt_unlock(&lock);
     }
-    fclose(treasure_file);
-    if (!found) {
-        printf("Error: Treasure '%s' not found in hunt '%s'\n", treasure_id, hunt_id);
+
+    if (found == -1) {
+        // No usable index (the monitor never writes it): load the hunt
+        cache_enter();
+        hunt = cache_hunt(hunt_id);
+        if (hunt) {
+            found = find_cached(hunt, treasure_id, text, sizeof(text));
+        }
+        cache_leave();
+        if (!hunt) {
+            fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+            fflush(out);
+            return;
+        }
+    }
+    stats_io(0, 1);
+    if (found) {
+        fputs(text, out);
+    } else {
+        fprintf(out, "Error: Treasure '%s' not found in hunt '%s'\n", treasure_id, hunt_id);
     }
-    fflush(stdout);
+    fflush(out);
+}
+
+// values <hunt> [user]: count, total, min, max and mean of the treasure
+// values, over the whole hunt or one user's treasures, from the columns
+void show_values(FILE *out, const char *args) {
+    char hunt_id[NAME_MAX + 1];
+    char user_name[NAME_SIZE] = "";
+    if (sscanf(args, "%255s %63s", hunt_id, user_name) < 1) {
+        fprintf(out, "Error: Usage: values <hunt> [user]\n");
+        return;
+    }
+
+    ColumnSet cols;
+    if (column_open(hunt_id, &cols) == -1) {
+        fprintf(out, "Error: Could not open hunt '%s'\n", hunt_id);
+        return;
+    }
+    ColumnStats s;
+    if (user_name[0]) {
+        long user = column_user(&cols, user_name);
+        if (user == -1) {
+            memset(&s, 0, sizeof(s));
+        } else {
+            column_user_stats(cols.users, cols.values, cols.count, (uint32_t)user, &s);
+        }
+        fprintf(out, "Values of '%s' in hunt '%s':\n", user_name, hunt_id);
+    } else {
+        column_stats(cols.values, cols.count, &s);
+        fprintf(out, "Values in hunt '%s':\n", hunt_id);
+    }
+    stats_io(cols.count * (sizeof(int32_t) + (user_name[0] ? sizeof(uint32_t) : 0)), cols.count);
+    column_close(&cols);
+
+    fprintf(out, "Treasures: %lld\n", (long long)s.count);
+    fprintf(out, "Total: %lld\n", (long long)s.sum);
+    if (s.count > 0) {
+        fprintf(out, "Min: %d\n", s.min);
+        fprintf(out, "Max: %d\n", s.max);
+        fprintf(out, "Mean: %.2f\n", (double)s.sum / (double)s.count);
+    }
+    fprintf(out, "Kernels: %s\n", column_isa());
+    fflush(out);
+}
+
+// stats: the monitor's own counters; "stats reset" starts them over
+void show_stats(FILE *out, const char *arg) {
+    if (arg && strcmp(arg, "reset") == 0) {
+        stats_reset();
+        fprintf(out, "Stats reset\n");
+    } else {
+        stats_print(out);
+    }
+    fflush(out);
 }
 
 // Main
-int main() {
-    setup_signal_handlers();
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <request_fd> <response_fd>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    request_fd = atoi(argv[1]);
+    response_fd = atoi(argv[2]);
+
+    int signal_fd = setup_signal_handlers();
+    if (cache_init(0) == -1) {
+        perror("cache_init");
+        return EXIT_FAILURE;
+    }
+    if (stats_start_dump() == -1) {
+        perror("stats_start_dump");
+    }
+
+    // The loop only reads: requests go to the workers as soon as their frame
+    // is complete, so a slow command never holds up the ones behind it
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = request_fd;
+    int ok = epoll_fd != -1 && fcntl(request_fd, F_SETFL, fcntl(request_fd, F_GETFL) | O_NONBLOCK) == 0 &&
+             epoll_ctl(epoll_fd, EPOLL_CTL_ADD, request_fd, &ev) == 0;
+    ev.data.fd = signal_fd;
+    if (!ok || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1) {
+        perror("epoll");
+        return EXIT_FAILURE;
+    }
+
+    size_t workers = (size_t)monitor_worker_limit();
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads && started < workers && pthread_create(&threads[started], NULL, request_worker, NULL) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        perror("pthread_create");
+        return EXIT_FAILURE;
+    }
+
+    FrameReader reader;
+    memset(&reader, 0, sizeof(reader));
+    bool running = true;
     while (running) {
-        pause();
+        struct epoll_event events[2];
+        int n = epoll_wait(epoll_fd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+                    running = false; // SIGUSR1
+                }
+                continue;
+            }
+
+            int r = proto_reader_fill(&reader, request_fd);
+            FrameHeader h;
+            char *payload;
+            int got;
+            while ((got = proto_reader_next(&reader, &h, &payload)) == 1) {
+                Request *request = malloc(sizeof(Request));
+                if (h.type != FRAME_REQUEST || !request) {
+                    free(request);
+                    free(payload);
+                    continue;
+                }
+                request->id = h.request_id;
+                request->command = payload;
+                request->received = stats_now();
+                queue_push(request);
+            }
+            if (r == 0) {
+                running = false; // hub closed the request pipe
+            } else if (r == -1 || got == -1) {
+                perror("Error reading requests");
+                running = false;
+            }
+        }
+    }
+
+    // Requests already read are still answered
+    queue_close();
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
-    unlink(COMMAND_FILE);
+    free(threads);
+    proto_reader_free(&reader);
+    close(epoll_fd);
+    close(signal_fd);
+    cache_free();
     printf("Monitor stopping...\n");
     usleep(500000);
     return 0;
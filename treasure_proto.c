@@ -0,0 +1,205 @@
+#define _GNU_SOURCE // fopencookie
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>//for PIPE_BUF
+#include <sys/uio.h>
+#include "treasure_proto.h"
+
+// Header and payload of a stream frame fit in one atomic pipe write
+#define STREAM_BUFFER_SIZE (PIPE_BUF - sizeof(FrameHeader))
+#define READER_CHUNK 65536
+
+int proto_send(int fd, uint32_t request_id, uint16_t type, const void *data, size_t len) {
+    if (len > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    FrameHeader h;
+    memset(&h, 0, sizeof(h));
+    h.length = (uint32_t)len;
+    h.request_id = request_id;
+    h.type = type;
+
+    // Header and payload leave in one writev; loop only on short writes
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (void *)data, len },
+    };
+    int iovcnt = len > 0 ? 2 : 1;
+    struct iovec *v = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, v, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Reads exactly len bytes. EINTR is only reported if nothing was read yet.
+static int read_full(int fd, void *buf, size_t len, int interruptible) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n == 0) {
+            if (done == 0) {
+                return 0;
+            }
+            errno = EPIPE; // EOF in the middle of a frame
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EINTR && !(interruptible && done == 0)) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+int proto_recv(int fd, FrameHeader *h, char **payload) {
+    *payload = NULL;
+    int r = read_full(fd, h, sizeof(*h), 1);
+    if (r != 1) {
+        return r;
+    }
+    if (h->length > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    char *buf = malloc(h->length + 1);
+    if (!buf) {
+        return -1;
+    }
+    if (h->length > 0 && read_full(fd, buf, h->length, 0) != 1) {
+        free(buf);
+        return -1;
+    }
+    buf[h->length] = '\0';
+    *payload = buf;
+    return 1;
+}
+
+typedef struct {
+    int fd;
+    uint32_t request_id;
+} StreamCookie;
+
+// stdio hands big writes straight through, so they are cut to frame size
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+    StreamCookie *c = cookie;
+    for (size_t done = 0; done < size; ) {
+        size_t len = size - done < STREAM_BUFFER_SIZE ? size - done : STREAM_BUFFER_SIZE;
+        if (proto_send(c->fd, c->request_id, FRAME_DATA, buf + done, len) == -1) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        done += len;
+    }
+    return (ssize_t)size;
+}
+
+static int stream_close(void *cookie) {
+    StreamCookie *c = cookie;
+    int r = proto_send(c->fd, c->request_id, FRAME_END, NULL, 0);
+    free(c);
+    return r;
+}
+
+FILE *proto_stream(int fd, uint32_t request_id) {
+    StreamCookie *c = malloc(sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->fd = fd;
+    c->request_id = request_id;
+
+    cookie_io_functions_t io = {
+        .read = NULL,
+        .write = stream_write,
+        .seek = NULL,
+        .close = stream_close,
+    };
+    FILE *out = fopencookie(c, "w", io);
+    if (!out) {
+        free(c);
+        return NULL;
+    }
+    // Fully buffered: output leaves in frames of up to STREAM_BUFFER_SIZE
+    setvbuf(out, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    return out;
+}
+
+int proto_reader_fill(FrameReader *r, int fd) {
+    while (1) {
+        if (r->capacity - r->len < READER_CHUNK) {
+            char *bigger = realloc(r->buf, r->capacity + READER_CHUNK);
+            if (!bigger) {
+                return -1;
+            }
+            r->buf = bigger;
+            r->capacity += READER_CHUNK;
+        }
+        ssize_t n = read(fd, r->buf + r->len, r->capacity - r->len);
+        if (n == 0) {
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        r->len += (size_t)n;
+    }
+}
+
+int proto_reader_next(FrameReader *r, FrameHeader *h, char **payload) {
+    *payload = NULL;
+    if (r->len < sizeof(*h)) {
+        return 0;
+    }
+    memcpy(h, r->buf, sizeof(*h));
+    if (h->length > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    size_t frame = sizeof(*h) + h->length;
+    if (r->len < frame) {
+        return 0;
+    }
+
+    char *buf = malloc(h->length + 1);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf, r->buf + sizeof(*h), h->length);
+    buf[h->length] = '\0';
+    memmove(r->buf, r->buf + frame, r->len - frame);
+    r->len -= frame;
+    *payload = buf;
+    return 1;
+}
+
+void proto_reader_free(FrameReader *r) {
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
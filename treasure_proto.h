@@ -0,0 +1,62 @@
+#ifndef TREASURE_PROTO_H
+#define TREASURE_PROTO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Hub <-> monitor protocol. The hub writes REQUEST frames (a text command
+// such as "view_treasure hunt1 t7") on the request pipe; the monitor answers
+// on the response pipe with any number of DATA frames carrying the output,
+// followed by one END frame, all tagged with the request's id.
+#define FRAME_REQUEST 1
+#define FRAME_DATA    2
+#define FRAME_END     3
+
+#define FRAME_MAX_PAYLOAD (1024 * 1024)
+
+// A page of list_treasures that has more after it ends with this line,
+// followed by the cursor to pass for the next page, in a DATA frame of
+// its own
+#define PROTO_CURSOR_PREFIX "Next cursor: "
+
+typedef struct {
+    uint32_t length;      // payload bytes following the header
+    uint32_t request_id;
+    uint16_t type;
+    uint16_t reserved;
+} FrameHeader;
+
+// Sends one frame. Returns 0, or -1 with errno set.
+int proto_send(int fd, uint32_t request_id, uint16_t type, const void *data, size_t len);
+
+// Receives one frame; *payload is malloc'd and NUL terminated (free it).
+// Returns 1 on success, 0 on a clean EOF, -1 on error. A signal that arrives
+// before any byte of the frame makes it fail with errno == EINTR.
+int proto_recv(int fd, FrameHeader *h, char **payload);
+
+// A stdio stream whose buffered output is sent as DATA frames for
+// request_id; fclose() flushes it and sends the END frame. No frame is
+// larger than PIPE_BUF, so each one is a single atomic pipe write and
+// streams of different requests can share one pipe from several threads.
+FILE *proto_stream(int fd, uint32_t request_id);
+
+// Incremental reader for a non-blocking fd: bytes are collected until
+// whole frames can be taken out, so an event loop never waits on a frame
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+} FrameReader;
+
+// Reads whatever the fd has. Returns 1 if it may have more later, 0 on
+// EOF, -1 on error.
+int proto_reader_fill(FrameReader *r, int fd);
+
+// Takes the next complete frame out; *payload as for proto_recv().
+// Returns 1 for a frame, 0 if none is complete yet, -1 on a bad frame.
+int proto_reader_next(FrameReader *r, FrameHeader *h, char **payload);
+
+void proto_reader_free(FrameReader *r);
+
+#endif
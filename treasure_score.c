@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/stat.h>
+#include "treasure_store.h"
+#include "treasure_score.h"
+#include "treasure_lock.h"
+
+#define SCORE_MIN_CAPACITY 64
+#define SCORE_MAGIC "TRSCORE1"
+
+typedef struct {
+    char magic[8];
+    DataStamp stamp;       // treasures.dat this table was computed from
+    uint64_t count;        // ScoreEntry records that follow
+} ScoreFileHeader;
+
+typedef struct {
+    char name[NAME_SIZE];
+    int64_t score;
+    int64_t treasures;
+} ScoreEntry;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < NAME_SIZE && name[i]; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int table_alloc(ScoreTable *table, size_t capacity) {
+    table->slots = calloc(capacity, sizeof(UserScore));
+    table->capacity = table->slots ? capacity : 0;
+    table->count = 0;
+    return table->slots ? 0 : -1;
+}
+
+int score_init(ScoreTable *table) {
+    return table_alloc(table, SCORE_MIN_CAPACITY);
+}
+
+void score_free(ScoreTable *table) {
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+static UserScore *find_slot(UserScore *slots, size_t capacity, const char *name) {
+    size_t mask = capacity - 1;
+    size_t slot = hash_name(name) & mask;
+    while (slots[slot].name[0] != '\0' && strncmp(slots[slot].name, name, NAME_SIZE) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &slots[slot];
+}
+
+static int grow(ScoreTable *table) {
+    ScoreTable bigger;
+    if (table_alloc(&bigger, table->capacity * 2) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].name[0] != '\0') {
+            *find_slot(bigger.slots, bigger.capacity, table->slots[i].name) = table->slots[i];
+        }
+    }
+    bigger.count = table->count;
+    free(table->slots);
+    *table = bigger;
+    return 0;
+}
+
+// Grows the table up front so n more users fit without rehashing
+static int reserve(ScoreTable *table, size_t n) {
+    while ((table->count + n) * 2 > table->capacity) {
+        if (grow(table) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int score_add(ScoreTable *table, const char *user_name, long long value) {
+    return score_adjust(table, user_name, value, 1);
+}
+
+int score_adjust(ScoreTable *table, const char *user_name, long long value, long treasures) {
+    UserScore *s = find_slot(table->slots, table->capacity, user_name);
+    if (s->name[0] == '\0') {
+        // Keep the load factor at or below 1/2
+        if ((table->count + 1) * 2 > table->capacity) {
+            if (grow(table) == -1) {
+                return -1;
+            }
+            s = find_slot(table->slots, table->capacity, user_name);
+        }
+        strncpy(s->name, user_name, NAME_SIZE - 1);
+        table->count++;
+    }
+    s->score += value;
+    s->treasures += treasures;
+    return 0;
+}
+
+// What score_load_hunt read in this thread since the last score_io() call
+static __thread uint64_t io_bytes, io_records;
+
+void score_io(uint64_t *bytes, uint64_t *records) {
+    *bytes = io_bytes;
+    *records = io_records;
+    io_bytes = io_records = 0;
+}
+
+// Per-segment results of a parallel score_hunt scan. Segment 0 adds
+// straight into the caller's table, the others into tables of their own
+// that are merged afterwards.
+typedef struct {
+    ScoreTable *table;
+    ScoreTable *tables;
+    uint64_t *records;
+    int *failed;
+    int (*keep)(const void *arg, const TreasureView *t);   // NULL = every live record
+    const void *keep_arg;
+} SegmentScores;
+
+// Per-user totals of v3 records, indexed by user ID
+typedef struct {
+    long long *scores;
+    long *treasures;
+    size_t size;
+} UserTotals;
+
+// Makes room for ID id, sized for every user known so far. 0, or -1.
+static int totals_reserve(UserTotals *u, uint32_t id) {
+    size_t size = users_count();
+    if (size <= id) {
+        size = (size_t)id + 1;
+    }
+    long long *scores = realloc(u->scores, size * sizeof(long long));
+    if (scores) {
+        u->scores = scores;
+    }
+    long *treasures = realloc(u->treasures, size * sizeof(long));
+    if (treasures) {
+        u->treasures = treasures;
+    }
+    if (!scores || !treasures) {
+        return -1;
+    }
+    memset(u->scores + u->size, 0, (size - u->size) * sizeof(long long));
+    memset(u->treasures + u->size, 0, (size - u->size) * sizeof(long));
+    u->size = size;
+    return 0;
+}
+
+static void score_segment(const TreasureMap *map, size_t segment, void *arg) {
+    SegmentScores *s = arg;
+    ScoreTable *table = segment == 0 ? s->table : &s->tables[segment];
+    int ok = segment == 0 ? 0 : score_init(table);
+    // v3 records are added up by user ID with an array increment; the names
+    // are looked up once per user at the end
+    UserTotals totals = { NULL, NULL, 0 };
+    TreasureView t;
+    for (size_t pos = 0; ok == 0 && store_next_in(map, segment, &pos, &t); ) {
+        s->records[segment]++;
+        if (t.dead || (s->keep && !s->keep(s->keep_arg, &t))) {
+            continue;
+        }
+        if (t.user_id == USER_NONE) {
+            ok = score_add(table, t.user_name, t.value);
+        } else if (t.user_id < totals.size || (ok = totals_reserve(&totals, t.user_id)) == 0) {
+            totals.scores[t.user_id] += t.value;
+            totals.treasures[t.user_id]++;
+        }
+    }
+    for (size_t id = 0; ok == 0 && id < totals.size; id++) {
+        if (totals.treasures[id] > 0) {
+            ok = score_adjust(table, users_label((uint32_t)id), totals.scores[id], totals.treasures[id]);
+        }
+    }
+    free(totals.scores);
+    free(totals.treasures);
+    s->failed[segment] = ok;
+}
+
+int score_hunt(const char *hunt_id, ScoreTable *table) {
+    return score_hunt_where(hunt_id, table, NULL, NULL);
+}
+
+int score_hunt_where(const char *hunt_id, ScoreTable *table,
+                     int (*keep)(const void *arg, const TreasureView *t), const void *arg) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+
+    HuntLock lock;
+    if (!hunt_lock(hunt_id, HUNT_READ, &lock)) {
+        return -1;
+    }
+    TreasureMap map;
+    if (access(path, R_OK) == -1 || store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        hunt_unlock(&lock);
+        return -1;
+    }
+
+    // Segments are scanned in parallel, each into its own table
+    SegmentScores s = { table, NULL, NULL, NULL, keep, arg };
+    s.tables = calloc(map.count ? map.count : 1, sizeof(ScoreTable));
+    s.records = calloc(map.count ? map.count : 1, sizeof(uint64_t));
+    s.failed = calloc(map.count ? map.count : 1, sizeof(int));
+    int ok = s.tables && s.records && s.failed ? 0 : -1;
+    if (ok == 0) {
+        store_scan(&map, score_segment, &s);
+        for (size_t i = 0; i < map.count; i++) {
+            if (s.failed[i] != 0 || (i > 0 && score_merge(table, &s.tables[i]) == -1)) {
+                ok = -1;
+            }
+            if (i > 0) {
+                score_free(&s.tables[i]);
+            }
+            io_records += s.records[i];
+        }
+    }
+    free(s.tables);
+    free(s.records);
+    free(s.failed);
+    io_bytes += map.size;
+    store_unmap(&map);
+    hunt_unlock(&lock);
+    return ok;
+}
+
+void score_stamp(const char *hunt_id, DataStamp *stamp) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, TREASURE_FILE);
+
+    struct stat st;
+    memset(stamp, 0, sizeof(*stamp));
+    if (stat(path, &st) == 0) {
+        stamp->size = st.st_size;
+        stamp->mtime_sec = st.st_mtim.tv_sec;
+        stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+int score_same_stamp(const DataStamp *a, const DataStamp *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static void score_path(char *buf, size_t size, const char *hunt_id) {
+    snprintf(buf, size, "%s/%s", hunt_id, SCORE_FILE);
+}
+
+// Reads scores.dat into table if it was computed from `expected`.
+// Returns 0 on success, -1 if it is missing, corrupt or stale.
+static int read_score_file(const char *hunt_id, const DataStamp *expected, ScoreTable *table) {
+    char path[PATH_MAX];
+    score_path(path, sizeof(path), hunt_id);
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+
+    ScoreFileHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+             memcmp(h.magic, SCORE_MAGIC, sizeof(h.magic)) == 0 &&
+             score_same_stamp(&h.stamp, expected) &&
+             reserve(table, h.count) == 0;
+
+    ScoreEntry e;
+    for (uint64_t i = 0; ok && i < h.count; i++) {
+        ok = fread(&e, sizeof(e), 1, f) == 1 &&
+             score_adjust(table, e.name, e.score, (long)e.treasures) == 0;
+        io_records++;
+    }
+    long read_bytes = ftell(f);
+    io_bytes += read_bytes > 0 ? (uint64_t)read_bytes : 0;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// Saves table as scores.dat for the data file identified by stamp
+static int write_score_file(const char *hunt_id, const DataStamp *stamp, const ScoreTable *table) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    score_path(path, sizeof(path), hunt_id);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, SCORE_FILE, (int)getpid());
+
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) {
+        return -1;
+    }
+
+    ScoreFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCORE_MAGIC, sizeof(h.magic));
+    h.stamp = *stamp;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].name[0] != '\0' && table->slots[i].treasures > 0) {
+            h.count++;
+        }
+    }
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < table->capacity; i++) {
+        const UserScore *s = &table->slots[i];
+        if (s->name[0] == '\0' || s->treasures <= 0) {
+            continue;
+        }
+        ScoreEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.name, s->name, NAME_SIZE);
+        e.score = s->score;
+        e.treasures = s->treasures;
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+    }
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int score_merge(ScoreTable *dst, const ScoreTable *src) {
+    if (reserve(dst, src->count) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < src->capacity; i++) {
+        const UserScore *s = &src->slots[i];
+        if (s->name[0] != '\0' && score_adjust(dst, s->name, s->score, s->treasures) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int score_load_hunt(const char *hunt_id, ScoreTable *table) {
+    DataStamp stamp;
+    score_stamp(hunt_id, &stamp);
+
+    ScoreTable loaded;
+    if (score_init(&loaded) == -1) {
+        return -1;
+    }
+    if (read_score_file(hunt_id, &stamp, &loaded) == -1) {
+        // Missing or stale: scan once and materialize the result. The scan
+        // holds the append lock: a remove rewrites its record in place and
+        // can leave the size and mtime stamp as they were, so comparing
+        // stamps afterwards would not tell that the scan missed it.
+        HuntLock lock;
+        if (!hunt_lock(hunt_id, HUNT_APPEND, &lock)) {
+            score_free(&loaded);
+            return -1;
+        }
+        score_stamp(hunt_id, &stamp);
+        score_free(&loaded);
+        // Another reader may have rebuilt it while this one waited
+        int built = score_init(&loaded) == 0 && read_score_file(hunt_id, &stamp, &loaded) == 0;
+        if (!built) {
+            score_free(&loaded);
+            built = score_init(&loaded) == 0 && score_hunt(hunt_id, &loaded) == 0;
+            if (built) {
+                write_score_file(hunt_id, &stamp, &loaded);
+            }
+        }
+        hunt_unlock(&lock);
+        if (!built) {
+            score_free(&loaded);
+            return -1;
+        }
+    }
+
+    // Callers may aggregate several hunts into one table
+    int ok = 0;
+    if (table->count == 0) {
+        score_free(table);
+        *table = loaded;
+    } else {
+        ok = score_merge(table, &loaded);
+        score_free(&loaded);
+    }
+    return ok;
+}
+
+void score_invalidate(const char *hunt_id) {
+    char path[PATH_MAX];
+    score_path(path, sizeof(path), hunt_id);
+    unlink(path);
+}
+
+void score_update_batch(const char *hunt_id, const DataStamp *before, const ScoreTable *delta) {
+    ScoreTable table;
+    if (score_init(&table) == -1) {
+        score_invalidate(hunt_id);
+        return;
+    }
+
+    // A hunt that had no treasures yet starts from an empty table
+    int ok = read_score_file(hunt_id, before, &table) == 0 || before->size == 0;
+    for (size_t i = 0; ok && delta && i < delta->capacity; i++) {
+        const UserScore *s = &delta->slots[i];
+        if (s->name[0] != '\0') {
+            ok = score_adjust(&table, s->name, s->score, s->treasures) == 0;
+        }
+    }
+
+    DataStamp after;
+    score_stamp(hunt_id, &after);
+    if (!ok || write_score_file(hunt_id, &after, &table) == -1) {
+        score_invalidate(hunt_id); // unknown state, let the next reader rebuild it
+    }
+    score_free(&table);
+}
+
+void score_update(const char *hunt_id, const DataStamp *before,
+                  const char *user_name, long long value, long treasures) {
+    if (!user_name) {
+        score_update_batch(hunt_id, before, NULL);
+        return;
+    }
+    ScoreTable delta;
+    if (score_init(&delta) == -1) {
+        score_update_batch(hunt_id, before, NULL);
+        return;
+    }
+    score_adjust(&delta, user_name, value, treasures);
+    score_update_batch(hunt_id, before, &delta);
+    score_free(&delta);
+}
+
+static int compare_scores(const void *a, const void *b) {
+    const UserScore *x = a, *y = b;
+    if (x->score != y->score) {
+        return x->score < y->score ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+UserScore *score_entries(const ScoreTable *table, size_t *count) {
+    UserScore *entries = malloc((table->count ? table->count : 1) * sizeof(UserScore));
+    if (!entries) {
+        *count = 0;
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].name[0] != '\0' && table->slots[i].treasures > 0) {
+            entries[n++] = table->slots[i];
+        }
+    }
+    *count = n;
+    return entries;
+}
+
+UserScore *score_sorted(const ScoreTable *table, size_t *count) {
+    UserScore *sorted = score_entries(table, count);
+    if (sorted) {
+        qsort(sorted, *count, sizeof(UserScore), compare_scores);
+    }
+    return sorted;
+}
+
+// Heap order: the root is the user that ranks last among those kept
+static int ranks_below(const UserScore *a, const UserScore *b) {
+    return compare_scores(a, b) > 0;
+}
+
+static void sift_down(UserScore *heap, size_t n, size_t i) {
+    while (1) {
+        size_t worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && ranks_below(&heap[l], &heap[worst])) {
+            worst = l;
+        }
+        if (r < n && ranks_below(&heap[r], &heap[worst])) {
+            worst = r;
+        }
+        if (worst == i) {
+            return;
+        }
+        UserScore tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+UserScore *score_top(const ScoreTable *table, size_t n, size_t *count) {
+    if (n == 0 || n >= table->count) {
+        return score_sorted(table, count);
+    }
+    UserScore *heap = malloc(n * sizeof(UserScore));
+    if (!heap) {
+        *count = 0;
+        return NULL;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        const UserScore *s = &table->slots[i];
+        if (s->name[0] == '\0' || s->treasures <= 0) {
+            continue;
+        }
+        if (used < n) {
+            heap[used++] = *s;
+            if (used == n) {
+                for (size_t j = n / 2; j-- > 0; ) {
+                    sift_down(heap, n, j);
+                }
+            }
+        } else if (ranks_below(&heap[0], s)) {
+            heap[0] = *s;
+            sift_down(heap, n, 0);
+        }
+    }
+    // Only the n survivors get sorted
+    qsort(heap, used, sizeof(UserScore), compare_scores);
+    *count = used;
+    return heap;
+}
+
+size_t score_rank(const ScoreTable *table, const char *user_name, long long *score, size_t *users) {
+    const UserScore *me = find_slot(table->slots, table->capacity, user_name);
+    if (me->name[0] == '\0') {
+        me = NULL;
+    }
+
+    size_t higher = 0, ranked = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        const UserScore *s = &table->slots[i];
+        if (s->name[0] == '\0' || s->treasures <= 0) {
+            continue;
+        }
+        ranked++;
+        if (me && s->score > me->score) {
+            higher++;
+        }
+    }
+    *users = ranked;
+    if (!me || me->treasures <= 0) {
+        *score = 0;
+        return 0;
+    }
+    *score = me->score;
+    return higher + 1;
+}
+
+void score_print(FILE *out, const char *hunt_id, const ScoreTable *table, size_t top_n) {
+    size_t count;
+    UserScore *sorted = score_sorted(table, &count);
+    if (top_n > 0 && top_n < count) {
+        count = top_n;
+    }
+
+    fprintf(out, "Scores for hunt '%s':\n", hunt_id);
+    for (size_t i = 0; i < count; ++i) {
+        fprintf(out, "  %s: %lld points\n", sorted[i].name, sorted[i].score);
+    }
+    fprintf(out, "score_calc done for hunt '%s'\n", hunt_id);
+    free(sorted);
+}
@@ -0,0 +1,105 @@
+#ifndef TREASURE_SCORE_H
+#define TREASURE_SCORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "treasure.h"
+#include "treasure_store.h"
+
+// Materialized per-user totals of one hunt, kept next to treasures.dat.
+// The file remembers the size and mtime of the data file it describes and
+// is only trusted while they still match.
+#define SCORE_FILE "scores.dat"
+
+// Per-user totals, aggregated in an open addressing hash table keyed on
+// user_name. The table grows as needed, so no user is ever dropped.
+typedef struct {
+    char name[NAME_SIZE];  // empty string = free slot
+    long long score;
+    long treasures;        // live treasures behind the score, 0 = user gone
+} UserScore;
+
+typedef struct {
+    UserScore *slots;
+    size_t capacity;       // power of two
+    size_t count;
+} ScoreTable;
+
+int score_init(ScoreTable *table);
+void score_free(ScoreTable *table);
+
+// Adds value to the user's total. Returns 0, or -1 if the table can not grow.
+int score_add(ScoreTable *table, const char *user_name, long long value);
+
+// Adds value and treasures (negative to take a removed treasure back out)
+int score_adjust(ScoreTable *table, const char *user_name, long long value, long treasures);
+
+// Adds every user of src to dst. Returns 0, or -1 if dst can not grow.
+int score_merge(ScoreTable *dst, const ScoreTable *src);
+
+// Adds every live treasure of the hunt. Returns 0, or -1 if the hunt has no
+// readable treasure file.
+int score_hunt(const char *hunt_id, ScoreTable *table);
+
+// The same for only the live treasures keep(arg, t) returns 1 for, checked
+// during the scan. The result is never saved to scores.dat.
+int score_hunt_where(const char *hunt_id, ScoreTable *table,
+                     int (*keep)(const void *arg, const TreasureView *t), const void *arg);
+
+// Identity of treasures.dat at one moment, used to validate scores.dat
+typedef struct {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} DataStamp;
+
+// Stamps the hunt's data file as it is now (a missing file stamps as zeros)
+void score_stamp(const char *hunt_id, DataStamp *stamp);
+
+// 1 if two stamps describe the same version of the data file
+int score_same_stamp(const DataStamp *a, const DataStamp *b);
+
+// Fills table from scores.dat when it still matches treasures.dat, otherwise
+// rebuilds it with a scan and saves it. Returns 0, or -1 if the hunt has no
+// readable treasure file.
+int score_load_hunt(const char *hunt_id, ScoreTable *table);
+
+// Bytes and records (scores.dat entries or scanned treasures) read by
+// score_hunt and score_load_hunt in the calling thread since the last call,
+// for callers that account their I/O. The counters are reset.
+void score_io(uint64_t *bytes, uint64_t *records);
+
+// Applies one writer's change to scores.dat. `before` is the data file
+// stamp taken before the change; if the table did not match it, it is
+// dropped and gets rebuilt by the next reader. A NULL user_name only
+// restamps the table (for rewrites that keep every live treasure).
+void score_update(const char *hunt_id, const DataStamp *before,
+                  const char *user_name, long long value, long treasures);
+
+// Same as score_update for a whole batch of changes already in `delta`
+void score_update_batch(const char *hunt_id, const DataStamp *before, const ScoreTable *delta);
+
+// Drops scores.dat after a change whose effect on the totals is unknown
+void score_invalidate(const char *hunt_id);
+
+// The users with live treasures, packed in table order; malloc'd, the
+// caller frees it. *count is set to the number of entries.
+UserScore *score_entries(const ScoreTable *table, size_t *count);
+
+// The users sorted by score (highest first, ties by name); malloc'd, the
+// caller frees it. *count is set to the number of entries.
+UserScore *score_sorted(const ScoreTable *table, size_t *count);
+
+// The best n users in the same order as score_sorted, found with a bounded
+// heap instead of sorting every user; malloc'd, *count set as above.
+UserScore *score_top(const ScoreTable *table, size_t n, size_t *count);
+
+// 1 + the number of users with a strictly higher score, or 0 if the user
+// has no live treasures. *score and *users (users ranked) are filled in.
+size_t score_rank(const ScoreTable *table, const char *user_name, long long *score, size_t *users);
+
+// Prints the per-hunt score block, limited to the top_n users (0 = all)
+void score_print(FILE *out, const char *hunt_id, const ScoreTable *table, size_t top_n);
+
+#endif
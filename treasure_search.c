@@ -0,0 +1,675 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "treasure.h"
+#include "treasure_search.h"
+#include "treasure_store.h"
+
+// clues.idx:  header | terms (sorted by word) | posting lists
+// Each posting list holds the record offsets of one word in ascending
+// order, stored as varint-encoded gaps (7 bits per byte, high bit = more).
+//
+// clues.log:  header | entries, each followed by its words (space separated)
+// An ADD entry carries the words of the new clue, a DEL entry none. Queries
+// apply the log on top of the base. Once the log outgrows a quarter of the
+// posting data (at least SEARCH_LOG_MIN bytes) the base is rebuilt.
+//
+// Both headers stamp the treasures.dat size they describe; the log's stamp
+// wins when it exists.
+
+#define SEARCH_MAGIC "TRFTS01"
+#define SEARCH_LOG_MAGIC "TRFTL01"
+#define SEARCH_LOG_MIN (64 * 1024)
+#define TERMS_MIN_CAPACITY 1024
+
+#define LOG_ADD 1
+#define LOG_DEL 2
+
+typedef struct {
+    char magic[8];
+    uint32_t term_count;
+    uint32_t reserved;
+    int64_t data_size;
+    uint64_t postings_size;
+} SearchHeader;
+
+typedef struct {
+    char term[SEARCH_TERM_SIZE];
+    uint32_t docs;
+    uint32_t length;       // bytes of the encoded list
+    uint64_t offset;       // from the start of the posting data
+} TermEntry;
+
+typedef struct {
+    char magic[8];
+    int64_t data_size;
+} LogHeader;
+
+typedef struct {
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t length;       // bytes of words that follow
+    int64_t offset;        // the record
+} LogEntry;
+
+static void build_path(char *buf, size_t size, const char *hunt_id, const char *file) {
+    snprintf(buf, size, "%s/%s", hunt_id, file);
+}
+
+// Copies the next word of *p into term. Returns 0 at the end of the text.
+static int next_term(const char **p, char *term) {
+    const unsigned char *s = (const unsigned char *)*p;
+    while (*s && !isalnum(*s)) {
+        s++;
+    }
+    if (*s == '\0') {
+        *p = (const char *)s;
+        return 0;
+    }
+    size_t len = 0;
+    while (*s && isalnum(*s)) {
+        if (len < SEARCH_TERM_SIZE - 1) {
+            term[len++] = (char)tolower(*s);
+        }
+        s++;
+    }
+    term[len] = '\0';
+    *p = (const char *)s;
+    return 1;
+}
+
+int search_matches(const char *clue, const char *query) {
+    char want[SEARCH_TERM_SIZE], have[SEARCH_TERM_SIZE];
+    for (const char *q = query; next_term(&q, want); ) {
+        int found = 0;
+        for (const char *c = clue; !found && next_term(&c, have); ) {
+            found = strcmp(want, have) == 0;
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static uint64_t get_varint(const uint8_t **p, const uint8_t *end) {
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+// ---- building the base segment ----
+
+// Distinct words met during a rebuild, ids handed out in order of appearance
+typedef struct {
+    char (*terms)[SEARCH_TERM_SIZE];
+    uint32_t count;
+    uint32_t *slots;       // id + 1, 0 = empty
+    uint32_t capacity;     // slots, power of two
+} TermSet;
+
+static uint32_t hash_term(const char *term) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < SEARCH_TERM_SIZE && term[i]; i++) {
+        h ^= (unsigned char)term[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int termset_grow(TermSet *set) {
+    uint32_t capacity = set->capacity ? set->capacity * 2 : TERMS_MIN_CAPACITY;
+    uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+    char (*terms)[SEARCH_TERM_SIZE] = realloc(set->terms, (size_t)(capacity / 2) * SEARCH_TERM_SIZE);
+    if (!slots || !terms) {
+        free(slots);
+        if (terms) {
+            set->terms = terms;
+        }
+        return 0;
+    }
+    set->terms = terms;
+    for (uint32_t id = 0; id < set->count; id++) {
+        uint32_t slot = hash_term(terms[id]) & (capacity - 1);
+        while (slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = id + 1;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    return 1;
+}
+
+// Returns the word's id, or UINT32_MAX if the set can not grow
+static uint32_t termset_add(TermSet *set, const char *term) {
+    if ((set->count + 1) * 2 > set->capacity && !termset_grow(set)) {
+        return UINT32_MAX;
+    }
+    uint32_t mask = set->capacity - 1;
+    uint32_t slot = hash_term(term) & mask;
+    while (set->slots[slot]) {
+        uint32_t id = set->slots[slot] - 1;
+        if (strcmp(set->terms[id], term) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+    uint32_t id = set->count++;
+    strcpy(set->terms[id], term);
+    set->slots[slot] = id + 1;
+    return id;
+}
+
+typedef struct {
+    uint32_t term;
+    int64_t offset;
+} Posting;
+
+static const TermSet *sorting_terms;
+
+static int compare_term_ids(const void *a, const void *b) {
+    return strcmp(sorting_terms->terms[*(const uint32_t *)a], sorting_terms->terms[*(const uint32_t *)b]);
+}
+
+static int write_base(const char *hunt_id, const SearchHeader *h, const TermEntry *entries, const uint8_t *postings) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SEARCH_FILE);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, SEARCH_FILE, (int)getpid());
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return 0;
+    }
+    size_t entries_size = (size_t)h->term_count * sizeof(TermEntry);
+    int ok = write(fd, h, sizeof(*h)) == (ssize_t)sizeof(*h) &&
+             write(fd, entries, entries_size) == (ssize_t)entries_size &&
+             write(fd, postings, h->postings_size) == (ssize_t)h->postings_size;
+    close(fd);
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+int search_rebuild(const char *hunt_id) {
+    int64_t data_size = store_data_end(hunt_id);
+
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        perror("Error opening treasure file");
+        return 0;
+    }
+
+    // One (word, record) pair per word occurrence, in file order
+    TermSet set;
+    memset(&set, 0, sizeof(set));
+    Posting *pairs = NULL;
+    size_t pair_count = 0, pair_capacity = 0;
+    int ok = termset_grow(&set);
+
+    TreasureView t;
+    char term[SEARCH_TERM_SIZE];
+    for (size_t pos = 0; ok && store_next(&map, &pos, &t); ) {
+        if (t.dead) {
+            continue;
+        }
+        for (const char *p = t.clue; ok && next_term(&p, term); ) {
+            uint32_t id = termset_add(&set, term);
+            if (id == UINT32_MAX) {
+                ok = 0;
+                break;
+            }
+            if (pair_count == pair_capacity) {
+                size_t cap = pair_capacity ? pair_capacity * 2 : 4096;
+                Posting *grown = realloc(pairs, cap * sizeof(Posting));
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                pairs = grown;
+                pair_capacity = cap;
+            }
+            pairs[pair_count].term = id;
+            pairs[pair_count].offset = (int64_t)t.offset;
+            pair_count++;
+        }
+    }
+    store_unmap(&map);
+
+    // Dictionary order, then a counting sort of the pairs by word keeps
+    // each word's offsets ascending
+    uint32_t *order = NULL, *rank = NULL;
+    size_t *start = NULL;
+    int64_t *sorted = NULL;
+    TermEntry *entries = NULL;
+    uint8_t *postings = NULL;
+    if (ok) {
+        order = malloc((set.count ? set.count : 1) * sizeof(uint32_t));
+        rank = malloc((set.count ? set.count : 1) * sizeof(uint32_t));
+        start = calloc(set.count + 1, sizeof(size_t));
+        sorted = malloc((pair_count ? pair_count : 1) * sizeof(int64_t));
+        entries = calloc(set.count ? set.count : 1, sizeof(TermEntry));
+        // A gap never takes more than 10 bytes
+        postings = malloc(pair_count ? pair_count * 10 : 1);
+        ok = order && rank && start && sorted && entries && postings;
+    }
+    if (ok) {
+        for (uint32_t i = 0; i < set.count; i++) {
+            order[i] = i;
+        }
+        sorting_terms = &set;
+        qsort(order, set.count, sizeof(uint32_t), compare_term_ids);
+        for (uint32_t i = 0; i < set.count; i++) {
+            rank[order[i]] = i;
+        }
+        for (size_t i = 0; i < pair_count; i++) {
+            start[rank[pairs[i].term] + 1]++;
+        }
+        for (uint32_t i = 0; i < set.count; i++) {
+            start[i + 1] += start[i];
+        }
+        for (size_t i = 0; i < pair_count; i++) {
+            sorted[start[rank[pairs[i].term]]++] = pairs[i].offset;
+        }
+
+        // start[r] now marks the end of word r's offsets
+        uint64_t used = 0;
+        size_t from = 0;
+        for (uint32_t r = 0; r < set.count; r++) {
+            TermEntry *e = &entries[r];
+            strcpy(e->term, set.terms[order[r]]);
+            e->offset = used;
+            int64_t last = -1;
+            for (size_t i = from; i < start[r]; i++) {
+                if (sorted[i] == last) {
+                    continue; // word repeated within one clue
+                }
+                used += put_varint(postings + used, (uint64_t)(sorted[i] - (last < 0 ? 0 : last)));
+                last = sorted[i];
+                e->docs++;
+            }
+            e->length = (uint32_t)(used - e->offset);
+            from = start[r];
+        }
+
+        SearchHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SEARCH_MAGIC, sizeof(h.magic));
+        h.term_count = set.count;
+        h.data_size = data_size;
+        h.postings_size = used;
+        ok = write_base(hunt_id, &h, entries, postings);
+        if (ok) {
+            // Everything in the log is in the new base now
+            char log_path[PATH_MAX];
+            build_path(log_path, sizeof(log_path), hunt_id, SEARCH_LOG);
+            unlink(log_path);
+        }
+    }
+
+    if (!ok) {
+        perror("Error building clue index");
+    }
+    free(order);
+    free(rank);
+    free(start);
+    free(sorted);
+    free(entries);
+    free(postings);
+    free(pairs);
+    free(set.terms);
+    free(set.slots);
+    return ok;
+}
+
+// ---- reading ----
+
+typedef struct {
+    void *base;
+    size_t size;
+    const SearchHeader *h;
+    const TermEntry *entries;
+    const uint8_t *postings;
+} BaseSegment;
+
+static int open_base(const char *hunt_id, BaseSegment *seg) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SEARCH_FILE);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SearchHeader)) {
+        close(fd);
+        return 0;
+    }
+    seg->size = (size_t)st.st_size;
+    seg->base = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (seg->base == MAP_FAILED) {
+        return 0;
+    }
+    seg->h = seg->base;
+    seg->entries = (const TermEntry *)((const char *)seg->base + sizeof(SearchHeader));
+    seg->postings = (const uint8_t *)(seg->entries + seg->h->term_count);
+    if (memcmp(seg->h->magic, SEARCH_MAGIC, sizeof(seg->h->magic)) != 0 ||
+        sizeof(SearchHeader) + (size_t)seg->h->term_count * sizeof(TermEntry) + seg->h->postings_size > seg->size) {
+        munmap(seg->base, seg->size);
+        return 0;
+    }
+    return 1;
+}
+
+static void close_base(BaseSegment *seg) {
+    munmap(seg->base, seg->size);
+}
+
+static const TermEntry *find_term(const BaseSegment *seg, const char *term) {
+    uint32_t lo = 0, hi = seg->h->term_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(seg->entries[mid].term, term, SEARCH_TERM_SIZE);
+        if (cmp == 0) {
+            return &seg->entries[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Reads the whole log. Returns 1 and a malloc'd copy (NULL if there is no
+// log) or 0 if it is unreadable.
+static int read_log(const char *hunt_id, char **data, size_t *size) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SEARCH_LOG);
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 1;
+    }
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(LogHeader);
+    if (ok) {
+        *data = malloc(st.st_size);
+        ok = *data && read(fd, *data, st.st_size) == st.st_size &&
+             memcmp(*data, SEARCH_LOG_MAGIC, 8) == 0;
+        *size = st.st_size;
+    }
+    close(fd);
+    if (!ok) {
+        free(*data);
+        *data = NULL;
+    }
+    return ok;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+long search_clues(const char *hunt_id, const char *query, off_t **offsets) {
+    *offsets = NULL;
+    BaseSegment seg;
+    if (!open_base(hunt_id, &seg)) {
+        return -1;
+    }
+    char *log;
+    size_t log_size;
+    if (!read_log(hunt_id, &log, &log_size)) {
+        close_base(&seg);
+        return -1;
+    }
+    int64_t stamp = log ? ((const LogHeader *)log)->data_size : seg.h->data_size;
+    if (stamp != store_data_end(hunt_id)) {
+        free(log);
+        close_base(&seg);
+        return -1;
+    }
+
+    // Words of the query, rarest first so the intersection shrinks fast
+    char terms[64][SEARCH_TERM_SIZE];
+    const TermEntry *lists[64];
+    int n = 0, missing = 0;
+    for (const char *q = query; n < 64 && next_term(&q, terms[n]); n++) {
+        lists[n] = find_term(&seg, terms[n]);
+        missing |= lists[n] == NULL;
+    }
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && lists[j] && (!lists[j - 1] || lists[j]->docs < lists[j - 1]->docs); j--) {
+            const TermEntry *tl = lists[j];
+            lists[j] = lists[j - 1];
+            lists[j - 1] = tl;
+        }
+    }
+
+    off_t *result = NULL;
+    size_t count = 0, capacity = 0;
+    if (n > 0 && !missing) {
+        // Decode the rarest list, then keep what every other list has
+        const TermEntry *e = lists[0];
+        result = malloc((e->docs ? e->docs : 1) * sizeof(off_t));
+        const uint8_t *p = seg.postings + e->offset, *end = p + e->length;
+        int64_t last = 0;
+        for (uint32_t i = 0; result && i < e->docs; i++) {
+            last += (int64_t)get_varint(&p, end);
+            result[count++] = (off_t)last;
+        }
+        capacity = e->docs;
+        for (int k = 1; result && k < n && count > 0; k++) {
+            const uint8_t *q = seg.postings + lists[k]->offset, *qend = q + lists[k]->length;
+            int64_t cur = -1, acc = 0;
+            uint32_t left = lists[k]->docs;
+            size_t kept = 0;
+            for (size_t i = 0; i < count; i++) {
+                while (cur < (int64_t)result[i] && left > 0) {
+                    acc += (int64_t)get_varint(&q, qend);
+                    cur = acc;
+                    left--;
+                }
+                if (cur == (int64_t)result[i]) {
+                    result[kept++] = result[i];
+                }
+            }
+            count = kept;
+        }
+    }
+    close_base(&seg);
+
+    // Apply the log: removed records drop out, added ones that match come in
+    int ok = 1;
+    for (size_t pos = sizeof(LogHeader); log && pos + sizeof(LogEntry) <= log_size; ) {
+        LogEntry le;
+        memcpy(&le, log + pos, sizeof(le));
+        pos += sizeof(le);
+        if (pos + le.length > log_size) {
+            break;
+        }
+        if (le.op == LOG_DEL) {
+            size_t kept = 0;
+            for (size_t i = 0; i < count; i++) {
+                if ((int64_t)result[i] != le.offset) {
+                    result[kept++] = result[i];
+                }
+            }
+            count = kept;
+        } else if (le.op == LOG_ADD && n > 0) {
+            char words[CLUE_SIZE * 2];
+            size_t len = le.length < sizeof(words) - 1 ? le.length : sizeof(words) - 1;
+            memcpy(words, log + pos, len);
+            words[len] = '\0';
+            if (search_matches(words, query)) {
+                if (count == capacity) {
+                    size_t cap = capacity ? capacity * 2 : 16;
+                    off_t *grown = realloc(result, cap * sizeof(off_t));
+                    if (!grown) {
+                        ok = 0;
+                        break;
+                    }
+                    result = grown;
+                    capacity = cap;
+                }
+                result[count++] = (off_t)le.offset;
+            }
+        }
+        pos += le.length;
+    }
+    free(log);
+    if (!ok) {
+        free(result);
+        return -1;
+    }
+
+    // Log entries arrive in file order too, but a re-added offset after a
+    // compaction could repeat; keep the list sorted and unique
+    qsort(result, count, sizeof(off_t), compare_offsets);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || result[unique - 1] != result[i]) {
+            result[unique++] = result[i];
+        }
+    }
+    *offsets = result;
+    return (long)unique;
+}
+
+// ---- incremental updates ----
+
+// Opens the log for appending, creating it on top of a base that matches
+// the data file. appended_at is where a just-appended record starts
+// (-1 = none); the index may not know that record yet.
+// Returns the fd, or -1 if the base or log is missing or stale.
+static int open_log(const char *hunt_id, int64_t appended_at, LogHeader *lh, uint64_t *postings_size) {
+    BaseSegment seg;
+    if (!open_base(hunt_id, &seg)) {
+        return -1;
+    }
+    int64_t base_size = seg.h->data_size;
+    *postings_size = seg.h->postings_size;
+    close_base(&seg);
+
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SEARCH_LOG);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = pread(fd, lh, sizeof(*lh), 0);
+    if (n == 0) {
+        memset(lh, 0, sizeof(*lh));
+        memcpy(lh->magic, SEARCH_LOG_MAGIC, sizeof(lh->magic));
+        lh->data_size = base_size;
+        if (pwrite(fd, lh, sizeof(*lh), 0) != (ssize_t)sizeof(*lh)) {
+            close(fd);
+            return -1;
+        }
+    } else if (n != (ssize_t)sizeof(*lh) || memcmp(lh->magic, SEARCH_LOG_MAGIC, sizeof(lh->magic)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int64_t current = store_data_end(hunt_id);
+    if (lh->data_size != current && (appended_at < 0 || lh->data_size != appended_at)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int append_log(const char *hunt_id, int fd, LogHeader *lh, uint64_t postings_size,
+                      uint8_t op, off_t offset, const char *words, size_t len) {
+    LogEntry le;
+    memset(&le, 0, sizeof(le));
+    le.op = op;
+    le.length = (uint32_t)len;
+    le.offset = (int64_t)offset;
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    lh->data_size = store_data_end(hunt_id);
+    int ok = end != -1 &&
+             pwrite(fd, &le, sizeof(le), end) == (ssize_t)sizeof(le) &&
+             (len == 0 || pwrite(fd, words, len, end + sizeof(le)) == (ssize_t)len) &&
+             pwrite(fd, lh, sizeof(*lh), 0) == (ssize_t)sizeof(*lh);
+    off_t log_size = end + (off_t)sizeof(le) + (off_t)len;
+    close(fd);
+    if (!ok) {
+        perror("Error updating clue index");
+        return 0;
+    }
+
+    // Fold the log into a new base once it is big next to the postings
+    uint64_t limit = postings_size / 4 > SEARCH_LOG_MIN ? postings_size / 4 : SEARCH_LOG_MIN;
+    if ((uint64_t)log_size > limit) {
+        return search_rebuild(hunt_id);
+    }
+    return 1;
+}
+
+int search_add(const char *hunt_id, const char *clue, off_t offset) {
+    LogHeader lh;
+    uint64_t postings_size;
+    int fd = open_log(hunt_id, (int64_t)offset, &lh, &postings_size);
+    if (fd == -1) {
+        // Missing or stale: the record is already on disk, so a rebuild picks it up
+        return search_rebuild(hunt_id);
+    }
+
+    // Store the clue's words already normalized
+    char words[CLUE_SIZE * 2], term[SEARCH_TERM_SIZE];
+    size_t len = 0;
+    for (const char *p = clue; next_term(&p, term); ) {
+        size_t tl = strlen(term);
+        if (len + tl + 1 >= sizeof(words)) {
+            break;
+        }
+        if (len > 0) {
+            words[len++] = ' ';
+        }
+        memcpy(words + len, term, tl);
+        len += tl;
+    }
+    return append_log(hunt_id, fd, &lh, postings_size, LOG_ADD, offset, words, len);
+}
+
+int search_remove(const char *hunt_id, off_t offset) {
+    LogHeader lh;
+    uint64_t postings_size;
+    int fd = open_log(hunt_id, -1, &lh, &postings_size);
+    if (fd == -1) {
+        return search_rebuild(hunt_id);
+    }
+    return append_log(hunt_id, fd, &lh, postings_size, LOG_DEL, offset, NULL, 0);
+}
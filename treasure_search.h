@@ -0,0 +1,29 @@
+#ifndef TREASURE_SEARCH_H
+#define TREASURE_SEARCH_H
+
+#include <sys/types.h>
+
+// Inverted index over the words of the clues, kept next to treasures.dat.
+// clues.idx is the base segment (sorted dictionary + compressed posting
+// lists); clues.log holds the adds and removes since it was built and is
+// folded into a new base once it grows too big.
+#define SEARCH_FILE "clues.idx"
+#define SEARCH_LOG  "clues.log"
+
+// Words are runs of letters and digits, lower-cased, cut to this length
+#define SEARCH_TERM_SIZE 32
+
+// Same conventions as treasure_index.h: 1 = ok, 0 = error
+int search_add(const char *hunt_id, const char *clue, off_t offset);
+int search_remove(const char *hunt_id, off_t offset);
+int search_rebuild(const char *hunt_id);
+
+// Offsets of the treasures whose clue contains every word of query, in
+// file order; *offsets is malloc'd (free it). Returns the number found, or
+// -1 if the index is missing or stale.
+long search_clues(const char *hunt_id, const char *query, off_t **offsets);
+
+// 1 if clue contains every word of query (for scans without an index)
+int search_matches(const char *clue, const char *query);
+
+#endif
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "treasure.h"
+#include "treasure_spatial.h"
+#include "treasure_store.h"
+
+// The world is cut into CELL_DEG x CELL_DEG degree cells. A hash directory
+// maps each non-empty cell to a chain of fixed-size blocks holding the
+// location and record offset of the treasures inside it:
+//
+//   header | directory (cell_count slots) | blocks...
+//
+// Appends fill the head block of the cell's chain or push a new block in
+// front of it; removals move the head block's last entry into the hole.
+// Emptied blocks are only reclaimed by a rebuild (compaction does one).
+
+#define SPATIAL_MAGIC "TRGEO01"
+#define SPATIAL_MIN_CELLS 64
+#define SPATIAL_BLOCK_ENTRIES 32
+#define SPATIAL_NONE UINT32_MAX
+#define CELL_EMPTY INT32_MIN
+#define CELL_DEG 0.01            // about 1.1 km of latitude
+#define GRID_COLUMNS 36000       // 360 / CELL_DEG
+#define GRID_ROWS 18000          // 180 / CELL_DEG
+#define EARTH_RADIUS_M 6371000.0
+#define METRES_PER_DEGREE 111195.0
+
+typedef struct {
+    char magic[8];
+    uint32_t cell_count;   // directory slots, power of two
+    uint32_t cells_used;
+    uint32_t block_count;
+    uint32_t entries;
+    int64_t data_size;     // store_data_end() of the data the index describes
+} SpatialHeader;
+
+typedef struct {
+    int32_t cx;            // CELL_EMPTY = free slot
+    int32_t cy;
+    uint32_t head;         // first block of the chain, SPATIAL_NONE if none
+    uint32_t count;
+} CellSlot;
+
+typedef struct {
+    float latitude;
+    float longitude;
+    int64_t offset;
+} SpatialEntry;
+
+typedef struct {
+    uint32_t next;
+    uint32_t used;
+    SpatialEntry entries[SPATIAL_BLOCK_ENTRIES];
+} SpatialBlock;
+
+static void build_path(char *buf, size_t size, const char *hunt_id, const char *file) {
+    snprintf(buf, size, "%s/%s", hunt_id, file);
+}
+
+static int32_t cell_x(double longitude) {
+    int32_t cx = (int32_t)floor((longitude + 180.0) / CELL_DEG);
+    return ((cx % GRID_COLUMNS) + GRID_COLUMNS) % GRID_COLUMNS;
+}
+
+static int32_t cell_y(double latitude) {
+    int32_t cy = (int32_t)floor((latitude + 90.0) / CELL_DEG);
+    return cy < 0 ? 0 : cy >= GRID_ROWS ? GRID_ROWS - 1 : cy;
+}
+
+static uint32_t hash_cell(int32_t cx, int32_t cy) {
+    return ((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u);
+}
+
+static off_t dir_pos(uint32_t slot) {
+    return (off_t)sizeof(SpatialHeader) + (off_t)slot * sizeof(CellSlot);
+}
+
+static off_t block_pos(const SpatialHeader *h, uint32_t block) {
+    return dir_pos(h->cell_count) + (off_t)block * sizeof(SpatialBlock);
+}
+
+double spatial_distance(double lat1, double lon1, double lat2, double lon2) {
+    double rad = M_PI / 180.0;
+    double dlat = (lat2 - lat1) * rad;
+    double dlon = (lon2 - lon1) * rad;
+    double a = sin(dlat / 2) * sin(dlat / 2) +
+               cos(lat1 * rad) * cos(lat2 * rad) * sin(dlon / 2) * sin(dlon / 2);
+    return 2.0 * EARTH_RADIUS_M * asin(sqrt(a < 1.0 ? a : 1.0));
+}
+
+// Like open_index() in treasure_index.c: a record just appended at
+// appended_at (-1 = none) is allowed to be missing from the index
+static int open_spatial(const char *hunt_id, int flags, SpatialHeader *h, int64_t appended_at) {
+    char path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SPATIAL_FILE);
+
+    int fd = open(path, flags);
+    if (fd == -1) {
+        return -1;
+    }
+    if (pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h) ||
+        memcmp(h->magic, SPATIAL_MAGIC, sizeof(h->magic)) != 0 ||
+        h->cell_count == 0 ||
+        (h->data_size != store_data_end(hunt_id) && (appended_at < 0 || h->data_size != appended_at))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Finds the directory slot of a cell, or the free slot it would take.
+// Returns 1 if found, 0 if not, -1 on I/O error.
+static int probe(int fd, const SpatialHeader *h, int32_t cx, int32_t cy, uint32_t *slot_out, CellSlot *s) {
+    uint32_t mask = h->cell_count - 1;
+    uint32_t slot = hash_cell(cx, cy) & mask;
+    for (uint32_t i = 0; i < h->cell_count; i++) {
+        if (pread(fd, s, sizeof(*s), dir_pos(slot)) != (ssize_t)sizeof(*s)) {
+            return -1;
+        }
+        if (s->cx == CELL_EMPTY || (s->cx == cx && s->cy == cy)) {
+            *slot_out = slot;
+            return s->cx != CELL_EMPTY;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static int read_block(int fd, const SpatialHeader *h, uint32_t block, SpatialBlock *b) {
+    return pread(fd, b, sizeof(*b), block_pos(h, block)) == (ssize_t)sizeof(*b);
+}
+
+static int write_block(int fd, const SpatialHeader *h, uint32_t block, const SpatialBlock *b) {
+    return pwrite(fd, b, sizeof(*b), block_pos(h, block)) == (ssize_t)sizeof(*b);
+}
+
+int spatial_insert(const char *hunt_id, float latitude, float longitude, off_t offset) {
+    SpatialHeader h;
+    int fd = open_spatial(hunt_id, O_RDWR, &h, (int64_t)offset);
+    if (fd == -1) {
+        // Missing or stale: the record is already on disk, so a rebuild picks it up
+        return spatial_rebuild(hunt_id);
+    }
+
+    int32_t cx = cell_x(longitude), cy = cell_y(latitude);
+    uint32_t slot;
+    CellSlot s;
+    int found = probe(fd, &h, cx, cy, &slot, &s);
+    if (found == -1 || (!found && (uint64_t)(h.cells_used + 1) * 4 > (uint64_t)h.cell_count * 3)) {
+        // Directory full enough to grow, which moves every block
+        close(fd);
+        return spatial_rebuild(hunt_id);
+    }
+    if (!found) {
+        s.cx = cx;
+        s.cy = cy;
+        s.head = SPATIAL_NONE;
+        s.count = 0;
+        h.cells_used++;
+    }
+
+    SpatialEntry e = { latitude, longitude, (int64_t)offset };
+    SpatialBlock b;
+    uint32_t block = s.head;
+    int ok = 1;
+    if (block != SPATIAL_NONE) {
+        ok = read_block(fd, &h, block, &b);
+    }
+    if (ok && (block == SPATIAL_NONE || b.used == SPATIAL_BLOCK_ENTRIES)) {
+        // Start a new block in front of the chain
+        memset(&b, 0, sizeof(b));
+        b.next = s.head;
+        block = h.block_count++;
+        s.head = block;
+    }
+    if (ok) {
+        b.entries[b.used++] = e;
+        s.count++;
+        h.entries++;
+        h.data_size = store_data_end(hunt_id);
+        ok = write_block(fd, &h, block, &b) &&
+             pwrite(fd, &s, sizeof(s), dir_pos(slot)) == (ssize_t)sizeof(s) &&
+             pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    }
+    close(fd);
+
+    if (!ok) {
+        perror("Error updating spatial index");
+    }
+    return ok;
+}
+
+int spatial_remove(const char *hunt_id, float latitude, float longitude, off_t offset) {
+    SpatialHeader h;
+    int fd = open_spatial(hunt_id, O_RDWR, &h, -1);
+    if (fd == -1) {
+        return spatial_rebuild(hunt_id);
+    }
+
+    uint32_t slot;
+    CellSlot s;
+    int found = probe(fd, &h, cell_x(longitude), cell_y(latitude), &slot, &s);
+    int ok = found != -1;
+
+    // Walk the chain to the entry, then fill its place from the head block
+    SpatialBlock head, b;
+    uint32_t block = found == 1 ? s.head : SPATIAL_NONE;
+    int at = -1;
+    while (ok && block != SPATIAL_NONE && at == -1) {
+        ok = read_block(fd, &h, block, &b);
+        for (uint32_t i = 0; ok && i < b.used; i++) {
+            if (b.entries[i].offset == (int64_t)offset) {
+                at = (int)i;
+                break;
+            }
+        }
+        if (at == -1) {
+            block = b.next;
+        }
+    }
+
+    if (ok && at != -1) {
+        ok = read_block(fd, &h, s.head, &head);
+        if (ok) {
+            SpatialEntry last = head.entries[--head.used];
+            if (block == s.head) {
+                if ((uint32_t)at < head.used) {
+                    head.entries[at] = last;
+                }
+            } else {
+                b.entries[at] = last;
+                ok = write_block(fd, &h, block, &b);
+            }
+        }
+        if (ok) {
+            if (head.used == 0) {
+                s.head = head.next; // the emptied block waits for a rebuild
+            } else {
+                ok = write_block(fd, &h, s.head, &head);
+            }
+        }
+        if (ok) {
+            s.count--;
+            h.entries--;
+            ok = pwrite(fd, &s, sizeof(s), dir_pos(slot)) == (ssize_t)sizeof(s);
+        }
+    }
+    h.data_size = store_data_end(hunt_id);
+    if (ok) {
+        ok = pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    }
+    close(fd);
+
+    if (!ok) {
+        perror("Error updating spatial index");
+    }
+    return ok;
+}
+
+typedef struct {
+    int32_t cx;
+    int32_t cy;
+    SpatialEntry e;
+} CellEntry;
+
+static int compare_cells(const void *a, const void *b) {
+    const CellEntry *x = a, *y = b;
+    if (x->cx != y->cx) {
+        return x->cx < y->cx ? -1 : 1;
+    }
+    if (x->cy != y->cy) {
+        return x->cy < y->cy ? -1 : 1;
+    }
+    return 0;
+}
+
+int spatial_rebuild(const char *hunt_id) {
+    int64_t data_size = store_data_end(hunt_id);
+
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        perror("Error opening treasure file");
+        return 0;
+    }
+
+    size_t live = 0;
+    TreasureView t;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        live += !t.dead;
+    }
+    CellEntry *all = malloc((live ? live : 1) * sizeof(CellEntry));
+    if (!all) {
+        perror("Error allocating spatial index");
+        store_unmap(&map);
+        return 0;
+    }
+    size_t n = 0;
+    for (size_t pos = 0; store_next(&map, &pos, &t); ) {
+        if (!t.dead) {
+            all[n].cx = cell_x(t.longitude);
+            all[n].cy = cell_y(t.latitude);
+            all[n].e.latitude = t.latitude;
+            all[n].e.longitude = t.longitude;
+            all[n].e.offset = (int64_t)t.offset;
+            n++;
+        }
+    }
+    store_unmap(&map);
+
+    // Group by cell; each cell's blocks are then laid out back to back
+    qsort(all, n, sizeof(CellEntry), compare_cells);
+    uint32_t cells = 0, blocks = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && compare_cells(&all[i], &all[j]) == 0) {
+            j++;
+        }
+        cells++;
+        blocks += (uint32_t)((j - i + SPATIAL_BLOCK_ENTRIES - 1) / SPATIAL_BLOCK_ENTRIES);
+        i = j;
+    }
+
+    SpatialHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SPATIAL_MAGIC, sizeof(h.magic));
+    h.cell_count = SPATIAL_MIN_CELLS;
+    while (h.cell_count < cells * 2) {
+        h.cell_count <<= 1;
+    }
+    h.cells_used = cells;
+    h.block_count = blocks;
+    h.entries = (uint32_t)n;
+    h.data_size = data_size;
+
+    CellSlot *dir = malloc((size_t)h.cell_count * sizeof(CellSlot));
+    SpatialBlock *out = calloc(blocks ? blocks : 1, sizeof(SpatialBlock));
+    if (!dir || !out) {
+        perror("Error allocating spatial index");
+        free(dir);
+        free(out);
+        free(all);
+        return 0;
+    }
+    for (uint32_t i = 0; i < h.cell_count; i++) {
+        dir[i].cx = CELL_EMPTY;
+        dir[i].head = SPATIAL_NONE;
+        dir[i].count = 0;
+    }
+
+    uint32_t mask = h.cell_count - 1, next_block = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && compare_cells(&all[i], &all[j]) == 0) {
+            j++;
+        }
+        uint32_t slot = hash_cell(all[i].cx, all[i].cy) & mask;
+        while (dir[slot].cx != CELL_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        dir[slot].cx = all[i].cx;
+        dir[slot].cy = all[i].cy;
+        dir[slot].head = next_block;
+        dir[slot].count = (uint32_t)(j - i);
+        for (size_t k = i; k < j; k++) {
+            SpatialBlock *b = &out[next_block];
+            b->entries[b->used++] = all[k].e;
+            if (b->used == SPATIAL_BLOCK_ENTRIES || k + 1 == j) {
+                b->next = k + 1 == j ? SPATIAL_NONE : next_block + 1;
+                next_block++;
+            }
+        }
+        i = j;
+    }
+    free(all);
+
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    build_path(path, sizeof(path), hunt_id, SPATIAL_FILE);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, SPATIAL_FILE, (int)getpid());
+
+    int ok = 0;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        size_t dir_size = (size_t)h.cell_count * sizeof(CellSlot);
+        size_t blocks_size = (size_t)blocks * sizeof(SpatialBlock);
+        ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             write(fd, dir, dir_size) == (ssize_t)dir_size &&
+             write(fd, out, blocks_size) == (ssize_t)blocks_size;
+        close(fd);
+        ok = ok && rename(temp_path, path) == 0;
+        if (!ok) {
+            unlink(temp_path);
+        }
+    }
+    if (!ok) {
+        perror("Error writing spatial index");
+    }
+    free(dir);
+    free(out);
+    return ok;
+}
+
+static int compare_hits(const void *a, const void *b) {
+    const SpatialHit *x = a, *y = b;
+    if (x->distance != y->distance) {
+        return x->distance < y->distance ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+typedef struct {
+    const char *base;
+    const SpatialHeader *h;
+    double latitude, longitude, radius_m;
+    SpatialHit *hits;
+    size_t count, capacity;
+} NearQuery;
+
+static int collect_cell(NearQuery *q, const CellSlot *s) {
+    for (uint32_t block = s->head; block != SPATIAL_NONE; ) {
+        const SpatialBlock *b = (const SpatialBlock *)(q->base + block_pos(q->h, block));
+        for (uint32_t i = 0; i < b->used; i++) {
+            const SpatialEntry *e = &b->entries[i];
+            double d = spatial_distance(q->latitude, q->longitude, e->latitude, e->longitude);
+            if (d > q->radius_m) {
+                continue;
+            }
+            if (q->count == q->capacity) {
+                size_t cap = q->capacity ? q->capacity * 2 : 64;
+                SpatialHit *grown = realloc(q->hits, cap * sizeof(SpatialHit));
+                if (!grown) {
+                    return 0;
+                }
+                q->hits = grown;
+                q->capacity = cap;
+            }
+            q->hits[q->count].offset = (off_t)e->offset;
+            q->hits[q->count].distance = d;
+            q->count++;
+        }
+        block = b->next;
+    }
+    return 1;
+}
+
+long spatial_near(const char *hunt_id, double latitude, double longitude, double radius_m, SpatialHit **hits) {
+    *hits = NULL;
+    SpatialHeader h;
+    int fd = open_spatial(hunt_id, O_RDONLY, &h, -1);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t size = (size_t)block_pos(&h, h.block_count);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < size) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    NearQuery q = { base, &h, latitude, longitude, radius_m, NULL, 0, 0 };
+    const CellSlot *dir = (const CellSlot *)((const char *)base + dir_pos(0));
+
+    // Bounding box of the circle in cells. A degree of longitude shrinks
+    // with latitude, so size it at the box edge nearest a pole.
+    double dlat = radius_m / METRES_PER_DEGREE;
+    double edge = fabs(latitude) + dlat;
+    double c = edge < 90.0 ? cos(edge * M_PI / 180.0) : 0.0;
+    double dlon = c > 1e-6 ? dlat / c : 360.0;
+    int32_t y0 = cell_y(latitude - dlat), y1 = cell_y(latitude + dlat);
+    int64_t x0 = (int64_t)floor((longitude - dlon + 180.0) / CELL_DEG);
+    int64_t x1 = (int64_t)floor((longitude + dlon + 180.0) / CELL_DEG);
+    int all_columns = x1 - x0 + 1 >= GRID_COLUMNS;
+    uint64_t box_cells = (uint64_t)(all_columns ? GRID_COLUMNS : x1 - x0 + 1) * (uint64_t)(y1 - y0 + 1);
+
+    int ok = 1;
+    if (!all_columns && box_cells <= h.cells_used) {
+        // Small area: look up each cell of the box
+        uint32_t mask = h.cell_count - 1;
+        for (int64_t x = x0; ok && x <= x1; x++) {
+            int32_t cx = (int32_t)(((x % GRID_COLUMNS) + GRID_COLUMNS) % GRID_COLUMNS);
+            for (int32_t cy = y0; ok && cy <= y1; cy++) {
+                uint32_t slot = hash_cell(cx, cy) & mask;
+                while (dir[slot].cx != CELL_EMPTY && !(dir[slot].cx == cx && dir[slot].cy == cy)) {
+                    slot = (slot + 1) & mask;
+                }
+                if (dir[slot].cx != CELL_EMPTY) {
+                    ok = collect_cell(&q, &dir[slot]);
+                }
+            }
+        }
+    } else {
+        // Large area: fewer occupied cells than cells in the box, walk them all
+        for (uint32_t i = 0; ok && i < h.cell_count; i++) {
+            const CellSlot *s = &dir[i];
+            if (s->cx == CELL_EMPTY || s->cy < y0 || s->cy > y1) {
+                continue;
+            }
+            int64_t dx = ((s->cx - x0) % GRID_COLUMNS + GRID_COLUMNS) % GRID_COLUMNS;
+            if (all_columns || dx <= x1 - x0) {
+                ok = collect_cell(&q, s);
+            }
+        }
+    }
+    munmap(base, size);
+
+    if (!ok) {
+        free(q.hits);
+        return -1;
+    }
+    qsort(q.hits, q.count, sizeof(SpatialHit), compare_hits);
+    *hits = q.hits;
+    return (long)q.count;
+}
@@ -0,0 +1,27 @@
+#ifndef TREASURE_SPATIAL_H
+#define TREASURE_SPATIAL_H
+
+#include <sys/types.h>
+
+// On-disk grid index (location -> record offset) kept next to treasures.dat
+#define SPATIAL_FILE "spatial.idx"
+
+typedef struct {
+    off_t offset;        // record in treasures.dat
+    double distance;     // metres from the query point
+} SpatialHit;
+
+// Same conventions as treasure_index.h: 1 = ok, 0 = error
+int spatial_insert(const char *hunt_id, float latitude, float longitude, off_t offset);
+int spatial_remove(const char *hunt_id, float latitude, float longitude, off_t offset);
+int spatial_rebuild(const char *hunt_id);
+
+// Live treasures within radius_m metres of (latitude, longitude), nearest
+// first. *hits is malloc'd (free it). Returns the number of hits, or -1 if
+// the index is missing or stale.
+long spatial_near(const char *hunt_id, double latitude, double longitude, double radius_m, SpatialHit **hits);
+
+// Great-circle distance in metres (haversine)
+double spatial_distance(double lat1, double lon1, double lat2, double lon2);
+
+#endif
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "treasure_stats.h"
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+    _Atomic uint64_t counts[BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} Histogram;
+
+typedef struct {
+    Histogram handler;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t records;
+    _Atomic uint64_t threads;
+} CommandStats;
+
+static const char *command_names[STAT_COMMANDS] = {
+    "list_hunts", "list_treasures", "view_treasure", "calculate_score", "leaderboard",
+    "rank", "near", "search", "stats", "values", "other",
+};
+
+static CommandStats commands[STAT_COMMANDS];
+static Histogram requests;           // whole process_command() calls
+static __thread int current = STAT_OTHER;   // command this thread works for
+static _Atomic uint64_t since_ns;
+
+#define RELAXED memory_order_relaxed
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Values below SUB_BUCKETS get a bucket each; above that every power of two
+// is split into SUB_BUCKETS equal parts
+static int bucket_of(uint64_t v) {
+    if (v < SUB_BUCKETS) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + (int)((v >> shift) & (SUB_BUCKETS - 1));
+}
+
+// Highest value that falls in bucket i
+static uint64_t bucket_top(int i) {
+    if (i < SUB_BUCKETS) {
+        return (uint64_t)i;
+    }
+    int shift = (i >> SUB_BITS) - 1;
+    uint64_t mantissa = (uint64_t)((i & (SUB_BUCKETS - 1)) | SUB_BUCKETS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void histogram_add(Histogram *h, uint64_t ns) {
+    atomic_fetch_add_explicit(&h->counts[bucket_of(ns)], 1, RELAXED);
+    atomic_fetch_add_explicit(&h->total, 1, RELAXED);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, RELAXED);
+    uint64_t max = atomic_load_explicit(&h->max_ns, RELAXED);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, ns, RELAXED, RELAXED)) {
+    }
+}
+
+// Latency at percentile p, from a snapshot of the counts
+static uint64_t histogram_percentile(const uint64_t *counts, uint64_t total, uint64_t max, double p) {
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)total + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+static void histogram_reset(Histogram *h) {
+    for (int i = 0; i < BUCKETS; i++) {
+        atomic_store_explicit(&h->counts[i], 0, RELAXED);
+    }
+    atomic_store_explicit(&h->total, 0, RELAXED);
+    atomic_store_explicit(&h->sum_ns, 0, RELAXED);
+    atomic_store_explicit(&h->max_ns, 0, RELAXED);
+}
+
+int stats_command(const char *name) {
+    for (int i = 0; i < STAT_OTHER; i++) {
+        if (strcmp(command_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return STAT_OTHER;
+}
+
+void stats_begin(int command) {
+    if (command < 0 || command >= STAT_COMMANDS) {
+        command = STAT_OTHER;
+    }
+    current = command;
+}
+
+void stats_record(int command, uint64_t handler_ns, uint64_t total_ns) {
+    if (command < 0 || command >= STAT_COMMANDS) {
+        command = STAT_OTHER;
+    }
+    histogram_add(&commands[command].handler, handler_ns);
+    histogram_add(&requests, total_ns);
+}
+
+void stats_io(uint64_t bytes, uint64_t records) {
+    CommandStats *c = &commands[current];
+    atomic_fetch_add_explicit(&c->bytes, bytes, RELAXED);
+    atomic_fetch_add_explicit(&c->records, records, RELAXED);
+}
+
+void stats_threads(uint64_t threads) {
+    CommandStats *c = &commands[current];
+    atomic_fetch_add_explicit(&c->threads, threads, RELAXED);
+}
+
+// One row of the table; the counts are copied first so the percentiles
+// agree with each other while commands keep recording
+static void print_row(FILE *out, const char *name, Histogram *h, const CommandStats *c) {
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->counts[i], RELAXED);
+        total += counts[i];
+    }
+    uint64_t max = atomic_load_explicit(&h->max_ns, RELAXED);
+    uint64_t sum = atomic_load_explicit(&h->sum_ns, RELAXED);
+    fprintf(out, "%-16s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f", name, (unsigned long long)total,
+            total ? sum / 1e3 / total : 0.0,
+            histogram_percentile(counts, total, max, 50) / 1e3,
+            histogram_percentile(counts, total, max, 90) / 1e3,
+            histogram_percentile(counts, total, max, 99) / 1e3, max / 1e3);
+    if (c) {
+        fprintf(out, " %12llu %10llu %8llu\n",
+                (unsigned long long)atomic_load_explicit(&c->bytes, RELAXED),
+                (unsigned long long)atomic_load_explicit(&c->records, RELAXED),
+                (unsigned long long)atomic_load_explicit(&c->threads, RELAXED));
+    } else {
+        fprintf(out, "\n");
+    }
+}
+
+void stats_print(FILE *out) {
+    uint64_t since = atomic_load_explicit(&since_ns, RELAXED);
+    fprintf(out, "Monitor stats over the last %.1f s (latencies in us):\n",
+            since ? (stats_now() - since) / 1e9 : 0.0);
+    fprintf(out, "%-16s %8s %10s %10s %10s %10s %10s %12s %10s %8s\n", "command", "calls", "mean",
+            "p50", "p90", "p99", "max", "bytes_read", "records", "threads");
+    for (int i = 0; i < STAT_COMMANDS; i++) {
+        if (atomic_load_explicit(&commands[i].handler.total, RELAXED) > 0) {
+            print_row(out, command_names[i], &commands[i].handler, &commands[i]);
+        }
+    }
+    print_row(out, "all requests", &requests, NULL);
+}
+
+void stats_reset(void) {
+    for (int i = 0; i < STAT_COMMANDS; i++) {
+        histogram_reset(&commands[i].handler);
+        atomic_store_explicit(&commands[i].bytes, 0, RELAXED);
+        atomic_store_explicit(&commands[i].records, 0, RELAXED);
+        atomic_store_explicit(&commands[i].threads, 0, RELAXED);
+    }
+    histogram_reset(&requests);
+    atomic_store_explicit(&since_ns, stats_now(), RELAXED);
+}
+
+static void *dump_thread(void *arg) {
+    long interval = (long)(intptr_t)arg;
+    const char *path = getenv("TREASURE_STATS_FILE");
+    while (1) {
+        struct timespec ts = { interval, 0 };
+        while (nanosleep(&ts, &ts) == -1) {
+        }
+        FILE *out = path ? fopen(path, "a") : stderr;
+        if (!out) {
+            perror("Error opening stats file");
+            continue;
+        }
+        time_t now = time(NULL);
+        struct tm tm;
+        char stamp[32];
+        localtime_r(&now, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(out, "[%s] ", stamp);
+        stats_print(out);
+        if (out == stderr) {
+            fflush(out);
+        } else {
+            fclose(out);
+        }
+    }
+    return NULL;
+}
+
+int stats_start_dump(void) {
+    atomic_store_explicit(&since_ns, stats_now(), RELAXED);
+    const char *env = getenv("TREASURE_STATS_INTERVAL");
+    long interval = env ? atol(env) : DEFAULT_STATS_INTERVAL;
+    if (interval <= 0) {
+        return 0;
+    }
+    // The thread starts with every signal blocked, so signals meant for the
+    // monitor's event loop are never taken by it
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    int ok = pthread_create(&thread, NULL, dump_thread, (void *)(intptr_t)interval) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!ok) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
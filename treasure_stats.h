@@ -0,0 +1,60 @@
+#ifndef TREASURE_STATS_H
+#define TREASURE_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Monitor instrumentation: a latency histogram per command, plus the bytes
+// read, records scanned and worker threads started on its behalf. Every
+// counter is a relaxed atomic, so recording costs a few uncontended adds
+// and stays on in normal use; the stats command and the periodic dump read
+// them while commands run.
+//
+// Histograms are log-linear like HDR histograms: 16 buckets per power of
+// two, so a reported latency is within about 6% of the real one.
+
+#define STAT_LIST_HUNTS     0
+#define STAT_LIST_TREASURES 1
+#define STAT_VIEW_TREASURE  2
+#define STAT_CALCULATE      3
+#define STAT_LEADERBOARD    4
+#define STAT_RANK           5
+#define STAT_NEAR           6
+#define STAT_SEARCH         7
+#define STAT_STATS          8
+#define STAT_VALUES         9
+#define STAT_OTHER          10  // unknown or malformed commands
+#define STAT_COMMANDS       11
+
+// TREASURE_STATS_INTERVAL=<seconds> makes the monitor dump its stats that
+// often, to TREASURE_STATS_FILE (appended to) or else stderr
+#define DEFAULT_STATS_INTERVAL 0
+
+// STAT_ index of a hub command name, STAT_OTHER if unknown
+int stats_command(const char *name);
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now(void);
+
+// Makes command the one that stats_io() and stats_threads() charge from the
+// calling thread, until its next call. Called by whichever thread runs a
+// request before any of its work, and by helper threads it starts.
+void stats_begin(int command);
+
+// Records one request: the time its handler took and the time for the
+// whole request (cache refresh and sending the answer included)
+void stats_record(int command, uint64_t handler_ns, uint64_t total_ns);
+
+// Charges I/O to the calling thread's command
+void stats_io(uint64_t bytes, uint64_t records);
+void stats_threads(uint64_t threads);
+
+// Prints a table of every command's counts and latency percentiles
+void stats_print(FILE *out);
+void stats_reset(void);
+
+// Starts the periodic dump thread if TREASURE_STATS_INTERVAL asks for it.
+// Returns 0, or -1 if the thread could not be started.
+int stats_start_dump(void);
+
+#endif
@@ -0,0 +1,937 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>//for PATH_MAX
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "treasure_store.h"
+
+#define WRITE_BUFFER_SIZE (64 * 1024)
+#define MANIFEST_MAGIC "TRSEG001"
+
+// treasures.seg: this header, then one entry per sealed segment, oldest
+// first. It is replaced whole (temp file + rename) when a segment is sealed.
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t next_number;  // number the next sealed segment gets
+} ManifestHeader;
+
+typedef struct {
+    uint32_t number;
+    uint32_t reserved;
+    int64_t base;
+} ManifestEntry;
+
+static void data_path(char *buf, size_t size, const char *hunt_id) {
+    snprintf(buf, size, "%s/%s", hunt_id, TREASURE_FILE);
+}
+
+// File name of a sealed segment, or of treasures.dat for number 0
+static void segment_name(char *buf, size_t size, unsigned number) {
+    if (number == 0) {
+        snprintf(buf, size, "%s", TREASURE_FILE);
+    } else {
+        snprintf(buf, size, SEGMENT_NAME_FORMAT, number);
+    }
+}
+
+static void segment_path(char *buf, size_t size, const char *hunt_id, unsigned number) {
+    char name[NAME_MAX + 1];
+    segment_name(name, sizeof(name), number);
+    snprintf(buf, size, "%s/%s", hunt_id, name);
+}
+
+static void sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void init_header(StoreHeader *h, int version, off_t base) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, STORE_MAGIC, sizeof(h->magic));
+    h->version = (uint16_t)version;
+    h->header_size = sizeof(StoreHeader);
+    h->base = base;
+}
+
+// Works out the layout from the first bytes of the file. Returns the
+// version, the offset of the first record and the file's logical base, or
+// -1 if unknown.
+static int detect_version(const char *data, size_t size, size_t *data_start, off_t *base) {
+    StoreHeader h;
+    memset(&h, 0, sizeof(h));
+    *data_start = 0;
+    *base = 0;
+    if (size >= STORE_HEADER_V2_SIZE) {
+        memcpy(&h, data, size < sizeof(h) ? size : sizeof(h));
+        if (memcmp(h.magic, STORE_MAGIC, sizeof(h.magic)) == 0) {
+            if ((h.version != STORE_V2 && h.version != STORE_V3) ||
+                h.header_size < STORE_HEADER_V2_SIZE ||
+                (h.header_size >= sizeof(h) && (size < sizeof(h) || h.base < 0))) {
+                errno = EPROTO;
+                return -1;
+            }
+            *data_start = h.header_size;
+            if (h.header_size >= sizeof(h)) {
+                *base = (off_t)h.base;
+            }
+            return h.version;
+        }
+    }
+    return STORE_V1;
+}
+
+int store_file_layout(int fd, int *version, off_t *base, size_t *data_start) {
+    char buf[sizeof(StoreHeader)];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    if (n == -1) {
+        return -1;
+    }
+    if (n == 0) {
+        // empty file, new records go in the current format
+        *version = STORE_VERSION;
+        *base = 0;
+        *data_start = 0;
+        return 0;
+    }
+    *version = detect_version(buf, (size_t)n, data_start, base);
+    return *version == -1 ? -1 : 0;
+}
+
+off_t store_append_offset(int fd) {
+    int version;
+    off_t base;
+    size_t data_start;
+    struct stat st;
+    if (store_file_layout(fd, &version, &base, &data_start) == -1 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    return base + st.st_size;
+}
+
+int64_t store_data_end(const char *hunt_id) {
+    char path[PATH_MAX];
+    data_path(path, sizeof(path), hunt_id);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    off_t end = store_append_offset(fd);
+    close(fd);
+    return end == -1 ? 0 : (int64_t)end;
+}
+
+int store_is_data_file(const char *name) {
+    if (strcmp(name, TREASURE_FILE) == 0 || strcmp(name, SEGMENT_MANIFEST) == 0) {
+        return 1;
+    }
+    unsigned number;
+    int end = -1;
+    sscanf(name, "treasures.%u.dat%n", &number, &end);
+    return end > 0 && name[end] == '\0';
+}
+
+// ---- the manifest ----
+
+// Sealed segments, oldest first (malloc'd). A missing manifest is a hunt
+// that was never sealed. Returns 0, or -1 on error.
+static int read_manifest(const char *hunt_id, ManifestEntry **entries, size_t *count,
+                         uint32_t *next_number) {
+    *entries = NULL;
+    *count = 0;
+    *next_number = 1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, SEGMENT_MANIFEST);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    ManifestHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+             memcmp(h.magic, MANIFEST_MAGIC, sizeof(h.magic)) == 0;
+    if (ok && h.count > 0) {
+        *entries = malloc(h.count * sizeof(ManifestEntry));
+        ok = *entries && fread(*entries, sizeof(ManifestEntry), h.count, f) == h.count;
+    }
+    fclose(f);
+    if (!ok) {
+        free(*entries);
+        *entries = NULL;
+        errno = EPROTO;
+        return -1;
+    }
+    *count = h.count;
+    *next_number = h.next_number;
+    return 0;
+}
+
+static int write_manifest(const char *hunt_id, const ManifestEntry *entries, size_t count,
+                          uint32_t next_number) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", hunt_id, SEGMENT_MANIFEST);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, SEGMENT_MANIFEST, (int)getpid());
+
+    ManifestHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+    h.count = (uint32_t)count;
+    h.next_number = next_number;
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t size = count * sizeof(ManifestEntry);
+    int ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             (size == 0 || write(fd, entries, size) == (ssize_t)size) &&
+             fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- mapping ----
+
+// Maps one segment file. Returns 1, 0 if it is missing or empty, -1 on error.
+static int map_segment(const char *path, StoreSegment *seg, int access) {
+    memset(seg, 0, sizeof(*seg));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    int version = detect_version(addr, size, &seg->data_start, &seg->base);
+    if (version == -1) {
+        munmap(addr, size);
+        return -1;
+    }
+
+    madvise(addr, size, access == STORE_SCAN ? MADV_SEQUENTIAL : MADV_RANDOM);
+
+    seg->data = addr;
+    seg->size = size;
+    seg->version = version;
+    seg->inode = st.st_ino;
+    return 1;
+}
+
+int store_map(const char *hunt_id, TreasureMap *map, int access) {
+    memset(map, 0, sizeof(*map));
+    map->version = STORE_VERSION;
+
+    // treasures.dat first: a segment sealed after this point is still part
+    // of it, so only manifest entries below its base are added
+    char path[PATH_MAX];
+    StoreSegment active;
+    data_path(path, sizeof(path), hunt_id);
+    int found = map_segment(path, &active, access);
+    if (found <= 0) {
+        return found;
+    }
+
+    ManifestEntry *entries = NULL;
+    size_t sealed = 0;
+    uint32_t next_number;
+    if (active.base > 0 && read_manifest(hunt_id, &entries, &sealed, &next_number) == -1) {
+        munmap((void *)active.data, active.size);
+        return -1;
+    }
+    while (sealed > 0 && entries[sealed - 1].base >= active.base) {
+        sealed--;
+    }
+
+    map->segments = malloc((sealed + 1) * sizeof(StoreSegment));
+    if (!map->segments) {
+        free(entries);
+        munmap((void *)active.data, active.size);
+        return -1;
+    }
+    for (size_t i = 0; i < sealed; i++) {
+        StoreSegment *seg = &map->segments[map->count];
+        segment_path(path, sizeof(path), hunt_id, entries[i].number);
+        found = map_segment(path, seg, access);
+        if (found <= 0) {
+            if (found == 0) {
+                errno = ENOENT; // listed but gone
+            }
+            free(entries);
+            munmap((void *)active.data, active.size);
+            store_unmap(map);
+            return -1;
+        }
+        seg->number = entries[i].number;
+        map->size += seg->size;
+        map->count++;
+    }
+    free(entries);
+
+    map->segments[map->count++] = active;
+    map->size += active.size;
+    map->end = active.base + (off_t)active.size;
+    map->version = active.version;
+    return 0;
+}
+
+void store_unmap(TreasureMap *map) {
+    for (size_t i = 0; i < map->count; i++) {
+        munmap((void *)map->segments[i].data, map->segments[i].size);
+    }
+    free(map->segments);
+    memset(map, 0, sizeof(*map));
+}
+
+static off_t segment_start(const StoreSegment *seg) {
+    return seg->base + (off_t)seg->data_start;
+}
+
+// Index of the last segment whose records start at or before offset. The
+// header of a segment overlaps the tail of the one before it in logical
+// offsets, so the search is on where the records start, not on base.
+static size_t find_segment(const TreasureMap *map, off_t offset) {
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segment_start(&map->segments[mid]) <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+const StoreSegment *store_segment_at(const TreasureMap *map, off_t offset) {
+    return map->count > 0 ? &map->segments[find_segment(map, offset)] : NULL;
+}
+
+static int decode_v1(const StoreSegment *seg, size_t pos, TreasureView *out) {
+    if (pos + sizeof(Treasure) > seg->size) {
+        return 0; // end of file or torn trailing record
+    }
+    const Treasure *t = (const Treasure *)(seg->data + pos);
+    out->offset = seg->base + (off_t)pos;
+    out->dead = TREASURE_IS_DEAD(t);
+    out->id = t->id;
+    out->user_name = t->user_name;
+    out->user_id = USER_NONE;
+    out->clue = t->clue;
+    out->latitude = t->latitude;
+    out->longitude = t->longitude;
+    out->value = t->value;
+    return 1;
+}
+
+// Decodes a v2 or v3 record, returning its length or 0 if it is torn or
+// corrupt
+static size_t decode_v2(const StoreSegment *seg, size_t pos, TreasureView *out) {
+    RecordHeader h;
+    if (pos + sizeof(h) > seg->size) {
+        return 0;
+    }
+    memcpy(&h, seg->data + pos, sizeof(h));
+
+    // v3 has the user ID where v2 has the name
+    int by_id = seg->version == STORE_V3;
+    size_t user_len = by_id ? sizeof(uint32_t) : h.name_len;
+    size_t strings = (size_t)h.id_len + user_len + h.clue_len;
+    if (h.length < sizeof(h) || pos + h.length > seg->size ||
+        sizeof(h) + strings > h.length ||
+        h.id_len == 0 || (by_id ? h.name_len != 0 : h.name_len == 0) || h.clue_len == 0) {
+        return 0;
+    }
+
+    const char *user = seg->data + pos + sizeof(h);
+    const char *id = by_id ? user + user_len : user;
+    const char *user_name = by_id ? NULL : id + h.id_len;
+    const char *clue = id + h.id_len + (by_id ? 0 : user_len);
+    if (id[h.id_len - 1] != '\0' || (!by_id && user_name[h.name_len - 1] != '\0') ||
+        clue[h.clue_len - 1] != '\0') {
+        return 0;
+    }
+
+    out->user_id = USER_NONE;
+    if (by_id) {
+        memcpy(&out->user_id, user, sizeof(uint32_t));
+        user_name = users_label(out->user_id);
+    }
+
+    out->offset = seg->base + (off_t)pos;
+    out->dead = (h.flags & RECORD_DEAD) != 0;
+    out->id = id;
+    out->user_name = user_name;
+    out->clue = clue;
+    out->latitude = h.latitude;
+    out->longitude = h.longitude;
+    out->value = h.value;
+    return h.length;
+}
+
+int store_next_in(const TreasureMap *map, size_t segment, size_t *pos, TreasureView *out) {
+    const StoreSegment *seg = &map->segments[segment];
+    if ((off_t)*pos < segment_start(seg)) {
+        *pos = (size_t)segment_start(seg);
+    }
+    size_t local = *pos - (size_t)seg->base;
+    if (seg->version == STORE_V1) {
+        if (!decode_v1(seg, local, out)) {
+            return 0;
+        }
+        *pos += sizeof(Treasure);
+        return 1;
+    }
+    size_t length = decode_v2(seg, local, out);
+    if (length == 0) {
+        return 0;
+    }
+    *pos += length;
+    return 1;
+}
+
+int store_next(const TreasureMap *map, size_t *pos, TreasureView *out) {
+    if (map->count == 0) {
+        return 0;
+    }
+    for (size_t i = find_segment(map, (off_t)*pos); ; ) {
+        if (store_next_in(map, i, pos, out)) {
+            return 1;
+        }
+        if (++i == map->count) {
+            return 0;
+        }
+        *pos = (size_t)segment_start(&map->segments[i]);
+    }
+}
+
+int store_at(const TreasureMap *map, off_t offset, TreasureView *out) {
+    const StoreSegment *seg = store_segment_at(map, offset);
+    if (!seg || offset < segment_start(seg)) {
+        return 0;
+    }
+    size_t local = (size_t)(offset - seg->base);
+    if (seg->version == STORE_V1) {
+        return local % sizeof(Treasure) == 0 && decode_v1(seg, local, out);
+    }
+    return local % 4 == 0 && decode_v2(seg, local, out) != 0;
+}
+
+// ---- parallel scans ----
+
+typedef struct {
+    const TreasureMap *map;
+    void (*scan)(const TreasureMap *map, size_t segment, void *arg);
+    void *arg;
+    size_t next;           // next segment to hand out, taken atomically
+} ScanJob;
+
+static int scan_threads(void) {
+    const char *env = getenv("TREASURE_SCAN_THREADS");
+    int threads = env ? atoi(env) : 0;
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return threads > 0 ? threads : 1;
+}
+
+static void *scan_worker(void *arg) {
+    ScanJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->map->count) {
+        job->scan(job->map, i, job->arg);
+    }
+    return NULL;
+}
+
+void store_scan(const TreasureMap *map, void (*scan)(const TreasureMap *map, size_t segment, void *arg),
+                void *arg) {
+    ScanJob job = { map, scan, arg, 0 };
+    size_t threads = (size_t)scan_threads();
+    if (threads > map->count) {
+        threads = map->count;
+    }
+    pthread_t tid[threads > 1 ? threads - 1 : 1];
+    size_t started = 0;
+    // The caller is one of the workers; if a thread fails to start, the
+    // ones running (or the caller alone) take its segments
+    while (started + 1 < threads && pthread_create(&tid[started], NULL, scan_worker, &job) == 0) {
+        started++;
+    }
+    scan_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+// ---- appending ----
+
+static uint8_t string_len(const char *s, size_t max) {
+    size_t n = strnlen(s, max - 1);
+    return (uint8_t)(n + 1);
+}
+
+size_t store_encode(const Treasure *t, int version, char *buf) {
+    if (version == STORE_V1) {
+        memcpy(buf, t, sizeof(Treasure));
+        return sizeof(Treasure);
+    }
+
+    uint32_t user_id = USER_NONE;
+    if (version == STORE_V3 && (user_id = users_intern(t->user_name)) == USER_NONE) {
+        return 0;
+    }
+
+    RecordHeader h;
+    memset(&h, 0, sizeof(h));
+    h.id_len = string_len(t->id, ID_SIZE);
+    h.name_len = version == STORE_V3 ? 0 : string_len(t->user_name, NAME_SIZE);
+    h.clue_len = (uint16_t)(strnlen(t->clue, CLUE_SIZE - 1) + 1);
+    h.latitude = t->latitude;
+    h.longitude = t->longitude;
+    h.value = t->value;
+
+    size_t user_len = version == STORE_V3 ? sizeof(user_id) : h.name_len;
+    size_t length = sizeof(h) + h.id_len + user_len + h.clue_len;
+    length = (length + 3) & ~(size_t)3;
+    h.length = (uint16_t)length;
+
+    memset(buf, 0, length);
+    memcpy(buf, &h, sizeof(h));
+    char *p = buf + sizeof(h);
+    if (version == STORE_V3) {
+        memcpy(p, &user_id, sizeof(user_id));
+        p += sizeof(user_id);
+    }
+    memcpy(p, t->id, h.id_len - 1);
+    p += h.id_len;
+    if (version != STORE_V3) {
+        memcpy(p, t->user_name, h.name_len - 1);
+        p += h.name_len;
+    }
+    memcpy(p, t->clue, h.clue_len - 1);
+    return length;
+}
+
+// Size at which treasures.dat is sealed, TREASURE_SEGMENT_MB (0 = never)
+static off_t segment_limit(void) {
+    const char *env = getenv("TREASURE_SEGMENT_MB");
+    double mb = DEFAULT_SEGMENT_MB;
+    if (env) {
+        char *end;
+        double value = strtod(env, &end);
+        if (end != env && value >= 0.0) {
+            mb = value;
+        }
+    }
+    off_t limit = (off_t)(mb * 1024 * 1024);
+    if (limit > 0 && limit < (off_t)(sizeof(StoreHeader) + RECORD_MAX_SIZE)) {
+        limit = (off_t)(sizeof(StoreHeader) + RECORD_MAX_SIZE); // at least one record per segment
+    }
+    return limit;
+}
+
+// Seals the full treasures.dat open as fd: it gets a numbered name and a
+// manifest entry, then an empty treasures.dat takes its place. The steps
+// are ordered so readers, which open treasures.dat before the manifest,
+// never see a segment twice or miss one, and a crash between them leaves
+// at worst an unlisted link that the next seal replaces. Returns the fd of
+// the new treasures.dat, or -1.
+static int seal_active(const char *hunt_id, int fd, off_t size) {
+    int version;
+    off_t base;
+    size_t data_start;
+    if (store_file_layout(fd, &version, &base, &data_start) == -1) {
+        return -1;
+    }
+    // Nothing in it changes any more, so the journal never replays into it
+    if (fdatasync(fd) == -1) {
+        return -1;
+    }
+
+    ManifestEntry *entries;
+    size_t count;
+    uint32_t next_number;
+    if (read_manifest(hunt_id, &entries, &count, &next_number) == -1) {
+        return -1;
+    }
+
+    char path[PATH_MAX], sealed_path[PATH_MAX], temp_path[PATH_MAX];
+    data_path(path, sizeof(path), hunt_id);
+    int ok = 1;
+    if (count == 0 || entries[count - 1].base != base) {
+        // (otherwise it was already listed before a crash)
+        ManifestEntry *more = realloc(entries, (count + 1) * sizeof(ManifestEntry));
+        ok = more != NULL;
+        if (ok) {
+            entries = more;
+            memset(&entries[count], 0, sizeof(ManifestEntry));
+            entries[count].number = next_number;
+            entries[count].base = base;
+            segment_path(sealed_path, sizeof(sealed_path), hunt_id, next_number);
+            unlink(sealed_path);
+            ok = link(path, sealed_path) == 0 &&
+                 write_manifest(hunt_id, entries, count + 1, next_number + 1) == 0;
+        }
+    }
+    free(entries);
+
+    // The new segment starts where the sealed one ends
+    StoreHeader h;
+    init_header(&h, STORE_VERSION, base + size - (off_t)sizeof(h));
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", hunt_id, TREASURE_FILE, (int)getpid());
+    int new_fd = ok ? open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644) : -1;
+    if (new_fd == -1) {
+        return -1;
+    }
+    if (write(new_fd, &h, sizeof(h)) != (ssize_t)sizeof(h) || fdatasync(new_fd) == -1 ||
+        rename(temp_path, path) == -1) {
+        close(new_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    sync_dir(hunt_id);
+    return new_fd;
+}
+
+int store_roll(const char *hunt_id, int fd, int *version) {
+    struct stat st;
+    off_t limit = segment_limit();
+    if (limit == 0 || fstat(fd, &st) == -1 || st.st_size < limit) {
+        return fd;
+    }
+    int new_fd = seal_active(hunt_id, fd, st.st_size);
+    close(fd);
+    if (new_fd != -1) {
+        *version = STORE_VERSION;
+    }
+    return new_fd;
+}
+
+int store_open_append(const char *hunt_id, int *version) {
+    char path[PATH_MAX];
+    data_path(path, sizeof(path), hunt_id);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    off_t base;
+    size_t data_start;
+    if (store_file_layout(fd, version, &base, &data_start) == -1 || fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        StoreHeader h;
+        init_header(&h, STORE_VERSION, 0);
+        if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    return store_roll(hunt_id, fd, version);
+}
+
+int store_append(const char *hunt_id, const Treasure *t, off_t *offset) {
+    int version;
+    int fd = store_open_append(hunt_id, &version);
+    if (fd == -1) {
+        return 0;
+    }
+
+    char buf[RECORD_MAX_SIZE];
+    size_t len = store_encode(t, version, buf);
+    *offset = store_append_offset(fd);
+    int ok = len > 0 && *offset != -1 && write(fd, buf, len) == (ssize_t)len;
+    close(fd);
+    return ok;
+}
+
+// ---- removing ----
+
+// Opens the segment file holding a logical offset for writing. Returns the
+// fd, its version and the offset within it, or -1.
+static int open_segment_at(const char *hunt_id, off_t offset, int *version, off_t *local,
+                           int *sealed) {
+    char path[PATH_MAX];
+    data_path(path, sizeof(path), hunt_id);
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    off_t base;
+    size_t data_start;
+    if (store_file_layout(fd, version, &base, &data_start) == -1) {
+        close(fd);
+        return -1;
+    }
+    *sealed = 0;
+    if (offset >= base + (off_t)data_start) {
+        *local = offset - base;
+        return fd;
+    }
+    close(fd);
+
+    ManifestEntry *entries;
+    size_t count;
+    uint32_t next_number;
+    if (read_manifest(hunt_id, &entries, &count, &next_number) == -1) {
+        return -1;
+    }
+    fd = -1;
+    for (size_t i = count; i-- > 0 && fd == -1; ) {
+        if (entries[i].base > offset) {
+            continue;
+        }
+        segment_path(path, sizeof(path), hunt_id, entries[i].number);
+        fd = open(path, O_RDWR);
+        if (fd != -1 && (store_file_layout(fd, version, &base, &data_start) == -1 ||
+                         offset < base + (off_t)data_start)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    free(entries);
+    if (fd == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    *local = offset - base;
+    *sealed = 1;
+    return fd;
+}
+
+// Bumps treasures.dat's mtime after a sealed segment changed
+static void touch_active(const char *hunt_id) {
+    char path[PATH_MAX];
+    data_path(path, sizeof(path), hunt_id);
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+int store_mark_dead(const char *hunt_id, off_t offset) {
+    int version, sealed;
+    off_t local;
+    int fd = open_segment_at(hunt_id, offset, &version, &local, &sealed);
+    if (fd == -1) {
+        return 0;
+    }
+
+    int ok = 0;
+    if (version == STORE_V1) {
+        // v1 has no flags: clearing the ID is the tombstone
+        char dead = '\0';
+        ok = pwrite(fd, &dead, 1, local + offsetof(Treasure, id)) == 1;
+    } else {
+        off_t flags_pos = local + offsetof(RecordHeader, flags);
+        uint8_t flags;
+        ok = pread(fd, &flags, 1, flags_pos) == 1;
+        flags |= RECORD_DEAD;
+        ok = ok && pwrite(fd, &flags, 1, flags_pos) == 1;
+    }
+    close(fd);
+    if (ok && sealed) {
+        touch_active(hunt_id);
+    }
+    return ok;
+}
+
+// ---- rewriting ----
+
+// Small buffered writer so rewrites do not issue one write() per record
+typedef struct {
+    int fd;
+    size_t used;
+    off_t written;
+    int ok;
+    char data[WRITE_BUFFER_SIZE];
+} WriteBuffer;
+
+static void wb_flush(WriteBuffer *wb) {
+    if (wb->ok && wb->used > 0 && write(wb->fd, wb->data, wb->used) != (ssize_t)wb->used) {
+        wb->ok = 0;
+    }
+    wb->written += (off_t)wb->used;
+    wb->used = 0;
+}
+
+static void wb_put(WriteBuffer *wb, const void *src, size_t len) {
+    if (wb->used + len > sizeof(wb->data)) {
+        wb_flush(wb);
+    }
+    memcpy(wb->data + wb->used, src, len);
+    wb->used += len;
+}
+
+static void view_to_treasure(const TreasureView *v, Treasure *t) {
+    memset(t, 0, sizeof(*t));
+    strncpy(t->id, v->id, ID_SIZE - 1);
+    strncpy(t->user_name, v->user_name, NAME_SIZE - 1);
+    strncpy(t->clue, v->clue, CLUE_SIZE - 1);
+    t->latitude = v->latitude;
+    t->longitude = v->longitude;
+    t->value = v->value;
+}
+
+typedef struct {
+    const char *hunt_id;
+    int version;
+    double threshold;
+    long *dropped;         // per segment, -1 = failed
+    int *rewritten;        // per segment
+} RewriteJob;
+
+// Rewrites one segment if it qualifies. A sealed segment has to end before
+// the next one starts; a v1 segment of long records could grow as v2 and is
+// then left as it is.
+static void rewrite_segment(const TreasureMap *map, size_t segment, void *arg) {
+    RewriteJob *job = arg;
+    const StoreSegment *seg = &map->segments[segment];
+    int version = job->version ? job->version : seg->version;
+
+    long live = 0, dead = 0;
+    TreasureView v;
+    for (size_t pos = 0; store_next_in(map, segment, &pos, &v); ) {
+        if (v.dead) {
+            dead++;
+        } else {
+            live++;
+        }
+    }
+    job->dropped[segment] = 0;
+    if (version == seg->version &&
+        (live + dead == 0 || (double)dead / (double)(live + dead) <= job->threshold)) {
+        return;
+    }
+
+    char name[NAME_MAX + 1], path[PATH_MAX], temp_path[PATH_MAX];
+    segment_name(name, sizeof(name), seg->number);
+    snprintf(path, sizeof(path), "%s/%s", job->hunt_id, name);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%d.tmp", job->hunt_id, name, (int)getpid());
+
+    WriteBuffer *wb = malloc(sizeof(WriteBuffer));
+    if (!wb) {
+        job->dropped[segment] = -1;
+        return;
+    }
+    wb->fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    wb->used = 0;
+    wb->written = 0;
+    wb->ok = wb->fd != -1;
+    if (!wb->ok) {
+        free(wb);
+        job->dropped[segment] = -1;
+        return;
+    }
+
+    if (version != STORE_V1) {
+        StoreHeader h;
+        init_header(&h, version, seg->base);
+        wb_put(wb, &h, sizeof(h));
+    }
+
+    char record[RECORD_MAX_SIZE];
+    for (size_t pos = 0; store_next_in(map, segment, &pos, &v); ) {
+        if (v.dead) {
+            continue;
+        } else if (seg->version == version) {
+            // same layout, copy the record bytes as they are
+            wb_put(wb, seg->data + (v.offset - seg->base), pos - (size_t)v.offset);
+        } else {
+            Treasure t;
+            view_to_treasure(&v, &t);
+            size_t len = store_encode(&t, version, record);
+            wb->ok = wb->ok && len > 0;
+            wb_put(wb, record, len);
+        }
+    }
+    wb_flush(wb);
+
+    int ok = wb->ok;
+    int fits = segment + 1 == map->count ||
+               seg->base + wb->written <= segment_start(&map->segments[segment + 1]);
+    close(wb->fd);
+    free(wb);
+
+    if (ok && !fits) {
+        unlink(temp_path);
+        return;
+    }
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        job->dropped[segment] = -1;
+        return;
+    }
+    job->dropped[segment] = dead;
+    job->rewritten[segment] = 1;
+}
+
+long store_rewrite(const char *hunt_id, int version, double threshold) {
+    TreasureMap map;
+    if (store_map(hunt_id, &map, STORE_SCAN) == -1) {
+        return -1;
+    }
+    if (map.count == 0) {
+        return 0;
+    }
+
+    RewriteJob job = { hunt_id, version, threshold, NULL, NULL };
+    job.dropped = calloc(map.count, sizeof(long));
+    job.rewritten = calloc(map.count, sizeof(int));
+    if (!job.dropped || !job.rewritten) {
+        free(job.dropped);
+        free(job.rewritten);
+        store_unmap(&map);
+        return -1;
+    }
+    store_scan(&map, rewrite_segment, &job);
+
+    long dropped = 0;
+    int sealed_changed = 0;
+    for (size_t i = 0; i < map.count; i++) {
+        if (job.dropped[i] == -1) {
+            dropped = -1;
+        } else if (dropped != -1) {
+            dropped += job.dropped[i];
+        }
+        sealed_changed |= job.rewritten[i] && map.segments[i].number != 0;
+    }
+    free(job.dropped);
+    free(job.rewritten);
+    store_unmap(&map);
+    if (sealed_changed) {
+        touch_active(hunt_id);
+    }
+    return dropped;
+}
@@ -0,0 +1,171 @@
+#ifndef TREASURE_STORE_H
+#define TREASURE_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "treasure.h"
+#include "treasure_users.h"
+
+// treasures.dat comes in three layouts:
+//  v1: raw Treasure structs back to back, no header (the original format)
+//  v2: a StoreHeader followed by compact records whose strings are stored
+//      with their real length instead of the fixed ID/NAME/CLUE sizes
+//  v3: v2 with the user stored as its users.dict ID instead of the name
+#define STORE_V1 1
+#define STORE_V2 2
+#define STORE_V3 3
+#define STORE_VERSION STORE_V3   // the layout new files get
+
+#define STORE_MAGIC "\x89THD"
+
+// Files written before segments have the 16 byte header without `base`
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t base;        // logical offset of the file's first byte
+} StoreHeader;
+
+#define STORE_HEADER_V2_SIZE 16
+
+// A hunt's records can span several segment files. treasures.dat is the
+// active segment that takes appends; once it reaches TREASURE_SEGMENT_MB it
+// is sealed under a numbered name and listed in the manifest, and a new
+// empty treasures.dat continues where it ended. Offsets (in the indexes,
+// TreasureView.offset, store_at) are logical: each segment's header holds
+// the offset its first byte has, so they keep growing across segments and
+// never change when one is sealed.
+#define SEGMENT_MANIFEST "treasures.seg"
+#define SEGMENT_NAME_FORMAT "treasures.%06u.dat"
+#define DEFAULT_SEGMENT_MB 64
+
+// v2 record: this header, then id, user_name and clue, each NUL terminated.
+// v3 record: this header with name_len 0, the uint32 user ID, then id and
+// clue. `length` covers the whole record and is padded to a multiple of 4.
+typedef struct {
+    uint16_t length;
+    uint8_t flags;
+    uint8_t id_len;      // lengths include the terminating NUL
+    uint8_t name_len;
+    uint8_t reserved;
+    uint16_t clue_len;
+    float latitude;
+    float longitude;
+    int32_t value;
+} RecordHeader;
+
+#define RECORD_DEAD 0x01
+#define RECORD_MAX_SIZE (sizeof(RecordHeader) + ID_SIZE + NAME_SIZE + CLUE_SIZE + 4)
+
+// One decoded record. The strings point into the mapping, nothing is copied.
+typedef struct {
+    off_t offset;        // where the record starts, as stored in the index
+    int dead;
+    const char *id;
+    const char *user_name;
+    uint32_t user_id;    // users.dict ID in v3, USER_NONE for older records
+    const char *clue;
+    float latitude;
+    float longitude;
+    int value;
+} TreasureView;
+
+// One mapped segment file
+typedef struct {
+    const char *data;
+    size_t size;         // mapped length in bytes
+    size_t data_start;   // first record (past the header from v2 on)
+    int version;
+    off_t base;          // logical offset of data[0]
+    ino_t inode;         // changes when the segment is compacted
+    unsigned number;     // sealed segment number, 0 for treasures.dat
+} StoreSegment;
+
+// Read-only, zero-copy view of a hunt's records over all its segments
+typedef struct {
+    StoreSegment *segments;  // sealed segments in order, treasures.dat last
+    size_t count;
+    size_t size;         // mapped bytes over all segments
+    off_t end;           // logical offset the next appended record gets
+    int version;         // layout of treasures.dat, used by new records
+} TreasureMap;
+
+// Access patterns, passed on to madvise()
+#define STORE_SCAN   0   // front-to-back pass over every record
+#define STORE_LOOKUP 1   // a few point reads through the index
+
+// 0 on success (an empty or missing file maps as an empty hunt in the
+// current layout), -1 on error
+int store_map(const char *hunt_id, TreasureMap *map, int access);
+void store_unmap(TreasureMap *map);
+
+// Iterates records, dead ones included: start with *pos = 0. *pos is a
+// logical offset. Returns 1 and fills out, or 0 at the end of the hunt or a
+// torn record in treasures.dat.
+int store_next(const TreasureMap *map, size_t *pos, TreasureView *out);
+
+// Same, over the records of one segment only
+int store_next_in(const TreasureMap *map, size_t segment, size_t *pos, TreasureView *out);
+
+// Record at a logical offset taken from the index; 0 if there is none
+int store_at(const TreasureMap *map, off_t offset, TreasureView *out);
+
+// The segment holding a logical offset (the first one for offsets before
+// any record), or NULL for an empty map
+const StoreSegment *store_segment_at(const TreasureMap *map, off_t offset);
+
+// Calls scan(map, segment, arg) once per segment, spread over up to
+// TREASURE_SCAN_THREADS threads (default: one per core). Each call gets its
+// own segment, so per-segment results need no locking; the caller merges
+// them once store_scan returns.
+void store_scan(const TreasureMap *map, void (*scan)(const TreasureMap *map, size_t segment, void *arg),
+                void *arg);
+
+// Opens treasures.dat for appending, creating it (as STORE_VERSION) if
+// needed and sealing it first if it is full. The caller holds the append
+// lock. Returns the fd and the file's version, or -1 on error.
+int store_open_append(const char *hunt_id, int *version);
+
+// For bulk writers that keep the fd from store_open_append() open: seals a
+// full segment and returns the fd of the new one (fd is closed), or fd
+// itself while there is room. Call between records. -1 on error.
+int store_roll(const char *hunt_id, int fd, int *version);
+
+// Version, logical base and first record position of an open segment
+// file; 0, or -1 on error
+int store_file_layout(int fd, int *version, off_t *base, size_t *data_start);
+
+// Logical offset the next record appended through fd gets, or -1
+off_t store_append_offset(int fd);
+
+// Logical end of the hunt's data (0 for a missing hunt). It only moves on
+// appends and compaction, so the index files use it as their stamp.
+int64_t store_data_end(const char *hunt_id);
+
+// 1 if a file name in a hunt directory holds records (treasures.dat, a
+// sealed segment or the manifest)
+int store_is_data_file(const char *name);
+
+// Appends one record in the file's own format (new files are created as
+// STORE_VERSION, v3). Returns 1 and the record offset, or 0 on error.
+int store_append(const char *hunt_id, const Treasure *t, off_t *offset);
+
+// Encodes a record for a file of the given version into buf, which must hold
+// RECORD_MAX_SIZE bytes. For v3 a new user is first added to users.dict.
+// Returns the encoded length, or 0 if the user could not be added.
+size_t store_encode(const Treasure *t, int version, char *buf);
+
+// Marks the record at offset as removed, in place. A record in a sealed
+// segment also touches treasures.dat, whose size and mtime stamp the hunt.
+int store_mark_dead(const char *hunt_id, off_t offset);
+
+// Rewrites, one segment at a time and in parallel, every segment more than
+// `threshold` dead, or not in `version` yet (0 keeps each segment's own),
+// without its dead records. Returns the number of records dropped, or -1
+// on error.
+long store_rewrite(const char *hunt_id, int version, double threshold);
+
+#endif
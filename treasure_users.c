@@ -0,0 +1,290 @@
+#define _GNU_SOURCE // F_OFD_SETLKW
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "treasure_users.h"
+
+#define USERS_MAGIC "TRUSR001"
+#define CHUNK_SHIFT 12
+#define CHUNK_SIZE (1u << CHUNK_SHIFT)   // names per chunk
+#define MAX_CHUNKS 4096                  // 16M users
+#define READ_BATCH 256                   // entries per pread
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t entry_size;
+} UsersHeader;
+
+// The names known to this process, by ID. Chunks are never moved or
+// freed, so users_name() hands out stable pointers and reads them without
+// the lock: a chunk is filled before `loaded` is raised past its IDs.
+static char (*chunks[MAX_CHUNKS])[NAME_SIZE];
+static _Atomic uint32_t loaded;
+
+// Open addressing index name -> ID + 1 (0 = empty), under users_lock
+static uint32_t *slots;
+static size_t slot_count;
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// "#<id>" names handed out by users_label(), under users_lock; never freed
+typedef struct Placeholder {
+    struct Placeholder *next;
+    uint32_t id;
+    char name[NAME_SIZE];
+} Placeholder;
+static Placeholder *placeholders;
+
+static char *entry(uint32_t id) {
+    return chunks[id >> CHUNK_SHIFT][id & (CHUNK_SIZE - 1)];
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < NAME_SIZE - 1 && name[i]; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t *find_slot(const char *name) {
+    size_t mask = slot_count - 1;
+    size_t slot = hash_name(name) & mask;
+    while (slots[slot] != 0 && strncmp(entry(slots[slot] - 1), name, NAME_SIZE - 1) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &slots[slot];
+}
+
+// Rebuilds the index over the first `count` IDs, at least twice as large
+static int reindex(uint32_t count) {
+    size_t size = 64;
+    while (size < ((size_t)count + 1) * 2) {
+        size *= 2;
+    }
+    uint32_t *more = calloc(size, sizeof(uint32_t));
+    if (!more) {
+        return -1;
+    }
+    free(slots);
+    slots = more;
+    slot_count = size;
+    for (uint32_t id = 0; id < count; id++) {
+        *find_slot(entry(id)) = id + 1;
+    }
+    return 0;
+}
+
+// Caller holds users_lock
+static uint32_t lookup(const char *name) {
+    if (slot_count == 0) {
+        return USER_NONE;
+    }
+    uint32_t slot = *find_slot(name);
+    return slot == 0 ? USER_NONE : slot - 1;
+}
+
+// Gives name the next ID in this process. Caller holds users_lock.
+static uint32_t add_local(const char *name) {
+    uint32_t id = atomic_load_explicit(&loaded, memory_order_relaxed);
+    if ((id >> CHUNK_SHIFT) >= MAX_CHUNKS) {
+        errno = EOVERFLOW;
+        return USER_NONE;
+    }
+    if (!chunks[id >> CHUNK_SHIFT] && !(chunks[id >> CHUNK_SHIFT] = calloc(CHUNK_SIZE, NAME_SIZE))) {
+        return USER_NONE;
+    }
+    if (((size_t)id + 1) * 2 > slot_count && reindex(id + 1) == -1) {
+        return USER_NONE;
+    }
+    char *e = entry(id);
+    memset(e, 0, NAME_SIZE);
+    strncpy(e, name, NAME_SIZE - 1);
+    *find_slot(e) = id + 1;
+    atomic_store_explicit(&loaded, id + 1, memory_order_release);
+    return id;
+}
+
+// Takes in the entries other processes added since the last read. A
+// missing or empty file has none. Caller holds users_lock. 0, or -1.
+static int read_new(int fd) {
+    UsersHeader h;
+    ssize_t n = pread(fd, &h, sizeof(h), 0);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != (ssize_t)sizeof(h) || memcmp(h.magic, USERS_MAGIC, sizeof(h.magic)) != 0 ||
+        h.entry_size != NAME_SIZE) {
+        errno = EPROTO;
+        return -1;
+    }
+    char batch[READ_BATCH][NAME_SIZE];
+    uint32_t id = atomic_load_explicit(&loaded, memory_order_relaxed);
+    while (id < h.count) {
+        uint32_t want = h.count - id < READ_BATCH ? h.count - id : READ_BATCH;
+        off_t pos = (off_t)sizeof(h) + (off_t)id * NAME_SIZE;
+        if (pread(fd, batch, (size_t)want * NAME_SIZE, pos) != (ssize_t)want * NAME_SIZE) {
+            errno = EPROTO;
+            return -1;
+        }
+        for (uint32_t i = 0; i < want; i++) {
+            batch[i][NAME_SIZE - 1] = '\0';
+            if (add_local(batch[i]) == USER_NONE) {
+                return -1;
+            }
+        }
+        id += want;
+    }
+    return 0;
+}
+
+// Caller holds users_lock
+static int refresh(void) {
+    int fd = open(USERS_FILE, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    int ret = read_new(fd);
+    close(fd);
+    return ret;
+}
+
+static int lock_file(int fd) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Appends the names not in the dictionary yet, under the file lock so
+// processes agree on the IDs. Caller holds users_lock. 0, or -1.
+static int append_new(const char (*names)[NAME_SIZE], size_t n) {
+    int fd = open(USERS_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (lock_file(fd) == -1 || read_new(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t first = atomic_load_explicit(&loaded, memory_order_relaxed);
+    int ok = 1;
+    for (size_t i = 0; ok && i < n; i++) {
+        if (lookup(names[i]) == USER_NONE) {
+            uint32_t id = add_local(names[i]);
+            ok = id != USER_NONE &&
+                 pwrite(fd, entry(id), NAME_SIZE, (off_t)sizeof(UsersHeader) + (off_t)id * NAME_SIZE) ==
+                 NAME_SIZE;
+        }
+    }
+    uint32_t count = atomic_load_explicit(&loaded, memory_order_relaxed);
+    if (ok && count > first) {
+        // The header goes last: a crash before it leaves entries past the
+        // count, which the next append overwrites
+        UsersHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, USERS_MAGIC, sizeof(h.magic));
+        h.count = count;
+        h.entry_size = NAME_SIZE;
+        ok = pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && fdatasync(fd) == 0;
+    }
+    if (!ok) {
+        // Forget the IDs other processes never saw, they may hand them out
+        int saved = errno;
+        atomic_store_explicit(&loaded, first, memory_order_release);
+        reindex(first);
+        errno = saved;
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+int users_intern_all(const char (*names)[NAME_SIZE], size_t n, uint32_t *ids) {
+    pthread_mutex_lock(&users_lock);
+    int missing = 0;
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = lookup(names[i]);
+        missing |= ids[i] == USER_NONE;
+    }
+    int ok = 1;
+    if (missing) {
+        ok = refresh() == 0 && append_new(names, n) == 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            ids[i] = lookup(names[i]);
+        }
+    }
+    pthread_mutex_unlock(&users_lock);
+    return ok ? 0 : -1;
+}
+
+uint32_t users_intern(const char *user_name) {
+    char name[1][NAME_SIZE];
+    memset(name, 0, sizeof(name));
+    strncpy(name[0], user_name, NAME_SIZE - 1);
+    uint32_t id;
+    return users_intern_all((const char (*)[NAME_SIZE])name, 1, &id) == 0 ? id : USER_NONE;
+}
+
+uint32_t users_find(const char *user_name) {
+    pthread_mutex_lock(&users_lock);
+    uint32_t id = lookup(user_name);
+    if (id == USER_NONE && refresh() == 0) {
+        id = lookup(user_name);
+    }
+    pthread_mutex_unlock(&users_lock);
+    return id;
+}
+
+const char *users_name(uint32_t id) {
+    if (id >= atomic_load_explicit(&loaded, memory_order_acquire)) {
+        // Written by another process since we last looked
+        pthread_mutex_lock(&users_lock);
+        refresh();
+        pthread_mutex_unlock(&users_lock);
+        if (id >= atomic_load_explicit(&loaded, memory_order_acquire)) {
+            return NULL;
+        }
+    }
+    return entry(id);
+}
+
+const char *users_label(uint32_t id) {
+    const char *name = users_name(id);
+    if (name) {
+        return name;
+    }
+    pthread_mutex_lock(&users_lock);
+    Placeholder *p = placeholders;
+    while (p && p->id != id) {
+        p = p->next;
+    }
+    if (!p && (p = malloc(sizeof(*p))) != NULL) {
+        p->id = id;
+        snprintf(p->name, sizeof(p->name), "#%u", id);
+        p->next = placeholders;
+        placeholders = p;
+    }
+    pthread_mutex_unlock(&users_lock);
+    return p ? p->name : "#?";
+}
+
+uint32_t users_count(void) {
+    pthread_mutex_lock(&users_lock);
+    refresh();
+    pthread_mutex_unlock(&users_lock);
+    return atomic_load_explicit(&loaded, memory_order_acquire);
+}
@@ -0,0 +1,41 @@
+#ifndef TREASURE_USERS_H
+#define TREASURE_USERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "treasure.h"
+
+// Dictionary of every user name in the directory's hunts, next to
+// hunts.cat. Each name gets a dense ID the first time it is written and
+// keeps it for good; v3 records store that ID instead of the name, scans
+// group by it, and the name is looked up again only for output.
+// users.dict is append only: a header, then one NAME_SIZE entry per ID.
+#define USERS_FILE "users.dict"
+
+#define USER_NONE UINT32_MAX     // a record that stores its user by name
+
+// ID of a user, added to users.dict (and synced) if it is new. USER_NONE
+// on error.
+uint32_t users_intern(const char *user_name);
+
+// The same for n names at once, with one sync for all the new ones.
+// Returns 0, or -1 on error.
+int users_intern_all(const char (*names)[NAME_SIZE], size_t n, uint32_t *ids);
+
+// ID of a user some record was written with, or USER_NONE
+uint32_t users_find(const char *user_name);
+
+// Name of an ID, or NULL if users.dict does not have it. The name stays
+// valid, at the same address, until the process exits.
+const char *users_name(uint32_t id);
+
+// Name of an ID for output: users_name(), or "#<id>" if users.dict lost
+// the entry, so such a user never turns into an empty name. Valid until
+// the process exits, like users_name().
+const char *users_label(uint32_t id);
+
+// Number of IDs handed out so far, to size per-user arrays. Records
+// written later can carry higher IDs.
+uint32_t users_count(void);
+
+#endif